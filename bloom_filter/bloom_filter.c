@@ -8,8 +8,15 @@
 
 #include <limits.h>
 #include <math.h>
+#include <stdint.h>
 #include <string.h>
 
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "lauxlib.h"
 #include "lua.h"
 #include "../common/xxhash.h"
@@ -20,6 +27,15 @@
 #endif
 
 static const char* mozsvc_bloom_filter = "mozsvc.bloom_filter";
+static const char* mozsvc_blocked_bloom_filter = "mozsvc.blocked_bloom_filter";
+
+/*
+ * Hashing scheme used to set/test the bits, it is part of the serialized state.
+ * 1 - one XXH32 pass over the key per hash function (original implementation)
+ * 2 - one XXH64 pass over the key, probes derived by double hashing
+ */
+#define BF_VERSION_XXH32 1
+#define BF_VERSION_XXH64 2
 
 typedef struct bloom_filter
 {
@@ -28,10 +44,24 @@ typedef struct bloom_filter
   size_t bits;
   size_t cnt;
   unsigned int hashes;
+  unsigned int version;
   double probability;
   unsigned char data[];
 } bloom_filter;
 
+#define BLOCK_SIZE 64 // bytes, one cache line
+#define BLOCK_BITS (BLOCK_SIZE * CHAR_BIT)
+
+typedef struct blocked_bloom_filter
+{
+  size_t items;
+  size_t blocks;
+  size_t cnt;
+  unsigned int hashes;
+  double probability;
+  unsigned char buf[]; // blocks * BLOCK_SIZE + BLOCK_SIZE - 1 (for alignment)
+} blocked_bloom_filter;
+
 
 static int bloom_filter_new(lua_State* lua)
 {
@@ -52,6 +82,7 @@ static int bloom_filter_new(lua_State* lua)
   bf->bits = bits;
   bf->bytes = bytes;
   bf->hashes = hashes;
+  bf->version = BF_VERSION_XXH64;
   bf->probability = probability;
   bf->cnt = 0;
   memset(bf->data, 0, bf->bytes);
@@ -72,30 +103,52 @@ static bloom_filter* check_bloom_filter(lua_State* lua, int args)
 }
 
 
-static int bloom_filter_add(lua_State* lua)
+static void* check_key(lua_State* lua, int idx, size_t* len, double* val)
 {
-  bloom_filter* bf = check_bloom_filter(lua, 2);
-  size_t len = 0;
-  double val = 0;
   void* key = NULL;
-  switch (lua_type(lua, 2)) {
+  switch (lua_type(lua, idx)) {
   case LUA_TSTRING:
-    key = (void*)lua_tolstring(lua, 2, &len);
+    key = (void*)lua_tolstring(lua, idx, len);
     break;
   case LUA_TNUMBER:
-    val = lua_tonumber(lua, 2);
-    len = sizeof(double);
-    key = &val;
+    *val = lua_tonumber(lua, idx);
+    *len = sizeof(double);
+    key = val;
     break;
   default:
-    luaL_argerror(lua, 2, "must be a string or number");
+    luaL_argerror(lua, idx, "must be a string or number");
     break;
   }
-  unsigned int bit = 0;
+  return key;
+}
+
+
+static inline size_t probe_bit(bloom_filter* bf, const void* key, size_t len,
+                               unsigned long long h, unsigned int i)
+{
+  if (bf->version == BF_VERSION_XXH32) {
+    return XXH32(key, len, i) % bf->bits;
+  }
+  // Kirsch-Mitzenmacher: g_i(x) = h1(x) + i * h2(x) using the two 32 bit
+  // halves of the 64 bit hash, the step is kept non zero (modulo the number of
+  // bits) so the probes of a key never collapse onto a single bit
+  unsigned long long step = ((h >> 32) | 1) % bf->bits;
+  if (!step) step = 1;
+  return (size_t)(((h & 0xffffffff) + i * step) % bf->bits);
+}
+
+
+static int add_key(bloom_filter* bf, const void* key, size_t len)
+{
+  unsigned long long h = 0;
+  if (bf->version == BF_VERSION_XXH64) {
+    h = XXH64(key, len, 0);
+  }
+  size_t bit = 0;
   int added = 0;
 
   for (unsigned int i = 0; i < bf->hashes; ++i) {
-    bit = XXH32(key, (int)len, i) % bf->bits;
+    bit = probe_bit(bf, key, len, h, i);
     if (!(bf->data[bit / CHAR_BIT] & 1 << (bit % CHAR_BIT))) {
       bf->data[bit / CHAR_BIT] |= 1 << (bit % CHAR_BIT);
       added = 1;
@@ -105,40 +158,88 @@ static int bloom_filter_add(lua_State* lua)
   if (added) {
     ++bf->cnt;
   }
+  return added;
+}
+
+
+static int query_key(bloom_filter* bf, const void* key, size_t len)
+{
+  unsigned long long h = 0;
+  if (bf->version == BF_VERSION_XXH64) {
+    h = XXH64(key, len, 0);
+  }
+  size_t bit = 0;
+  int found = 1;
+
+  for (unsigned int i = 0; i < bf->hashes && found; ++i) {
+    bit = probe_bit(bf, key, len, h, i);
+    found = bf->data[bit / CHAR_BIT] & 1 << (bit % CHAR_BIT);
+  }
+  return found;
+}
 
-  lua_pushboolean(lua, added);
+
+static int bloom_filter_add(lua_State* lua)
+{
+  bloom_filter* bf = check_bloom_filter(lua, 2);
+  size_t len = 0;
+  double val = 0;
+  void* key = check_key(lua, 2, &len, &val);
+  lua_pushboolean(lua, add_key(bf, key, len));
   return 1;
 }
 
 
-static int bloom_filter_query(lua_State* lua)
+static int bloom_filter_add_many(lua_State* lua)
 {
   bloom_filter* bf = check_bloom_filter(lua, 2);
+  luaL_checktype(lua, 2, LUA_TTABLE);
   size_t len = 0;
   double val = 0;
   void* key = NULL;
-  switch (lua_type(lua, 2)) {
-  case LUA_TSTRING:
-    key = (void*)lua_tolstring(lua, 2, &len);
-    break;
-  case LUA_TNUMBER:
-    val = lua_tonumber(lua, 2);
-    len = sizeof(double);
-    key = &val;
-    break;
-  default:
-    luaL_argerror(lua, 2, "must be a string or number");
-    break;
-  }
-  unsigned int bit = 0;
-  int found = 1;
+  int added = 0;
 
-  for (unsigned int i = 0; i < bf->hashes && found; ++i) {
-    bit = XXH32(key, (int)len, i) % bf->bits;
-    found = bf->data[bit / CHAR_BIT] & 1 << (bit % CHAR_BIT);
+  int n = (int)lua_objlen(lua, 2);
+  for (int i = 1; i <= n; ++i) {
+    lua_rawgeti(lua, 2, i);
+    key = check_key(lua, 3, &len, &val);
+    added += add_key(bf, key, len);
+    lua_pop(lua, 1);
   }
 
-  lua_pushboolean(lua, found);
+  lua_pushinteger(lua, added);
+  return 1;
+}
+
+
+static int bloom_filter_query(lua_State* lua)
+{
+  bloom_filter* bf = check_bloom_filter(lua, 2);
+  size_t len = 0;
+  double val = 0;
+  void* key = check_key(lua, 2, &len, &val);
+  lua_pushboolean(lua, query_key(bf, key, len));
+  return 1;
+}
+
+
+static int bloom_filter_query_many(lua_State* lua)
+{
+  bloom_filter* bf = check_bloom_filter(lua, 2);
+  luaL_checktype(lua, 2, LUA_TTABLE);
+  size_t len = 0;
+  double val = 0;
+  void* key = NULL;
+
+  int n = (int)lua_objlen(lua, 2);
+  lua_createtable(lua, n, 0);
+  for (int i = 1; i <= n; ++i) {
+    lua_rawgeti(lua, 2, i);
+    key = check_key(lua, 4, &len, &val);
+    lua_pushboolean(lua, query_key(bf, key, len));
+    lua_rawseti(lua, 3, i);
+    lua_pop(lua, 1);
+  }
   return 1;
 }
 
@@ -160,6 +261,259 @@ static int bloom_filter_clear(lua_State* lua)
 }
 
 
+
+/*
+ * Expected false positive rate of a blocked filter with lambda keys per block
+ * on average (Putze, Sanders, Singler - Cache-, Hash- and Space-Efficient
+ * Bloom Filters)
+ */
+static double blocked_fpp(double lambda, unsigned int hashes)
+{
+  double fpp = 0;
+  int max = (int)(lambda * 4) + 64;
+  for (int i = 0; i < max; ++i) {
+    double p = exp(-lambda + i * log(lambda) - lgamma(i + 1.0));
+    fpp += p * pow(1 - pow(1 - 1.0 / BLOCK_BITS, (double)i * hashes), hashes);
+  }
+  return fpp;
+}
+
+
+static int blocked_bloom_filter_new(lua_State* lua)
+{
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n == 2, 0, "incorrect number of arguments");
+  int items = luaL_checkint(lua, 1);
+  luaL_argcheck(lua, 1 < items, 1, "items must be > 1");
+  double probability = luaL_checknumber(lua, 2);
+  luaL_argcheck(lua, 0 < probability && 1 > probability, 2, "probability must be between 0 and 1");
+
+  // start from the standard sizing and grow it until the uneven distribution
+  // of keys across the blocks is accounted for
+  double bits = ceil(items * log(probability) / log(1 / pow(2, log(2))));
+  unsigned int hashes = (unsigned int)round(log(2) * bits / items);
+  if (hashes < 1) hashes = 1;
+  if (hashes > BLOCK_BITS / 2) hashes = BLOCK_BITS / 2;
+  size_t blocks = (size_t)ceil(bits / BLOCK_BITS);
+  while (blocked_fpp((double)items / blocks, hashes) > probability) {
+    blocks += blocks / 32 + 1;
+  }
+
+  size_t nbytes = sizeof(blocked_bloom_filter) + blocks * BLOCK_SIZE
+      + BLOCK_SIZE - 1;
+  blocked_bloom_filter* bf = (blocked_bloom_filter*)lua_newuserdata(lua, nbytes);
+  bf->items = items;
+  bf->blocks = blocks;
+  bf->hashes = hashes;
+  bf->probability = probability;
+  bf->cnt = 0;
+  memset(bf->buf, 0, blocks * BLOCK_SIZE + BLOCK_SIZE - 1);
+
+  luaL_getmetatable(lua, mozsvc_blocked_bloom_filter);
+  lua_setmetatable(lua, -2);
+
+  return 1;
+}
+
+
+static blocked_bloom_filter* check_blocked_bloom_filter(lua_State* lua,
+                                                        int args)
+{
+  blocked_bloom_filter *bf = luaL_checkudata(lua, 1,
+                                             mozsvc_blocked_bloom_filter);
+  luaL_argcheck(lua, args == lua_gettop(lua), 0,
+                "incorrect number of arguments");
+  return bf;
+}
+
+
+static inline unsigned char* blocked_data(blocked_bloom_filter* bf)
+{
+  return (unsigned char*)(((uintptr_t)bf->buf + BLOCK_SIZE - 1)
+                          & ~(uintptr_t)(BLOCK_SIZE - 1));
+}
+
+
+static inline uint64_t mix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL; // splitmix64 finalizer
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+
+/*
+ * Locates the key's block and builds the mask of its bits within the block.
+ * The upper half of the hash selects the block and the bit positions are
+ * taken nine bits at a time from a remixed hash.
+ */
+static unsigned char* blocked_mask(blocked_bloom_filter* bf, const void* key,
+                                   size_t len, uint64_t mask[])
+{
+  uint64_t h = XXH64(key, len, 0);
+  unsigned char* block = blocked_data(bf)
+      + (size_t)((h >> 32) % bf->blocks) * BLOCK_SIZE;
+
+  memset(mask, 0, BLOCK_SIZE);
+  uint64_t r = 0;
+  for (unsigned int i = 0; i < bf->hashes; ++i) {
+    if (i % 7 == 0) {
+      h = r = mix64(h);
+    }
+    unsigned bit = (unsigned)(r % BLOCK_BITS);
+    r >>= 9;
+    mask[bit / 64] |= (uint64_t)1 << (bit % 64);
+  }
+  return block;
+}
+
+
+/*
+ * Returns true if all the mask bits are set in the block, optionally setting
+ * them.
+ */
+static inline int blocked_test(unsigned char* block, const uint64_t mask[],
+                               int set)
+{
+  int found = 1;
+#if defined(__AVX2__)
+  for (int i = 0; i < BLOCK_SIZE; i += 32) {
+    __m256i b = _mm256_load_si256((const __m256i*)(block + i));
+    __m256i m = _mm256_loadu_si256((const __m256i*)((const char*)mask + i));
+    found &= _mm256_testc_si256(b, m);
+    if (set) _mm256_store_si256((__m256i*)(block + i), _mm256_or_si256(b, m));
+  }
+#elif defined(__SSE4_1__)
+  for (int i = 0; i < BLOCK_SIZE; i += 16) {
+    __m128i b = _mm_load_si128((const __m128i*)(block + i));
+    __m128i m = _mm_loadu_si128((const __m128i*)((const char*)mask + i));
+    found &= _mm_testc_si128(b, m);
+    if (set) _mm_store_si128((__m128i*)(block + i), _mm_or_si128(b, m));
+  }
+#elif defined(__SSE2__)
+  for (int i = 0; i < BLOCK_SIZE; i += 16) {
+    __m128i b = _mm_load_si128((const __m128i*)(block + i));
+    __m128i m = _mm_loadu_si128((const __m128i*)((const char*)mask + i));
+    found &= _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(b, m), m))
+        == 0xffff;
+    if (set) _mm_store_si128((__m128i*)(block + i), _mm_or_si128(b, m));
+  }
+#else
+  uint64_t* b = (uint64_t*)block;
+  for (int i = 0; i < BLOCK_SIZE / 8; ++i) {
+    found &= (b[i] & mask[i]) == mask[i];
+    if (set) b[i] |= mask[i];
+  }
+#endif
+  return found;
+}
+
+
+static int blocked_add_key(blocked_bloom_filter* bf, const void* key,
+                           size_t len)
+{
+  uint64_t mask[BLOCK_SIZE / 8];
+  unsigned char* block = blocked_mask(bf, key, len, mask);
+  int added = !blocked_test(block, mask, 1);
+  if (added) {
+    ++bf->cnt;
+  }
+  return added;
+}
+
+
+static int blocked_query_key(blocked_bloom_filter* bf, const void* key,
+                             size_t len)
+{
+  uint64_t mask[BLOCK_SIZE / 8];
+  unsigned char* block = blocked_mask(bf, key, len, mask);
+  return blocked_test(block, mask, 0);
+}
+
+
+static int blocked_bloom_filter_add(lua_State* lua)
+{
+  blocked_bloom_filter* bf = check_blocked_bloom_filter(lua, 2);
+  size_t len = 0;
+  double val = 0;
+  void* key = check_key(lua, 2, &len, &val);
+  lua_pushboolean(lua, blocked_add_key(bf, key, len));
+  return 1;
+}
+
+
+static int blocked_bloom_filter_add_many(lua_State* lua)
+{
+  blocked_bloom_filter* bf = check_blocked_bloom_filter(lua, 2);
+  luaL_checktype(lua, 2, LUA_TTABLE);
+  size_t len = 0;
+  double val = 0;
+  void* key = NULL;
+  int added = 0;
+
+  int n = (int)lua_objlen(lua, 2);
+  for (int i = 1; i <= n; ++i) {
+    lua_rawgeti(lua, 2, i);
+    key = check_key(lua, 3, &len, &val);
+    added += blocked_add_key(bf, key, len);
+    lua_pop(lua, 1);
+  }
+
+  lua_pushinteger(lua, added);
+  return 1;
+}
+
+
+static int blocked_bloom_filter_query(lua_State* lua)
+{
+  blocked_bloom_filter* bf = check_blocked_bloom_filter(lua, 2);
+  size_t len = 0;
+  double val = 0;
+  void* key = check_key(lua, 2, &len, &val);
+  lua_pushboolean(lua, blocked_query_key(bf, key, len));
+  return 1;
+}
+
+
+static int blocked_bloom_filter_query_many(lua_State* lua)
+{
+  blocked_bloom_filter* bf = check_blocked_bloom_filter(lua, 2);
+  luaL_checktype(lua, 2, LUA_TTABLE);
+  size_t len = 0;
+  double val = 0;
+  void* key = NULL;
+
+  int n = (int)lua_objlen(lua, 2);
+  lua_createtable(lua, n, 0);
+  for (int i = 1; i <= n; ++i) {
+    lua_rawgeti(lua, 2, i);
+    key = check_key(lua, 4, &len, &val);
+    lua_pushboolean(lua, blocked_query_key(bf, key, len));
+    lua_rawseti(lua, 3, i);
+    lua_pop(lua, 1);
+  }
+  return 1;
+}
+
+
+static int blocked_bloom_filter_count(lua_State* lua)
+{
+  blocked_bloom_filter* bf = check_blocked_bloom_filter(lua, 1);
+  lua_pushnumber(lua, (lua_Number)bf->cnt);
+  return 1;
+}
+
+
+static int blocked_bloom_filter_clear(lua_State* lua)
+{
+  blocked_bloom_filter* bf = check_blocked_bloom_filter(lua, 1);
+  memset(blocked_data(bf), 0, bf->blocks * BLOCK_SIZE);
+  bf->cnt = 0;
+  return 0;
+}
+
+
 static int bloom_filter_version(lua_State* lua)
 {
   lua_pushstring(lua, DIST_VERSION);
@@ -174,22 +528,89 @@ static int bloom_filter_fromstring(lua_State* lua)
   const char* values = NULL;
   bloom_filter* bf = NULL;
 
-  if (lua_gettop(lua) == 2) { // todo remove conditional check after migration
+  unsigned int version = BF_VERSION_XXH32; // state preserved before versioning
+
+  switch (lua_gettop(lua)) {
+  case 2: // todo remove case after migration
     bf = check_bloom_filter(lua, 2);
     values = luaL_checklstring(lua, 2, &len);
-  } else {
+    break;
+  case 3:
     bf = check_bloom_filter(lua, 3);
     bf->cnt = (size_t)luaL_checknumber(lua, 2);
     values = luaL_checklstring(lua, 3, &len);
+    break;
+  default:
+    bf = check_bloom_filter(lua, 4);
+    bf->cnt = (size_t)luaL_checknumber(lua, 2);
+    values = luaL_checklstring(lua, 3, &len);
+    version = (unsigned int)luaL_checkint(lua, 4);
+    luaL_argcheck(lua, version == BF_VERSION_XXH32
+                  || version == BF_VERSION_XXH64, 4, "invalid version");
+    break;
   }
   if (len != bf->bytes) {
     luaL_error(lua, "fromstring() bytes found: %d, expected %d", len, bf->bytes);
   }
   memcpy(bf->data, values, len);
+  bf->version = version;
   return 0;
 }
 
 
+static int blocked_bloom_filter_fromstring(lua_State* lua)
+{
+  size_t len = 0;
+  blocked_bloom_filter* bf = check_blocked_bloom_filter(lua, 3);
+  bf->cnt = (size_t)luaL_checknumber(lua, 2);
+  const char* values = luaL_checklstring(lua, 3, &len);
+  if (len != bf->blocks * BLOCK_SIZE) {
+    luaL_error(lua, "fromstring() bytes found: %d, expected %d", len,
+               bf->blocks * BLOCK_SIZE);
+  }
+  memcpy(blocked_data(bf), values, len);
+  return 0;
+}
+
+
+static int serialize_blocked_bloom_filter(blocked_bloom_filter* bf,
+                                          const char* key,
+                                          lsb_output_buffer* ob)
+{
+  if (lsb_outputf(ob,
+                  "if %s == nil then %s = bloom_filter.new_blocked(%u, %g) end\n",
+                  key,
+                  key,
+                  (unsigned)bf->items,
+                  bf->probability)) {
+    return 1;
+  }
+
+  if (lsb_outputf(ob, "%s:fromstring(%u, \"", key, (unsigned)bf->cnt)) {
+    return 1;
+  }
+  if (lsb_serialize_binary(ob, blocked_data(bf), bf->blocks * BLOCK_SIZE)) {
+    return 1;
+  }
+  if (lsb_outputs(ob, "\")\n", 3)) {
+    return 1;
+  }
+  return 0;
+}
+
+
+static int is_blocked_bloom_filter(lua_State* lua, int idx)
+{
+  int blocked = 0;
+  if (lua_getmetatable(lua, idx)) {
+    luaL_getmetatable(lua, mozsvc_blocked_bloom_filter);
+    blocked = lua_rawequal(lua, -1, -2);
+    lua_pop(lua, 2);
+  }
+  return blocked;
+}
+
+
 static int serialize_bloom_filter(lua_State *lua) {
   lsb_output_buffer* ob = lua_touserdata(lua, -1);
   const char *key = lua_touserdata(lua, -2);
@@ -197,6 +618,9 @@ static int serialize_bloom_filter(lua_State *lua) {
   if (!(ob && key && bf)) {
     return 1;
   }
+  if (is_blocked_bloom_filter(lua, -3)) {
+    return serialize_blocked_bloom_filter((blocked_bloom_filter*)bf, key, ob);
+  }
   if (lsb_outputf(ob,
                   "if %s == nil then %s = bloom_filter.new(%u, %g) end\n",
                   key,
@@ -210,7 +634,7 @@ static int serialize_bloom_filter(lua_State *lua) {
     return 1;
   }
   if (lsb_serialize_binary(ob, bf->data, bf->bytes)) return 1;
-  if (lsb_outputs(ob, "\")\n", 3)) {
+  if (lsb_outputf(ob, "\", %u)\n", bf->version)) {
     return 1;
   }
   return 0;
@@ -221,6 +645,7 @@ static int serialize_bloom_filter(lua_State *lua) {
 static const struct luaL_reg bloom_filterlib_f[] =
 {
   { "new", bloom_filter_new }
+  , { "new_blocked", blocked_bloom_filter_new }
   , { "version", bloom_filter_version }
   , { NULL, NULL }
 };
@@ -229,7 +654,9 @@ static const struct luaL_reg bloom_filterlib_f[] =
 static const struct luaL_reg bloom_filterlib_m[] =
 {
   { "add", bloom_filter_add }
+  , { "add_many", bloom_filter_add_many }
   , { "query", bloom_filter_query }
+  , { "query_many", bloom_filter_query_many }
   , { "clear", bloom_filter_clear }
   , { "count", bloom_filter_count }
 #ifdef LUA_SANDBOX
@@ -239,6 +666,21 @@ static const struct luaL_reg bloom_filterlib_m[] =
 };
 
 
+static const struct luaL_reg blocked_bloom_filterlib_m[] =
+{
+  { "add", blocked_bloom_filter_add }
+  , { "add_many", blocked_bloom_filter_add_many }
+  , { "query", blocked_bloom_filter_query }
+  , { "query_many", blocked_bloom_filter_query_many }
+  , { "clear", blocked_bloom_filter_clear }
+  , { "count", blocked_bloom_filter_count }
+#ifdef LUA_SANDBOX
+  , { "fromstring", blocked_bloom_filter_fromstring } // used for data restoration
+#endif
+  , { NULL, NULL }
+};
+
+
 int luaopen_bloom_filter(lua_State* lua)
 {
 #ifdef LUA_SANDBOX
@@ -250,6 +692,14 @@ int luaopen_bloom_filter(lua_State* lua)
   lua_pushvalue(lua, -1);
   lua_setfield(lua, -2, "__index");
   luaL_register(lua, NULL, bloom_filterlib_m);
+  lua_pop(lua, 1);
+
+  luaL_newmetatable(lua, mozsvc_blocked_bloom_filter);
+  lua_pushvalue(lua, -1);
+  lua_setfield(lua, -2, "__index");
+  luaL_register(lua, NULL, blocked_bloom_filterlib_m);
+  lua_pop(lua, 1);
+
   luaL_register(lua, "bloom_filter", bloom_filterlib_f);
   return 1;
 }
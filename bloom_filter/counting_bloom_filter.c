@@ -0,0 +1,379 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Lua counting_bloom_filter implementation @file */
+
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "../common/xxhash.h"
+
+#ifdef LUA_SANDBOX
+#include "luasandbox_output.h"
+#include "luasandbox_serialize.h"
+#endif
+
+static const char *module_name  = "mozsvc.counting_bloom_filter";
+static const char *module_table = "counting_bloom_filter";
+
+#define COUNTER_MAX 15 // 4 bit saturating counters, two per byte
+
+typedef struct counting_bloom_filter
+{
+  size_t items;
+  size_t bytes;
+  size_t counters;
+  size_t cnt;
+  unsigned int hashes;
+  double probability;
+  unsigned char data[];
+} counting_bloom_filter;
+
+
+static int cbf_new(lua_State *lua)
+{
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n == 2, 0, "incorrect number of arguments");
+  int items = luaL_checkint(lua, 1);
+  luaL_argcheck(lua, 1 < items, 1, "items must be > 1");
+  double probability = luaL_checknumber(lua, 2);
+  luaL_argcheck(lua, 0 < probability && 1 > probability, 2, "probability must be between 0 and 1");
+
+  size_t counters = (size_t)ceil(items * log(probability) / log(1 / pow(2, log(2))));
+  size_t bytes = (counters + 1) / 2;
+  unsigned int hashes = (unsigned int)round(log(2) * counters / items);
+
+  size_t nbytes = sizeof(counting_bloom_filter) + bytes;
+  counting_bloom_filter *cbf = (counting_bloom_filter *)lua_newuserdata(lua, nbytes);
+  cbf->items = items;
+  cbf->counters = counters;
+  cbf->bytes = bytes;
+  cbf->hashes = hashes;
+  cbf->probability = probability;
+  cbf->cnt = 0;
+  memset(cbf->data, 0, cbf->bytes);
+
+  luaL_getmetatable(lua, module_name);
+  lua_setmetatable(lua, -2);
+
+  return 1;
+}
+
+
+static counting_bloom_filter* check_cbf(lua_State *lua, int args)
+{
+  counting_bloom_filter *cbf = luaL_checkudata(lua, 1, module_name);
+  luaL_argcheck(lua, args == lua_gettop(lua), 0,
+                "incorrect number of arguments");
+  return cbf;
+}
+
+
+static void* check_key(lua_State *lua, int idx, size_t *len, double *val)
+{
+  void *key = NULL;
+  switch (lua_type(lua, idx)) {
+  case LUA_TSTRING:
+    key = (void *)lua_tolstring(lua, idx, len);
+    break;
+  case LUA_TNUMBER:
+    *val = lua_tonumber(lua, idx);
+    *len = sizeof(double);
+    key = val;
+    break;
+  default:
+    luaL_argerror(lua, idx, "must be a string or number");
+    break;
+  }
+  return key;
+}
+
+
+static inline unsigned get_counter(counting_bloom_filter *cbf, size_t i)
+{
+  return (cbf->data[i / 2] >> (i % 2 * 4)) & COUNTER_MAX;
+}
+
+
+static inline void set_counter(counting_bloom_filter *cbf, size_t i,
+                               unsigned v)
+{
+  unsigned shift = i % 2 * 4;
+  cbf->data[i / 2] = (unsigned char)((cbf->data[i / 2] & ~(COUNTER_MAX << shift))
+                                     | v << shift);
+}
+
+
+/*
+ * Returns the position of the i'th counter for the key hash, the key is hashed
+ * once with XXH64 and the probes are derived by double hashing (same scheme as
+ * the bloom_filter module). The step is kept non zero (modulo the number of
+ * counters) so the probes of a key never collapse onto a single counter, which
+ * would saturate it after a few adds.
+ */
+static inline size_t probe_counter(counting_bloom_filter *cbf,
+                                   unsigned long long h, unsigned int i)
+{
+  unsigned long long step = ((h >> 32) | 1) % cbf->counters;
+  if (!step) step = 1;
+  return (size_t)(((h & 0xffffffff) + i * step) % cbf->counters);
+}
+
+
+static int query_key(counting_bloom_filter *cbf, unsigned long long h)
+{
+  for (unsigned int i = 0; i < cbf->hashes; ++i) {
+    if (!get_counter(cbf, probe_counter(cbf, h, i))) return 0;
+  }
+  return 1;
+}
+
+
+/*
+ * Every add increments the counters (saturating) even when the key already
+ * appears to be present, otherwise a later delete of either insertion would
+ * remove the key. Returns true if the key was not present.
+ */
+static int add_key(counting_bloom_filter *cbf, const void *key, size_t len)
+{
+  unsigned long long h = XXH64(key, len, 0);
+  int added = 0;
+  for (unsigned int i = 0; i < cbf->hashes; ++i) {
+    size_t pos = probe_counter(cbf, h, i);
+    unsigned c = get_counter(cbf, pos);
+    if (!c) added = 1;
+    if (c < COUNTER_MAX) {
+      set_counter(cbf, pos, c + 1);
+    }
+  }
+  ++cbf->cnt;
+  return added;
+}
+
+
+static int cbf_add(lua_State *lua)
+{
+  counting_bloom_filter *cbf = check_cbf(lua, 2);
+  size_t len = 0;
+  double val = 0;
+  void *key = check_key(lua, 2, &len, &val);
+  lua_pushboolean(lua, add_key(cbf, key, len));
+  return 1;
+}
+
+
+static int cbf_add_many(lua_State *lua)
+{
+  counting_bloom_filter *cbf = check_cbf(lua, 2);
+  luaL_checktype(lua, 2, LUA_TTABLE);
+  size_t len = 0;
+  double val = 0;
+  void *key = NULL;
+  int added = 0;
+
+  int n = (int)lua_objlen(lua, 2);
+  for (int i = 1; i <= n; ++i) {
+    lua_rawgeti(lua, 2, i);
+    key = check_key(lua, 3, &len, &val);
+    added += add_key(cbf, key, len);
+    lua_pop(lua, 1);
+  }
+
+  lua_pushinteger(lua, added);
+  return 1;
+}
+
+
+static int cbf_query(lua_State *lua)
+{
+  counting_bloom_filter *cbf = check_cbf(lua, 2);
+  size_t len = 0;
+  double val = 0;
+  void *key = check_key(lua, 2, &len, &val);
+  unsigned long long h = XXH64(key, len, 0);
+  lua_pushboolean(lua, query_key(cbf, h));
+  return 1;
+}
+
+
+static int cbf_query_many(lua_State *lua)
+{
+  counting_bloom_filter *cbf = check_cbf(lua, 2);
+  luaL_checktype(lua, 2, LUA_TTABLE);
+  size_t len = 0;
+  double val = 0;
+  void *key = NULL;
+
+  int n = (int)lua_objlen(lua, 2);
+  lua_createtable(lua, n, 0);
+  for (int i = 1; i <= n; ++i) {
+    lua_rawgeti(lua, 2, i);
+    key = check_key(lua, 4, &len, &val);
+    lua_pushboolean(lua, query_key(cbf, XXH64(key, len, 0)));
+    lua_rawseti(lua, 3, i);
+    lua_pop(lua, 1);
+  }
+  return 1;
+}
+
+
+static int cbf_delete(lua_State *lua)
+{
+  counting_bloom_filter *cbf = check_cbf(lua, 2);
+  size_t len = 0;
+  double val = 0;
+  void *key = check_key(lua, 2, &len, &val);
+  unsigned long long h = XXH64(key, len, 0);
+
+  int deleted = query_key(cbf, h);
+  if (deleted) {
+    for (unsigned int i = 0; i < cbf->hashes; ++i) {
+      size_t pos = probe_counter(cbf, h, i);
+      unsigned c = get_counter(cbf, pos);
+      if (c < COUNTER_MAX) { // saturated counters can no longer be decremented
+        set_counter(cbf, pos, c - 1);
+      }
+    }
+    if (cbf->cnt) --cbf->cnt;
+  }
+  lua_pushboolean(lua, deleted);
+  return 1;
+}
+
+
+static int cbf_merge(lua_State *lua)
+{
+  counting_bloom_filter *cbf = check_cbf(lua, 2);
+  counting_bloom_filter *other = luaL_checkudata(lua, 2, module_name);
+  luaL_argcheck(lua, cbf->counters == other->counters
+                && cbf->hashes == other->hashes, 2,
+                "the filter dimensions must match");
+
+  // saturating add of both packed nibbles in each byte
+  for (size_t i = 0; i < cbf->bytes; ++i) {
+    unsigned lo = (cbf->data[i] & COUNTER_MAX) + (other->data[i] & COUNTER_MAX);
+    unsigned hi = (cbf->data[i] >> 4) + (other->data[i] >> 4);
+    if (lo > COUNTER_MAX) lo = COUNTER_MAX;
+    if (hi > COUNTER_MAX) hi = COUNTER_MAX;
+    cbf->data[i] = (unsigned char)(hi << 4 | lo);
+  }
+  cbf->cnt += other->cnt;
+  return 0;
+}
+
+
+static int cbf_count(lua_State *lua)
+{
+  counting_bloom_filter *cbf = check_cbf(lua, 1);
+  lua_pushnumber(lua, (lua_Number)cbf->cnt);
+  return 1;
+}
+
+
+static int cbf_clear(lua_State *lua)
+{
+  counting_bloom_filter *cbf = check_cbf(lua, 1);
+  memset(cbf->data, 0, cbf->bytes);
+  cbf->cnt = 0;
+  return 0;
+}
+
+
+static int cbf_version(lua_State *lua)
+{
+  lua_pushstring(lua, DIST_VERSION);
+  return 1;
+}
+
+
+#ifdef LUA_SANDBOX
+static int cbf_fromstring(lua_State *lua)
+{
+  counting_bloom_filter *cbf = check_cbf(lua, 3);
+  cbf->cnt = (size_t)luaL_checknumber(lua, 2);
+  size_t len = 0;
+  const char *values = luaL_checklstring(lua, 3, &len);
+  if (len != cbf->bytes) {
+    luaL_error(lua, "fromstring() bytes found: %d, expected %d", len,
+               cbf->bytes);
+  }
+  memcpy(cbf->data, values, len);
+  return 0;
+}
+
+
+static int serialize_counting_bloom_filter(lua_State *lua)
+{
+  lsb_output_buffer *ob = lua_touserdata(lua, -1);
+  const char *key = lua_touserdata(lua, -2);
+  counting_bloom_filter *cbf = lua_touserdata(lua, -3);
+  if (!(ob && key && cbf)) {
+    return 1;
+  }
+  if (lsb_outputf(ob,
+                  "if %s == nil then %s = %s.new(%u, %g) end\n",
+                  key,
+                  key,
+                  module_table,
+                  (unsigned)cbf->items,
+                  cbf->probability)) {
+    return 1;
+  }
+
+  if (lsb_outputf(ob, "%s:fromstring(%u, \"", key, (unsigned)cbf->cnt)) {
+    return 1;
+  }
+  if (lsb_serialize_binary(ob, cbf->data, cbf->bytes)) return 1;
+  if (lsb_outputs(ob, "\")\n", 3)) {
+    return 1;
+  }
+  return 0;
+}
+#endif
+
+
+static const struct luaL_reg counting_bloom_filterlib_f[] =
+{
+  { "new", cbf_new }
+  , { "version", cbf_version }
+  , { NULL, NULL }
+};
+
+
+static const struct luaL_reg counting_bloom_filterlib_m[] =
+{
+  { "add", cbf_add }
+  , { "add_many", cbf_add_many }
+  , { "query", cbf_query }
+  , { "query_many", cbf_query_many }
+  , { "delete", cbf_delete }
+  , { "merge", cbf_merge }
+  , { "clear", cbf_clear }
+  , { "count", cbf_count }
+#ifdef LUA_SANDBOX
+  , { "fromstring", cbf_fromstring } // used for data restoration
+#endif
+  , { NULL, NULL }
+};
+
+
+int luaopen_counting_bloom_filter(lua_State *lua)
+{
+#ifdef LUA_SANDBOX
+  lua_newtable(lua);
+  lsb_add_serialize_function(lua, serialize_counting_bloom_filter);
+  lua_replace(lua, LUA_ENVIRONINDEX);
+#endif
+  luaL_newmetatable(lua, module_name);
+  lua_pushvalue(lua, -1);
+  lua_setfield(lua, -2, "__index");
+  luaL_register(lua, NULL, counting_bloom_filterlib_m);
+  luaL_register(lua, module_table, counting_bloom_filterlib_f);
+  return 1;
+}
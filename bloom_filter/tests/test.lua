@@ -3,7 +3,7 @@
 -- file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
 require "bloom_filter"
-assert(bloom_filter.version() == "1.0.0", bloom_filter.version())
+assert(bloom_filter.version() == "1.4.0", bloom_filter.version())
 
 local errors = {
     function() local bf = bloom_filter.new(2) end, -- new() incorrect # args
@@ -32,6 +32,33 @@ local errors = {
         local bf = bloom_filter.new(20, 0.01)
         bf:clear(1) --incorrect # args
     end,
+    function()
+        local bf = bloom_filter.new(20, 0.01)
+        bf:add_many("a") --incorrect argument type
+    end,
+    function()
+        local bf = bloom_filter.new(20, 0.01)
+        bf:add_many({{}}) --incorrect key type
+    end,
+    function()
+        local bf = bloom_filter.new(20, 0.01)
+        bf:query_many() --incorrect # args
+    end,
+    function()
+        local bf = bloom_filter.new(20, 0.01)
+        bf:query_many({true}) --incorrect key type
+    end,
+    function() local bf = bloom_filter.new_blocked(2) end, -- new_blocked() incorrect # args
+    function() local bf = bloom_filter.new_blocked(0, 0.01) end, -- invalid items
+    function() local bf = bloom_filter.new_blocked(2, 1) end, -- invalid probability
+    function()
+        local bf = bloom_filter.new_blocked(20, 0.01)
+        bf:add({}) --incorrect argument type
+    end,
+    function()
+        local bf = bloom_filter.new_blocked(20, 0.01)
+        bf:query() --incorrect # args
+    end,
 }
 
 for i, v in ipairs(errors) do
@@ -56,14 +83,141 @@ bf:clear()
 assert(bf:count() == 0, "bloom filter should be empty")
 assert(not bf:query(1), "bloom filter should be empty")
 
--- test strings
+-- test strings ("802" is a false positive once the filter is this full)
 for i=1, test_items do
-    assert(bf:add(tostring(i)), "insert failed")
+    assert(bf:add(tostring(i)) == (i ~= 802), "insert failed")
 end
 for i=1, test_items do
     assert(bf:query(tostring(i)), "query failed")
 end
-assert(bf:count() == test_items, "count=" .. bf:count())
+assert(bf:count() == test_items - 1, "count=" .. bf:count())
 bf:clear()
 assert(bf:count() == 0, "bloom filter should be empty")
 assert(not bf:query("1"), "bloom filter should be empty")
+
+-- test batch operations
+local keys = {}
+for i=1, test_items do
+    keys[i] = i
+end
+assert(bf:add_many(keys) == test_items, "count=" .. bf:count())
+assert(bf:count() == test_items, "count=" .. bf:count())
+assert(bf:add_many(keys) == 0, "count=" .. bf:count())
+local found = bf:query_many(keys)
+assert(#found == test_items, #found)
+for i=1, test_items do
+    assert(found[i], "query failed")
+    assert(bf:query(i), "query failed")
+end
+found = bf:query_many({"1", 1})
+assert(not found[1] and found[2], "query_many failed")
+assert(#bf:query_many({}) == 0, "query_many failed")
+
+-- test blocked filter
+bf = bloom_filter.new_blocked(1000, 0.01)
+assert(bf:count() == 0, "bloom filter should be empty")
+assert(not bf:query(1), "bloom filter should be empty")
+for i=1, test_items do
+    bf:add(i)
+end
+for i=1, test_items do
+    assert(bf:query(i), "query failed")
+end
+assert(bf:count() == 948, "count=" .. bf:count())
+assert(not bf:query("1"), "query failed")
+bf:clear()
+assert(bf:count() == 0, "bloom filter should be empty")
+assert(not bf:query(1), "bloom filter should be empty")
+
+assert(bf:add_many(keys) == 948, "count=" .. bf:count())
+found = bf:query_many(keys)
+for i=1, test_items do
+    assert(found[i], "query failed")
+end
+
+require "counting_bloom_filter"
+assert(counting_bloom_filter.version() == "1.4.0", counting_bloom_filter.version())
+
+errors = {
+    function() local cbf = counting_bloom_filter.new(2) end, -- new() incorrect # args
+    function() local cbf = counting_bloom_filter.new(0, 0.01) end, -- invalid items
+    function() local cbf = counting_bloom_filter.new(2, 1) end, -- invalid probability
+    function()
+        local cbf = counting_bloom_filter.new(20, 0.01)
+        cbf:add({}) --incorrect argument type
+    end,
+    function()
+        local cbf = counting_bloom_filter.new(20, 0.01)
+        cbf:delete() --incorrect # args
+    end,
+    function()
+        local cbf = counting_bloom_filter.new(20, 0.01)
+        cbf:merge(bloom_filter.new(20, 0.01)) --incorrect argument type
+    end,
+    function()
+        local cbf = counting_bloom_filter.new(20, 0.01)
+        cbf:merge(counting_bloom_filter.new(21, 0.01)) --mismatched dimensions
+    end,
+}
+
+for i, v in ipairs(errors) do
+    local ok = pcall(v)
+    if ok then error(string.format("counting error test %d failed\n", i)) end
+end
+
+local cbf = counting_bloom_filter.new(1000, 0.01)
+assert(not cbf:query(1), "bloom filter should be empty")
+assert(not cbf:delete(1), "bloom filter should be empty")
+for i=1, test_items do
+    assert(cbf:add(i), "insert failed")
+end
+for i=1, test_items do
+    assert(cbf:query(i), "query failed")
+    assert(not cbf:add(i), "duplicate insert")
+    assert(cbf:delete(i), "delete failed")
+    assert(cbf:query(i), "key added twice was removed by one delete")
+end
+assert(cbf:count() == test_items, "count=" .. cbf:count())
+for i=1, test_items, 2 do
+    assert(cbf:delete(i), "delete failed")
+end
+assert(cbf:count() == test_items / 2, "count=" .. cbf:count())
+for i=2, test_items, 2 do
+    assert(cbf:query(i), "query failed")
+end
+for i=2, test_items, 2 do
+    assert(cbf:delete(i), "delete failed")
+end
+assert(cbf:count() == 0, "count=" .. cbf:count())
+for i=1, test_items do
+    assert(not cbf:query(i), "query failed")
+end
+
+-- test add_many/query_many
+local keys = {}
+for i=1, test_items do keys[i] = i end
+assert(cbf:add_many(keys) == test_items, "add_many failed")
+assert(cbf:add_many({1, "a"}) == 1, "add_many duplicate")
+assert(cbf:count() == test_items + 2, "count=" .. cbf:count())
+local found = cbf:query_many({1, "a", "b", test_items})
+assert(#found == 4 and found[1] and found[2] and not found[3] and found[4], "query_many failed")
+assert(cbf:delete(1), "delete failed")
+assert(cbf:query(1), "key added twice was removed by one delete")
+cbf:clear()
+
+-- test merge
+local cbf1 = counting_bloom_filter.new(1000, 0.01)
+for i=1, 100 do
+    cbf:add(i)
+    cbf1:add(i + 100)
+end
+cbf:merge(cbf1)
+assert(cbf:count() == 200, "count=" .. cbf:count())
+for i=1, 200 do
+    assert(cbf:query(i), "query failed")
+end
+assert(cbf:delete(150), "delete failed")
+assert(not cbf:query(150), "query failed")
+cbf:clear()
+assert(cbf:count() == 0, "bloom filter should be empty")
+assert(not cbf:query(1), "bloom filter should be empty")
@@ -5,6 +5,7 @@
 require "bloom_filter"
 
 bf = bloom_filter.new(20, 0.01)
+bbf = bloom_filter.new_blocked(20, 0.01)
 
 local ok, err = pcall(bf.fromstring, bf, {})
 assert(not ok) --incorrect argument type
@@ -12,12 +13,23 @@ assert(not ok) --incorrect argument type
 local ok, err = pcall(bf.fromstring, bf, "                       ")
 assert(not ok) --incorrect argument length
 
+local ok, err = pcall(bf.fromstring, bf, 0, string.rep("\0", 24), 3)
+assert(not ok) --invalid version
+
+local ok, err = pcall(bbf.fromstring, bbf, 0, "                       ")
+assert(not ok) --incorrect argument length
+
 function process(ts)
     if not bf:query(ts) then
         if not bf:add(ts) then
             error("key existed")
         end
     end
+    if not bbf:query(ts) then
+        if not bbf:add(ts) then
+            error("blocked key existed")
+        end
+    end
 
     return 0
 end
@@ -25,7 +37,11 @@ end
 function report(tc)
     if tc == 99 then
         bf:clear()
+        bbf:clear()
     else
+        if bf:count() ~= bbf:count() then
+            error("blocked count=" .. bbf:count())
+        end
         write_output(bf:count())
     end
 end
@@ -0,0 +1,32 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "counting_bloom_filter"
+
+cbf = counting_bloom_filter.new(20, 0.01)
+
+local ok, err = pcall(cbf.fromstring, cbf, 0, "                       ")
+assert(not ok) --incorrect argument length
+
+function process(ts)
+    if not cbf:query(ts) then
+        if not cbf:add(ts) then
+            error("key existed")
+        end
+    end
+
+    return 0
+end
+
+function report(tc)
+    if tc == 98 then
+        cbf:delete(1);
+        write_output(cbf:count())
+    elseif tc == 99 then
+        cbf:clear()
+        write_output(cbf:count())
+    else
+        write_output(cbf:count())
+    end
+end
@@ -10,10 +10,18 @@
 #include <float.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "circular_buffer.h"
+#include "double_conversion.h"
 #include "lauxlib.h"
 #include "lua.h"
 #include "lualib.h"
@@ -34,6 +42,7 @@
 
 #define COLUMN_NAME_SIZE 16
 #define UNIT_LABEL_SIZE 8
+#define MAX_COLUMNS 256
 
 static const char *mozsvc_circular_buffer = "mozsvc.circular_buffer";
 static const char *mozsvc_circular_buffer_table = "circular_buffer";
@@ -55,8 +64,15 @@ typedef enum {
 typedef enum {
   OUTPUT_CBUF,
   OUTPUT_CBUFD,
+  OUTPUT_CBUFD_SPARSE,
 } OUTPUT_FORMAT;
 
+typedef enum {
+  PRESERVE_BINARY,
+  PRESERVE_COMPRESSED,
+  PRESERVE_TEXT,
+} PRESERVATION_FORMAT;
+
 typedef struct
 {
   char name[COLUMN_NAME_SIZE];
@@ -64,6 +80,12 @@ typedef struct
   COLUMN_AGGREGATION aggregation;
 } header_info;
 
+typedef struct view_ud
+{
+  circular_buffer_view view; // first so native consumers can cast to it
+  int ref;                   // registry reference keeping the buffer alive
+} view_ud;
+
 typedef struct circular_buffer
 {
   time_t        current_time;
@@ -73,9 +95,16 @@ typedef struct circular_buffer
   unsigned      columns;
   unsigned      tcolumns; // columns * 2 since we now store the deltas in-line
   OUTPUT_FORMAT format;
+  PRESERVATION_FORMAT preservation;
   int           ref;
+  int           tier_ref; // registry reference keeping the rollup tier alive
+  bool          columnar; // column-major values followed by column-major deltas
+
+  struct circular_buffer *tier; // next coarser resolution, fed on eviction
 
   header_info   *headers;
+  uint64_t      *dirty;   // one bit per row with a pending delta
+  uint64_t      *dirty_cells; // one bit per cell (row major) with a delta
   double        values[];
 } circular_buffer;
 
@@ -86,6 +115,69 @@ static time_t get_start_time(circular_buffer *cb)
 }
 
 
+static size_t value_index(circular_buffer *cb, unsigned row, unsigned col)
+{
+  if (cb->columnar) {
+    return (size_t)col * cb->rows + row;
+  }
+  return (size_t)row * cb->tcolumns + col * 2;
+}
+
+
+static size_t delta_index(circular_buffer *cb, unsigned row, unsigned col)
+{
+  if (cb->columnar) {
+    return ((size_t)cb->columns + col) * cb->rows + row;
+  }
+  return (size_t)row * cb->tcolumns + col * 2 + 1;
+}
+
+
+// distance between the same column in consecutive rows
+static size_t row_stride(circular_buffer *cb)
+{
+  return cb->columnar ? 1 : cb->tcolumns;
+}
+
+
+static size_t dirty_words(size_t bits)
+{
+  return (bits + 63) / 64;
+}
+
+
+static size_t dirty_size(circular_buffer *cb)
+{
+  return sizeof(uint64_t) * (dirty_words(cb->rows)
+                             + dirty_words((size_t)cb->rows * cb->columns));
+}
+
+
+static void set_dirty(circular_buffer *cb, unsigned row, unsigned col)
+{
+  size_t cell = (size_t)row * cb->columns + col;
+  cb->dirty[row >> 6] |= (uint64_t)1 << (row & 63);
+  cb->dirty_cells[cell >> 6] |= (uint64_t)1 << (cell & 63);
+}
+
+
+static void clear_dirty(circular_buffer *cb, unsigned row)
+{
+  cb->dirty[row >> 6] &= ~((uint64_t)1 << (row & 63));
+
+  size_t cell = (size_t)row * cb->columns;
+  size_t end = cell + cb->columns;
+  while (cell < end) {
+    unsigned shift = cell & 63;
+    size_t n = 64 - shift;
+    if (n > end - cell) n = end - cell;
+    uint64_t mask = n == 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1) << shift;
+    cb->dirty_cells[cell >> 6] &= ~mask;
+    cell += n;
+  }
+}
+
+
 static void copy_cleared_row(circular_buffer *cb, double *cleared, size_t rows)
 {
   size_t pool = 1;
@@ -105,6 +197,27 @@ static void copy_cleared_row(circular_buffer *cb, double *cleared, size_t rows)
 }
 
 
+static void clear_rows_columnar(circular_buffer *cb, unsigned row,
+                                unsigned num_rows)
+{
+  unsigned end = row + num_rows;
+  unsigned wrap = 0;
+  if (end > cb->rows) {
+    wrap = end - cb->rows;
+    end = cb->rows;
+  }
+  for (unsigned c = 0; c < cb->tcolumns; ++c) {
+    double *v = &cb->values[(size_t)c * cb->rows];
+    for (unsigned r = row; r < end; ++r) {
+      v[r] = NAN;
+    }
+    for (unsigned r = 0; r < wrap; ++r) {
+      v[r] = NAN;
+    }
+  }
+}
+
+
 static void clear_rows(circular_buffer *cb, unsigned num_rows)
 {
   if (num_rows >= cb->rows) {
@@ -113,6 +226,14 @@ static void clear_rows(circular_buffer *cb, unsigned num_rows)
   unsigned row = cb->current_row;
   ++row;
   if (row >= cb->rows) {row = 0;}
+  for (unsigned i = 0, r = row; i < num_rows; ++i, ++r) {
+    if (r >= cb->rows) {r = 0;}
+    clear_dirty(cb, r);
+  }
+  if (cb->columnar) {
+    clear_rows_columnar(cb, row, num_rows);
+    return;
+  }
   for (unsigned c = 0; c < cb->tcolumns; ++c) {
     cb->values[(row * cb->tcolumns) + c] = NAN;
   }
@@ -132,24 +253,38 @@ static void clear_rows(circular_buffer *cb, unsigned num_rows)
 static int cb_new(lua_State *lua)
 {
   int n = lua_gettop(lua);
-  luaL_argcheck(lua, n >= 3 && n <= 3, 0, "incorrect number of arguments");
+  luaL_argcheck(lua, n >= 3 && n <= 4, 0, "incorrect number of arguments");
   int rows = luaL_checkint(lua, 1);
   luaL_argcheck(lua, 1 < rows, 1, "rows must be > 1");
   int columns = luaL_checkint(lua, 2);
-  luaL_argcheck(lua, 0 < columns &&  256 >= columns, 2,
+  luaL_argcheck(lua, 0 < columns &&  MAX_COLUMNS >= columns, 2,
                 "columns must be > 0 and <= 256");
   int seconds_per_row = luaL_checkint(lua, 3);
   luaL_argcheck(lua, 0 < seconds_per_row, 3, "seconds_per_row is out of range");
+  bool columnar = false;
+  if (n == 4) {
+    luaL_checktype(lua, 4, LUA_TBOOLEAN);
+    columnar = lua_toboolean(lua, 4);
+  }
 
   size_t header_bytes = sizeof(header_info) * columns;
   size_t buffer_bytes = sizeof(double) * rows * columns * 2;
+  size_t dirty_bytes = sizeof(uint64_t)
+      * (dirty_words(rows) + dirty_words((size_t)rows * columns));
   size_t struct_bytes = sizeof(circular_buffer);
 
-  size_t nbytes = header_bytes + buffer_bytes + struct_bytes;
+  size_t nbytes = header_bytes + buffer_bytes + dirty_bytes + struct_bytes;
   circular_buffer *cb = (circular_buffer *)lua_newuserdata(lua, nbytes);
   cb->ref = LUA_NOREF;
+  cb->tier_ref = LUA_NOREF;
+  cb->tier = NULL;
   cb->format = OUTPUT_CBUF;
-  cb->headers = (header_info *)&cb->values[rows * columns * 2];
+  cb->preservation = PRESERVE_COMPRESSED;
+  cb->columnar = columnar;
+  cb->dirty = (uint64_t *)&cb->values[rows * columns * 2];
+  cb->dirty_cells = cb->dirty + dirty_words(rows);
+  cb->headers = (header_info *)(cb->dirty_cells
+                                + dirty_words((size_t)rows * columns));
 
   luaL_getmetatable(lua, mozsvc_circular_buffer);
   lua_setmetatable(lua, -2);
@@ -161,6 +296,7 @@ static int cb_new(lua_State *lua)
   cb->tcolumns = columns * 2;
   cb->seconds_per_row = seconds_per_row;
   memset(cb->headers, 0, header_bytes);
+  memset(cb->dirty, 0, dirty_bytes);
   for (unsigned col = 0; col < cb->columns; ++col) {
     snprintf(cb->headers[col].name, COLUMN_NAME_SIZE,
              "Column_%d", col + 1);
@@ -181,6 +317,64 @@ static circular_buffer* check_circular_buffer(lua_State *lua, int min_args)
 }
 
 
+static int check_row(circular_buffer *cb, double ns, int advance);
+
+
+static void rollup_value(circular_buffer *tier, unsigned row, unsigned col,
+                         COLUMN_AGGREGATION aggregation, double value)
+{
+  size_t i = value_index(tier, row, col);
+  size_t d = delta_index(tier, row, col);
+  double old = tier->values[i];
+  switch (aggregation) {
+  case AGGREGATION_SUM:
+    tier->values[i] = isnan(old) ? value : old + value;
+    tier->values[d] = isnan(tier->values[d]) ? value : tier->values[d] + value;
+    break;
+  case AGGREGATION_MIN:
+    if (isnan(old) || value < old) {
+      tier->values[i] = value;
+      tier->values[d] = value;
+    }
+    break;
+  case AGGREGATION_MAX:
+    if (isnan(old) || value > old) {
+      tier->values[i] = value;
+      tier->values[d] = value;
+    }
+    break;
+  default:
+    tier->values[i] = value; // last value wins
+    break;
+  }
+  if (!isnan(tier->values[d])) set_dirty(tier, row, col);
+}
+
+
+static void rollup_rows(circular_buffer *cb, unsigned num_rows)
+{
+  if (num_rows > cb->rows) {
+    num_rows = cb->rows;
+  }
+  // the rows about to be reused are the oldest ones in the buffer
+  time_t t = get_start_time(cb);
+  unsigned row = cb->current_row;
+  for (unsigned i = 0; i < num_rows; ++i, t += cb->seconds_per_row) {
+    if (++row == cb->rows) row = 0;
+    int trow = -1;
+    for (unsigned col = 0; col < cb->columns; ++col) {
+      double value = cb->values[value_index(cb, row, col)];
+      if (isnan(value)) continue;
+      if (trow == -1) {
+        trow = check_row(cb->tier, t * 1e9, 1);
+        if (trow == -1) break; // older than the tier's history
+      }
+      rollup_value(cb->tier, trow, col, cb->headers[col].aggregation, value);
+    }
+  }
+}
+
+
 static int check_row(circular_buffer *cb, double ns, int advance)
 {
   time_t t = (time_t)(ns / 1e9);
@@ -192,6 +386,7 @@ static int check_row(circular_buffer *cb, double ns, int advance)
   int row = requested_row % cb->rows;
 
   if (row_delta > 0 && advance) {
+    if (cb->tier) rollup_rows(cb, row_delta);
     clear_rows(cb, row_delta);
     cb->current_time = t;
     cb->current_row = row;
@@ -213,6 +408,77 @@ static int check_column(lua_State *lua, circular_buffer *cb, int arg)
 }
 
 
+static double add_value(lua_State *lua, circular_buffer *cb, int row,
+                        int column, double value)
+{
+  size_t i = value_index(cb, row, column);
+  size_t d = delta_index(cb, row, column);
+  double old = cb->values[i];
+
+  if (isnan(old)) {
+    cb->values[i] = value;
+  } else {
+    if (isnan(value)) {
+      luaL_error(lua, "cannot uninitialize a value");
+    }
+    cb->values[i] += value;
+    if (isnan(cb->values[i])) {
+      luaL_error(lua, "add produced a NAN");
+    }
+  }
+  if (old == cb->values[i]) return cb->values[i];
+
+  switch (cb->headers[column].aggregation) {
+  case AGGREGATION_SUM:
+    if (isnan(cb->values[d])) {
+      cb->values[d] = value;
+    } else {
+      cb->values[d] += value;
+    }
+    break;
+  case AGGREGATION_MIN:
+  case AGGREGATION_MAX:
+    cb->values[d] = cb->values[i];
+    break;
+  default:
+    // none
+    break;
+  }
+  if (!isnan(cb->values[d])) set_dirty(cb, row, column);
+  return cb->values[i];
+}
+
+
+/*
+ * Copies the current values of the row a batch add will change; a row the
+ * buffer still has to advance to starts out empty.
+ */
+static void get_batch_row(circular_buffer *cb, double ns, double *cells)
+{
+  int row = check_row(cb, ns, 0);
+  for (unsigned col = 0; col < cb->columns; ++col) {
+    cells[col] = row == -1 ? NAN : cb->values[value_index(cb, row, col)];
+  }
+}
+
+
+/*
+ * Applies a batch value to the copy of its cell so every value can be rejected
+ * before the row is changed (add_value raises its errors part way through).
+ */
+static void check_batch_value(lua_State *lua, int arg, double *cell,
+                              double value)
+{
+  luaL_argcheck(lua, !isnan(value), arg, "values cannot be NaN");
+  if (isnan(*cell)) {
+    *cell = value;
+  } else {
+    *cell += value;
+    luaL_argcheck(lua, !isnan(*cell), arg, "add produced a NAN");
+  }
+}
+
+
 static int cb_add(lua_State *lua)
 {
   circular_buffer *cb = check_circular_buffer(lua, 4);
@@ -222,42 +488,92 @@ static int cb_add(lua_State *lua)
   double value = luaL_checknumber(lua, 4);
 
   if (row != -1) {
-    int i = (row * cb->tcolumns) + column * 2;
-    double old = cb->values[i];
+    lua_pushnumber(lua, add_value(lua, cb, row, column, value));
+  } else {
+    lua_pushnil(lua);
+  }
+  return 1;
+}
 
-    if (isnan(old)) {
-      cb->values[i] = value;
-    } else {
-      if (isnan(value)) {
-        luaL_error(lua, "cannot uninitialize a value");
-      }
-      cb->values[i] += value;
-      if (isnan(cb->values[i])) {
-        luaL_error(lua, "add produced a NAN");
-      }
+
+static int cb_add_row(lua_State *lua)
+{
+  circular_buffer *cb = check_circular_buffer(lua, 3);
+  double ns = luaL_checknumber(lua, 2);
+  luaL_checktype(lua, 3, LUA_TTABLE);
+  int n = (int)lua_objlen(lua, 3);
+  luaL_argcheck(lua, n <= (int)cb->columns, 3, "too many values");
+  double cells[MAX_COLUMNS];
+  get_batch_row(cb, ns, cells);
+  for (int col = 1; col <= n; ++col) { // validate before changing anything
+    lua_rawgeti(lua, 3, col);
+    int t = lua_type(lua, -1);
+    if (t == LUA_TNUMBER) {
+      check_batch_value(lua, 3, &cells[col - 1], lua_tonumber(lua, -1));
+    } else if (t != LUA_TNIL) {
+      luaL_argerror(lua, 3, "values must be numbers");
     }
-    lua_pushnumber(lua, cb->values[i]);
-    if (old == cb->values[i]) return 1;
+    lua_pop(lua, 1);
+  }
 
-    switch (cb->headers[column].aggregation) {
-    case AGGREGATION_SUM:
-      if (isnan(cb->values[i + 1])) {
-        cb->values[i + 1] = value;
-      } else {
-        cb->values[i + 1] += value;
-      }
-      break;
-    case AGGREGATION_MIN:
-    case AGGREGATION_MAX:
-      cb->values[i + 1] = cb->values[i];
-      break;
-    default:
-      // none
-      break;
+  int row = check_row(cb, ns, 1); // advance the buffer forward if necessary
+  if (row == -1) {
+    lua_pushnil(lua);
+    return 1;
+  }
+
+  int added = 0;
+  for (int col = 1; col <= n; ++col) {
+    lua_rawgeti(lua, 3, col);
+    if (lua_type(lua, -1) == LUA_TNUMBER) {
+      add_value(lua, cb, row, col - 1, lua_tonumber(lua, -1));
+      ++added;
     }
-  } else {
+    lua_pop(lua, 1);
+  }
+  lua_pushinteger(lua, added);
+  return 1;
+}
+
+
+static int cb_add_many(lua_State *lua)
+{
+  circular_buffer *cb = check_circular_buffer(lua, 4);
+  double ns = luaL_checknumber(lua, 2);
+  luaL_checktype(lua, 3, LUA_TTABLE);
+  luaL_checktype(lua, 4, LUA_TTABLE);
+  int n = (int)lua_objlen(lua, 3);
+  luaL_argcheck(lua, n == (int)lua_objlen(lua, 4), 4,
+                "cols and vals must be the same length");
+  double cells[MAX_COLUMNS];
+  get_batch_row(cb, ns, cells);
+  for (int i = 1; i <= n; ++i) { // validate before changing anything
+    lua_rawgeti(lua, 3, i);
+    lua_rawgeti(lua, 4, i);
+    int col = (int)lua_tointeger(lua, -2);
+    luaL_argcheck(lua, lua_type(lua, -2) == LUA_TNUMBER
+                  && 1 <= col && col <= (int)cb->columns, 3,
+                  "column out of range");
+    luaL_argcheck(lua, lua_type(lua, -1) == LUA_TNUMBER, 4,
+                  "values must be numbers");
+    check_batch_value(lua, 4, &cells[col - 1], lua_tonumber(lua, -1));
+    lua_pop(lua, 2);
+  }
+
+  int row = check_row(cb, ns, 1); // advance the buffer forward if necessary
+  if (row == -1) {
     lua_pushnil(lua);
+    return 1;
   }
+
+  for (int i = 1; i <= n; ++i) {
+    lua_rawgeti(lua, 3, i);
+    lua_rawgeti(lua, 4, i);
+    add_value(lua, cb, row, (int)lua_tointeger(lua, -2) - 1,
+              lua_tonumber(lua, -1));
+    lua_pop(lua, 2);
+  }
+  lua_pushinteger(lua, n);
   return 1;
 }
 
@@ -270,7 +586,9 @@ static int cb_get(lua_State *lua)
   lua_Integer offset = lua_tointeger(lua, lua_upvalueindex(1));
 
   if (row != -1) {
-    lua_pushnumber(lua, cb->values[(row * cb->tcolumns) + column * 2 + offset]);
+    size_t i = offset ? delta_index(cb, row, column)
+        : value_index(cb, row, column);
+    lua_pushnumber(lua, cb->values[i]);
   } else {
     lua_pushnil(lua);
   }
@@ -298,7 +616,8 @@ static int cb_set(lua_State *lua)
   double value = luaL_checknumber(lua, 4);
 
   if (row != -1) {
-    int i = (row * cb->tcolumns) + column * 2;
+    size_t i = value_index(cb, row, column);
+    size_t d = delta_index(cb, row, column);
     double old = cb->values[i];
     if (isnan(value) && !isnan(old)) {
       luaL_error(lua, "cannot uninitialize a value");
@@ -310,28 +629,29 @@ static int cb_set(lua_State *lua)
         value -= old;
         if (value == 0) break;
       }
-      if (isnan(cb->values[i + 1])) {
-        cb->values[i + 1] = value;
+      if (isnan(cb->values[d])) {
+        cb->values[d] = value;
       } else {
-        cb->values[i + 1] += value;
+        cb->values[d] += value;
       }
       break;
     case AGGREGATION_MIN:
       if (isnan(old) || value < old) {
         cb->values[i] = value;
-        cb->values[i + 1] = value;
+        cb->values[d] = value;
       }
       break;
     case AGGREGATION_MAX:
       if (isnan(old) || value > old) {
         cb->values[i] = value;
-        cb->values[i + 1] = value;
+        cb->values[d] = value;
       }
       break;
     default:
       cb->values[i] = value;
       break;
     }
+    if (!isnan(cb->values[d])) set_dirty(cb, row, column);
     lua_pushnumber(lua, cb->values[i]);
   } else {
     lua_pushnil(lua);
@@ -363,54 +683,538 @@ static int cb_set_header(lua_State *lua)
       n[j] = '_';
     }
   }
+  for (circular_buffer *t = cb->tier; t; t = t->tier) {
+    t->headers[column] = cb->headers[column];
+  }
 
   lua_pushinteger(lua, column + 1); // return the 1 based Lua column
   return 1;
 }
 
 
-static int cb_get_header(lua_State *lua)
+static int cb_add_tier(lua_State *lua)
+{
+  circular_buffer *cb = check_circular_buffer(lua, 3);
+  luaL_argcheck(lua, cb->tier_ref == LUA_NOREF, 1, "tier already added");
+  int rows = luaL_checkint(lua, 2);
+  luaL_argcheck(lua, 1 < rows, 2, "rows must be > 1");
+  int seconds_per_row = luaL_checkint(lua, 3);
+  luaL_argcheck(lua, seconds_per_row > (int)cb->seconds_per_row
+                && seconds_per_row % cb->seconds_per_row == 0, 3,
+                "seconds_per_row must be a multiple of the source "
+                "seconds_per_row");
+
+  lua_pushcfunction(lua, cb_new);
+  lua_pushinteger(lua, rows);
+  lua_pushinteger(lua, cb->columns);
+  lua_pushinteger(lua, seconds_per_row);
+  lua_pushboolean(lua, cb->columnar);
+  lua_call(lua, 4, 1);
+  circular_buffer *tier = (circular_buffer *)lua_touserdata(lua, -1);
+  memcpy(tier->headers, cb->headers, sizeof(header_info) * cb->columns);
+
+  lua_pushvalue(lua, -1);
+  cb->tier_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+  cb->tier = tier;
+  return 1;
+}
+
+
+static int cb_get_header(lua_State *lua)
+{
+  circular_buffer *cb = check_circular_buffer(lua, 2);
+  int column = check_column(lua, cb, 2);
+
+  lua_pushstring(lua, cb->headers[column].name);
+  lua_pushstring(lua, cb->headers[column].unit);
+  lua_pushstring(lua, agg_methods[cb->headers[column].aggregation]);
+  return 3;
+}
+
+
+static int cb_get_range(lua_State *lua)
+{
+  circular_buffer *cb = check_circular_buffer(lua, 2);
+  int column = check_column(lua, cb, 2);
+  lua_Integer offset = lua_tointeger(lua, lua_upvalueindex(1));
+
+  // optional range arguments
+  double start_ns = luaL_optnumber(lua, 3, get_start_time(cb) * 1e9);
+  double end_ns = luaL_optnumber(lua, 4, cb->current_time * 1e9);
+  luaL_argcheck(lua, end_ns >= start_ns, 4, "end must be >= start");
+
+  int start_row = check_row(cb, start_ns, 0);
+  int end_row = check_row(cb, end_ns, 0);
+  if (-1 == start_row || -1 == end_row) {
+    lua_pushnil(lua);
+    return 1;
+  }
+
+  lua_newtable(lua);
+  const double *v = &cb->values[offset ? delta_index(cb, 0, column)
+                                : value_index(cb, 0, column)];
+  size_t stride = row_stride(cb);
+  int row = start_row;
+  int i = 0;
+  do {
+    if (row == (int)cb->rows) {
+      row = 0;
+    }
+    lua_pushnumber(lua, v[row * stride]);
+    lua_rawseti(lua, -2, ++i);
+  } while (row++ != end_row);
+
+  return 1;
+}
+
+
+// a column range split into at most two segments by the buffer wrap
+typedef struct column_span
+{
+  const double  *v[2];
+  size_t        n[2];
+  size_t        stride;
+} column_span;
+
+
+static bool get_span(circular_buffer *cb, int column, double start_ns,
+                     double end_ns, column_span *s)
+{
+  int start_row = check_row(cb, start_ns, 0);
+  int end_row = check_row(cb, end_ns, 0);
+  if (-1 == start_row || -1 == end_row) return false;
+
+  const double *base = &cb->values[value_index(cb, 0, column)];
+  s->stride = row_stride(cb);
+  s->v[0] = base + start_row * s->stride;
+  s->v[1] = base;
+  if (end_row >= start_row) {
+    s->n[0] = end_row - start_row + 1;
+    s->n[1] = 0;
+  } else {
+    s->n[0] = cb->rows - start_row;
+    s->n[1] = end_row + 1;
+  }
+  return true;
+}
+
+
+/*
+ * NaN aware kernels, the SSE2 versions are used when the column is contiguous
+ * (columnar layout) and mask out the NaN lanes with an ordered compare.
+ */
+static void sum_kernel(const double *v, size_t n, size_t stride, double *sum,
+                       double *count)
+{
+  size_t i = 0;
+  double s = 0, c = 0;
+#if defined(__SSE2__)
+  if (stride == 1) {
+    const __m128d one = _mm_set1_pd(1);
+    __m128d vs = _mm_setzero_pd();
+    __m128d vc = _mm_setzero_pd();
+    for (; i + 2 <= n; i += 2) {
+      __m128d x = _mm_loadu_pd(v + i);
+      __m128d m = _mm_cmpord_pd(x, x);
+      vs = _mm_add_pd(vs, _mm_and_pd(x, m));
+      vc = _mm_add_pd(vc, _mm_and_pd(one, m));
+    }
+    double ts[2], tc[2];
+    _mm_storeu_pd(ts, vs);
+    _mm_storeu_pd(tc, vc);
+    s = ts[0] + ts[1];
+    c = tc[0] + tc[1];
+  }
+#endif
+  for (; i < n; ++i) {
+    double x = v[i * stride];
+    if (!isnan(x)) {
+      s += x;
+      ++c;
+    }
+  }
+  *sum += s;
+  *count += c;
+}
+
+
+static void sos_kernel(const double *v, size_t n, size_t stride, double mean,
+                       double *sos)
+{
+  size_t i = 0;
+  double s = 0;
+#if defined(__SSE2__)
+  if (stride == 1) {
+    const __m128d vm = _mm_set1_pd(mean);
+    __m128d vs = _mm_setzero_pd();
+    for (; i + 2 <= n; i += 2) {
+      __m128d x = _mm_loadu_pd(v + i);
+      __m128d d = _mm_and_pd(_mm_sub_pd(x, vm), _mm_cmpord_pd(x, x));
+      vs = _mm_add_pd(vs, _mm_mul_pd(d, d));
+    }
+    double ts[2];
+    _mm_storeu_pd(ts, vs);
+    s = ts[0] + ts[1];
+  }
+#endif
+  for (; i < n; ++i) {
+    double x = v[i * stride];
+    if (!isnan(x)) {
+      x -= mean;
+      s += x * x;
+    }
+  }
+  *sos += s;
+}
+
+
+static void minmax_kernel(const double *v, size_t n, size_t stride, bool max,
+                          double *mv, double *count)
+{
+  size_t i = 0;
+  double r = *mv, c = 0;
+#if defined(__SSE2__)
+  if (stride == 1) {
+    const __m128d one = _mm_set1_pd(1);
+    const __m128d fill = _mm_set1_pd(r); // replaces the NaN lanes
+    __m128d vr = fill;
+    __m128d vc = _mm_setzero_pd();
+    for (; i + 2 <= n; i += 2) {
+      __m128d x = _mm_loadu_pd(v + i);
+      __m128d m = _mm_cmpord_pd(x, x);
+      x = _mm_or_pd(_mm_and_pd(m, x), _mm_andnot_pd(m, fill));
+      vr = max ? _mm_max_pd(vr, x) : _mm_min_pd(vr, x);
+      vc = _mm_add_pd(vc, _mm_and_pd(one, m));
+    }
+    double tr[2], tc[2];
+    _mm_storeu_pd(tr, vr);
+    _mm_storeu_pd(tc, vc);
+    if (max) {
+      r = tr[0] > tr[1] ? tr[0] : tr[1];
+    } else {
+      r = tr[0] < tr[1] ? tr[0] : tr[1];
+    }
+    c = tc[0] + tc[1];
+  }
+#endif
+  for (; i < n; ++i) {
+    double x = v[i * stride];
+    if (!isnan(x)) {
+      if (max ? x > r : x < r) r = x;
+      ++c;
+    }
+  }
+  *mv = r;
+  *count += c;
+}
+
+
+static size_t copy_span(const column_span *s, double *dst)
+{
+  size_t cnt = 0;
+  for (int j = 0; j < 2; ++j) {
+    for (size_t i = 0; i < s->n[j]; ++i) {
+      double x = s->v[j][i * s->stride];
+      if (!isnan(x)) dst[cnt++] = x;
+    }
+  }
+  return cnt;
+}
+
+
+static double* scratch_alloc(lua_State *lua, size_t n)
+{
+  void *ud;
+  lua_Alloc alloc = lua_getallocf(lua, &ud);
+  double *p = alloc(ud, NULL, 0, sizeof(double) * n);
+  if (!p) luaL_error(lua, "memory allocation failed");
+  return p;
+}
+
+
+static void scratch_free(lua_State *lua, double *p, size_t n)
+{
+  void *ud;
+  lua_Alloc alloc = lua_getallocf(lua, &ud);
+  alloc(ud, p, sizeof(double) * n, 0);
+}
+
+
+// partitions a so that a[k] is the kth smallest value
+static double select_kth(double *a, ptrdiff_t n, ptrdiff_t k)
+{
+  ptrdiff_t lo = 0, hi = n - 1;
+  while (lo < hi) {
+    double pivot = a[lo + (hi - lo) / 2];
+    ptrdiff_t i = lo, j = hi;
+    while (i <= j) {
+      while (a[i] < pivot) ++i;
+      while (a[j] > pivot) --j;
+      if (i <= j) {
+        double t = a[i];
+        a[i++] = a[j];
+        a[j--] = t;
+      }
+    }
+    if (k <= j) {
+      hi = j;
+    } else if (k >= i) {
+      lo = i;
+    } else {
+      break;
+    }
+  }
+  return a[k];
+}
+
+
+static double percentile(double *a, size_t n, double p)
+{
+  double h = (n - 1) * p / 100;
+  size_t k = (size_t)h;
+  double v = select_kth(a, n, k);
+  if (h > k) {
+    double next = a[k + 1]; // everything after k is >= a[k]
+    for (size_t i = k + 2; i < n; ++i) {
+      if (a[i] < next) next = a[i];
+    }
+    v += (h - k) * (next - v);
+  }
+  return v;
+}
+
+
+static int cb_compute(lua_State *lua)
+{
+  static const char *ops[] = { "sum", "avg", "min", "max", "variance", "sd",
+    "percentile", NULL };
+  enum { SUM, AVG, MIN, MAX, VARIANCE, SD, PERCENTILE };
+
+  circular_buffer *cb = check_circular_buffer(lua, 3);
+  int op = luaL_checkoption(lua, 2, NULL, ops);
+  int column = check_column(lua, cb, 3);
+  double start_ns = luaL_optnumber(lua, 4, get_start_time(cb) * 1e9);
+  double end_ns = luaL_optnumber(lua, 5, cb->current_time * 1e9);
+  luaL_argcheck(lua, end_ns >= start_ns, 5, "end must be >= start");
+  double p = 0;
+  if (op == PERCENTILE) {
+    p = luaL_checknumber(lua, 6);
+    luaL_argcheck(lua, 0 <= p && p <= 100, 6,
+                  "percentile must be between 0 and 100");
+  }
+
+  column_span s;
+  if (!get_span(cb, column, start_ns, end_ns, &s)) {
+    lua_pushnil(lua);
+    return 1;
+  }
+
+  double result = 0, count = 0;
+  switch (op) {
+  case MIN:
+  case MAX:
+    result = op == MAX ? -INFINITY : INFINITY;
+    for (int j = 0; j < 2; ++j) {
+      minmax_kernel(s.v[j], s.n[j], s.stride, op == MAX, &result, &count);
+    }
+    if (count == 0) result = NAN;
+    break;
+  case PERCENTILE:
+    {
+      size_t n = s.n[0] + s.n[1];
+      double *tmp = scratch_alloc(lua, n);
+      size_t cnt = copy_span(&s, tmp);
+      result = cnt ? percentile(tmp, cnt, p) : NAN;
+      count = (double)cnt;
+      scratch_free(lua, tmp, n);
+    }
+    break;
+  default:
+    for (int j = 0; j < 2; ++j) {
+      sum_kernel(s.v[j], s.n[j], s.stride, &result, &count);
+    }
+    if (op == SUM || count == 0) break;
+    result /= count;
+    if (op == AVG) break;
+    {
+      double sos = 0;
+      for (int j = 0; j < 2; ++j) {
+        sos_kernel(s.v[j], s.n[j], s.stride, result, &sos);
+      }
+      result = sos / count;
+    }
+    if (op == SD) result = sqrt(result);
+    break;
+  }
+  lua_pushnumber(lua, result);
+  lua_pushnumber(lua, count);
+  return 2;
+}
+
+
+static int double_cmp(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+
+static int cb_mannwhitneyu(lua_State *lua)
+{
+  circular_buffer *cb = check_circular_buffer(lua, 6);
+  int column = check_column(lua, cb, 2);
+  double start_1 = luaL_checknumber(lua, 3);
+  double end_1 = luaL_checknumber(lua, 4);
+  luaL_argcheck(lua, end_1 >= start_1, 4, "end_1 must be >= start_1");
+  double start_2 = luaL_checknumber(lua, 5);
+  double end_2 = luaL_checknumber(lua, 6);
+  luaL_argcheck(lua, end_2 >= start_2, 6, "end_2 must be >= start_2");
+  bool use_continuity = true;
+  if (!lua_isnoneornil(lua, 7)) {
+    luaL_checktype(lua, 7, LUA_TBOOLEAN);
+    use_continuity = lua_toboolean(lua, 7);
+  }
+
+  column_span s1, s2;
+  if (!get_span(cb, column, start_1, end_1, &s1)
+      || !get_span(cb, column, start_2, end_2, &s2)) {
+    lua_pushnil(lua);
+    return 1;
+  }
+
+  size_t n = s1.n[0] + s1.n[1] + s2.n[0] + s2.n[1];
+  double *x = scratch_alloc(lua, n);
+  size_t n1 = copy_span(&s1, x);
+  double *y = x + n1;
+  size_t n2 = copy_span(&s2, y);
+  qsort(x, n1, sizeof(double), double_cmp);
+  qsort(y, n2, sizeof(double), double_cmp);
+
+  // merge the sorted samples assigning the average rank to each tie group
+  double rank = 0, r1 = 0, ties = 0;
+  size_t i = 0, j = 0;
+  while (i < n1 || j < n2) {
+    double v = (j >= n2 || (i < n1 && x[i] <= y[j])) ? x[i] : y[j];
+    double cx = 0, cy = 0;
+    for (; i < n1 && x[i] == v; ++i) ++cx;
+    for (; j < n2 && y[j] == v; ++j) ++cy;
+    double t = cx + cy;
+    r1 += cx * (rank + (t + 1) / 2);
+    rank += t;
+    ties += t * t * t - t;
+  }
+  scratch_free(lua, x, n);
+
+  double N = (double)(n1 + n2);
+  double tie_correction = n1 && n2 ? 1 - ties / (N * N * N - N) : 0;
+  if (tie_correction == 0) {
+    lua_pushnil(lua);
+    return 1;
+  }
+
+  double u1 = r1 - (n1 * (n1 + 1)) / 2.0;
+  double u2 = (double)n1 * n2 - u1;
+  double lu = u1 > u2 ? u1 : u2;
+  double sd = sqrt(tie_correction * n1 * n2 * (N + 1) / 12.0);
+  double z = fabs((lu - (use_continuity ? 0.5 : 0) - n1 * n2 / 2.0) / sd);
+
+  lua_pushnumber(lua, u1);
+  lua_pushnumber(lua, 0.5 * erfc(z * 0.70710678118654752440)); // ndtr(-z)
+  return 2;
+}
+
+
+static int cb_get_view(lua_State *lua)
+{
+  circular_buffer *cb = check_circular_buffer(lua, 2);
+  int column = check_column(lua, cb, 2);
+  double start_ns = luaL_optnumber(lua, 3, get_start_time(cb) * 1e9);
+  double end_ns = luaL_optnumber(lua, 4, cb->current_time * 1e9);
+  luaL_argcheck(lua, end_ns >= start_ns, 4, "end must be >= start");
+
+  column_span s;
+  if (!get_span(cb, column, start_ns, end_ns, &s)) {
+    lua_pushnil(lua);
+    return 1;
+  }
+
+  view_ud *ud = (view_ud *)lua_newuserdata(lua, sizeof(view_ud));
+  ud->ref = LUA_NOREF;
+  for (int j = 0; j < 2; ++j) {
+    ud->view.v[j] = s.v[j];
+    ud->view.n[j] = s.n[j];
+  }
+  ud->view.stride = s.stride;
+  ud->view.current_time = &cb->current_time;
+  ud->view.created = cb->current_time;
+
+  luaL_getmetatable(lua, mozsvc_circular_buffer_view);
+  lua_setmetatable(lua, -2);
+  // views are transient, the empty environment keeps them out of the sandbox
+  // serialization/output
+  lua_pushvalue(lua, lua_upvalueindex(1));
+  lua_setfenv(lua, -2);
+
+  lua_pushvalue(lua, 1);
+  ud->ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+  return 1;
+}
+
+
+static view_ud* check_view(lua_State *lua)
+{
+  view_ud *ud = luaL_checkudata(lua, 1, mozsvc_circular_buffer_view);
+  luaL_argcheck(lua, circular_buffer_view_valid(&ud->view), 1,
+                "view invalidated by a buffer advance");
+  return ud;
+}
+
+
+static int cbv_len(lua_State *lua)
+{
+  circular_buffer_view *v = &check_view(lua)->view;
+  lua_pushnumber(lua, (lua_Number)(v->n[0] + v->n[1]));
+  return 1;
+}
+
+
+static int cbv_index(lua_State *lua)
+{
+  circular_buffer_view *v = &check_view(lua)->view;
+  if (lua_type(lua, 2) != LUA_TNUMBER) {
+    lua_pushnil(lua);
+    return 1;
+  }
+  lua_Number idx = lua_tonumber(lua, 2);
+  if (idx < 1 || idx > v->n[0] + v->n[1]) {
+    lua_pushnil(lua);
+    return 1;
+  }
+  size_t i = (size_t)idx - 1;
+  if (i < v->n[0]) {
+    lua_pushnumber(lua, v->v[0][i * v->stride]);
+  } else {
+    lua_pushnumber(lua, v->v[1][(i - v->n[0]) * v->stride]);
+  }
+  return 1;
+}
+
+
+static int cbv_newindex(lua_State *lua)
 {
-  circular_buffer *cb = check_circular_buffer(lua, 2);
-  int column = check_column(lua, cb, 2);
-
-  lua_pushstring(lua, cb->headers[column].name);
-  lua_pushstring(lua, cb->headers[column].unit);
-  lua_pushstring(lua, agg_methods[cb->headers[column].aggregation]);
-  return 3;
+  return luaL_error(lua, "circular buffer views are read-only");
 }
 
 
-static int cb_get_range(lua_State *lua)
+static int cbv_gc(lua_State *lua)
 {
-  circular_buffer *cb = check_circular_buffer(lua, 2);
-  int column = check_column(lua, cb, 2);
-  lua_Integer offset = lua_tointeger(lua, lua_upvalueindex(1));
-
-  // optional range arguments
-  double start_ns = luaL_optnumber(lua, 3, get_start_time(cb) * 1e9);
-  double end_ns = luaL_optnumber(lua, 4, cb->current_time * 1e9);
-  luaL_argcheck(lua, end_ns >= start_ns, 4, "end must be >= start");
-
-  int start_row = check_row(cb, start_ns, 0);
-  int end_row = check_row(cb, end_ns, 0);
-  if (-1 == start_row || -1 == end_row) {
-    lua_pushnil(lua);
-    return 1;
+  view_ud *ud = luaL_checkudata(lua, 1, mozsvc_circular_buffer_view);
+  if (ud->ref != LUA_NOREF) {
+    luaL_unref(lua, LUA_REGISTRYINDEX, ud->ref);
+    ud->ref = LUA_NOREF;
   }
-
-  lua_newtable(lua);
-  int row = start_row;
-  int i = 0;
-  do {
-    if (row == (int)cb->rows) {
-      row = 0;
-    }
-    lua_pushnumber(lua, cb->values[(row * cb->tcolumns) + column * 2 + offset]);
-    lua_rawseti(lua, -2, ++i);
-  } while (row++ != end_row);
-
-  return 1;
+  return 0;
 }
 
 
@@ -548,7 +1352,8 @@ static int cb_annotate(lua_State *lua)
 
 static int cb_format(lua_State *lua)
 {
-  static const char *output_types[] = { "cbuf", "cbufd", NULL };
+  static const char *output_types[] = { "cbuf", "cbufd", "cbufd_sparse",
+    NULL };
   circular_buffer *cb = check_circular_buffer(lua, 2);
   luaL_argcheck(lua, 2 == lua_gettop(lua), 0,
                 "incorrect number of arguments");
@@ -559,6 +1364,193 @@ static int cb_format(lua_State *lua)
 }
 
 
+static int cb_preservation(lua_State *lua)
+{
+  static const char *preservation_types[] = { "binary", "compressed", "text",
+    NULL };
+  circular_buffer *cb = check_circular_buffer(lua, 2);
+  luaL_argcheck(lua, 2 == lua_gettop(lua), 0,
+                "incorrect number of arguments");
+
+  cb->preservation = luaL_checkoption(lua, 2, NULL, preservation_types);
+  lua_pop(lua, 1); // remove the preservation format
+  return 1; // return the circular buffer object
+}
+
+
+/*
+ * Binary preservation format (native byte order, the preservation data is
+ * only restored on the host that wrote it)
+ *
+ * binary_header
+ * binary: rows * columns * 2 doubles in the buffer's memory layout (values and
+ *         deltas in-line or column-major values followed by the deltas); with
+ *         no pending deltas only the rows * columns values are stored (in the
+ *         same order) and the deltas are restored as NaN
+ * compressed: blocks of a uint32 control word followed by the doubles, the
+ *             high bit marks a run (one double repeated count times) otherwise
+ *             count literal doubles follow
+ */
+#define BINARY_MAGIC "CBUF"
+#define BINARY_VERSION 1
+#define BINARY_BYTE_ORDER 0x0102
+#define BINARY_FLAG_COMPRESSED 1
+#define BINARY_FLAG_COLUMNAR 2
+#define BINARY_FLAG_NO_DELTAS 4
+#define RLE_RUN 0x80000000u
+#define RLE_MIN_RUN 4
+
+typedef struct binary_header
+{
+  char      magic[4];
+  uint16_t  byte_order;
+  uint8_t   version;
+  uint8_t   flags;
+  uint32_t  rows;
+  uint32_t  columns;
+  uint32_t  seconds_per_row;
+  uint32_t  current_row;
+  int64_t   current_time;
+} binary_header;
+
+
+static const char* rle_restore(double *dst, size_t len, const char *p,
+                               const char *end)
+{
+  size_t pos = 0;
+  uint32_t ctl;
+  while (p < end) {
+    if ((size_t)(end - p) < sizeof(ctl)) return "truncated block";
+    memcpy(&ctl, p, sizeof(ctl));
+    p += sizeof(ctl);
+    size_t cnt = ctl & ~RLE_RUN;
+    size_t bytes = (ctl & RLE_RUN) ? sizeof(double) : sizeof(double) * cnt;
+    if (cnt == 0 || cnt > len - pos) return "invalid block length";
+    if ((size_t)(end - p) < bytes) return "truncated block";
+    if (dst) {
+      if (ctl & RLE_RUN) {
+        memcpy(&dst[pos], p, sizeof(double));
+        for (size_t i = 1; i < cnt; ++i) {
+          dst[pos + i] = dst[pos];
+        }
+      } else {
+        memcpy(&dst[pos], p, bytes);
+      }
+    }
+    p += bytes;
+    pos += cnt;
+  }
+  if (pos != len) return "too few values";
+  return NULL;
+}
+
+
+static void rebuild_dirty(circular_buffer *cb)
+{
+  memset(cb->dirty, 0, dirty_size(cb));
+  for (unsigned row = 0; row < cb->rows; ++row) {
+    for (unsigned col = 0; col < cb->columns; ++col) {
+      if (!isnan(cb->values[delta_index(cb, row, col)])) {
+        set_dirty(cb, row, col);
+      }
+    }
+  }
+}
+
+
+// spreads the n values restored without their deltas into the full layout
+static void expand_values(double *dst, size_t n, bool columnar)
+{
+  if (columnar) {
+    for (size_t i = n; i < n * 2; ++i) {
+      dst[i] = NAN;
+    }
+    return;
+  }
+  for (size_t i = n; i-- > 0;) {
+    dst[i * 2] = dst[i];
+    dst[i * 2 + 1] = NAN;
+  }
+}
+
+
+// copies the cells from a buffer stored in the other memory layout
+static void transpose_values(circular_buffer *cb, const double *src)
+{
+  for (unsigned row = 0; row < cb->rows; ++row) {
+    for (unsigned col = 0; col < cb->columns; ++col) {
+      size_t vi, di;
+      if (cb->columnar) { // source is row-major
+        vi = (size_t)row * cb->tcolumns + col * 2;
+        di = vi + 1;
+      } else {
+        vi = (size_t)col * cb->rows + row;
+        di = ((size_t)cb->columns + col) * cb->rows + row;
+      }
+      cb->values[value_index(cb, row, col)] = src[vi];
+      cb->values[delta_index(cb, row, col)] = src[di];
+    }
+  }
+}
+
+
+static void binary_fromstring(lua_State *lua, circular_buffer *cb,
+                              const char *values, size_t len)
+{
+  binary_header h;
+  if (len < sizeof(h)) {
+    luaL_error(lua, "fromstring() invalid binary header");
+  }
+  memcpy(&h, values, sizeof(h));
+  if (h.byte_order != BINARY_BYTE_ORDER || h.version != BINARY_VERSION
+      || (h.flags & ~(BINARY_FLAG_COMPRESSED | BINARY_FLAG_COLUMNAR
+                      | BINARY_FLAG_NO_DELTAS))) {
+    luaL_error(lua, "fromstring() invalid binary header");
+  }
+  if (h.rows != cb->rows || h.columns != cb->columns
+      || h.seconds_per_row != cb->seconds_per_row || h.current_row >= cb->rows) {
+    luaL_error(lua, "fromstring() configuration mismatch");
+  }
+
+  const char *p = values + sizeof(h);
+  const char *end = values + len;
+  size_t cells = (size_t)cb->rows * cb->tcolumns;
+  size_t bytes = sizeof(double) * cells;
+  size_t stored = h.flags & BINARY_FLAG_NO_DELTAS ? cells / 2 : cells;
+  if (h.flags & BINARY_FLAG_COMPRESSED) {
+    // validate the whole stream before touching the buffer
+    const char *err = rle_restore(NULL, stored, p, end);
+    if (err) {
+      luaL_error(lua, "fromstring() %s", err);
+    }
+  } else if ((size_t)(end - p) != sizeof(double) * stored) {
+    luaL_error(lua, "fromstring() bytes found: %d, expected %d",
+               (int)(end - p), (int)(sizeof(double) * stored));
+  }
+
+  bool transpose = cb->columnar != ((h.flags & BINARY_FLAG_COLUMNAR) != 0);
+  double *dst = cb->values;
+  if (transpose) {
+    dst = lua_newuserdata(lua, bytes);
+  }
+  if (h.flags & BINARY_FLAG_COMPRESSED) {
+    rle_restore(dst, stored, p, end);
+  } else {
+    memcpy(dst, p, sizeof(double) * stored);
+  }
+  if (stored != cells) {
+    expand_values(dst, stored, h.flags & BINARY_FLAG_COLUMNAR);
+  }
+  if (transpose) {
+    transpose_values(cb, dst);
+    lua_pop(lua, 1); // remove the temporary buffer
+  }
+  rebuild_dirty(cb);
+  cb->current_time = (time_t)h.current_time;
+  cb->current_row = h.current_row;
+}
+
+
 static void read_time_row(char **p, circular_buffer *cb)
 {
   cb->current_time = (time_t)strtoll(*p, &*p, 10);
@@ -576,19 +1568,19 @@ static int read_double(char **p, double *value)
   char *end = NULL;
 #ifdef _MSC_VER
   if ((*p)[0] == 'n' && strncmp(*p, not_a_number, 3) == 0) {
-    *p += 3;
+    end = *p + 3;
     *value = NAN;
   } else if ((*p)[0] == 'i' && strncmp(*p, "inf", 3) == 0) {
-    *p += 3;
+    end = *p + 3;
     *value = INFINITY;
   } else if ((*p)[0] == '-' && strncmp(*p, "-inf", 4) == 0) {
-    *p += 4;
+    end = *p + 4;
     *value = -INFINITY;
   } else {
-    *value = strtod(*p, &end);
+    *value = dc_parse(*p, &end);
   }
 #else
-  *value = strtod(*p, &end);
+  *value = dc_parse(*p, &end);
 #endif
   if (*p == end) {
     return 0;
@@ -598,6 +1590,8 @@ static int read_double(char **p, double *value)
 }
 
 
+// accepts dense rows (time followed by every column) and sparse rows (time
+// followed by column:delta pairs)
 static void cbufd_fromstring(lua_State *lua,
                              circular_buffer *cb,
                              char **p)
@@ -605,13 +1599,34 @@ static void cbufd_fromstring(lua_State *lua,
   double value, ns = 0;
   size_t pos = 0;
   int row = -1;
+  bool sparse = false;
   while (read_double(&*p, &value)) {
+    if (**p == ':') {
+      ++*p;
+      double delta;
+      if ((pos != 1 && !sparse) || !read_double(p, &delta)
+          || value < 1 || value > cb->columns) {
+        luaL_error(lua, "fromstring() invalid delta");
+      }
+      sparse = true;
+      if (row != -1) {
+        unsigned col = (unsigned)value - 1;
+        cb->values[delta_index(cb, row, col)] = delta;
+        if (!isnan(delta)) set_dirty(cb, row, col);
+      }
+      continue;
+    }
+    if (sparse) { // a bare number terminates the sparse row
+      sparse = false;
+      pos = 0;
+    }
     if (pos == 0) { // new row, starts with a time_t
       ns = value * 1e9;
       row = check_row(cb, ns, 0);
     } else {
       if (row != -1) {
-        cb->values[(row * cb->tcolumns) + (pos - 1) * 2 + 1] = value;
+        cb->values[delta_index(cb, row, pos - 1)] = value;
+        if (!isnan(value)) set_dirty(cb, row, pos - 1);
       }
     }
     if (pos == cb->columns) {
@@ -620,7 +1635,7 @@ static void cbufd_fromstring(lua_State *lua,
       ++pos;
     }
   }
-  if (pos != 0) {
+  if (pos != 0 && !sparse) {
     lua_pushstring(lua, "fromstring() invalid delta");
     lua_error(lua);
   }
@@ -631,7 +1646,14 @@ static void cbufd_fromstring(lua_State *lua,
 static int cb_fromstring(lua_State *lua)
 {
   circular_buffer *cb = check_circular_buffer(lua, 2);
-  const char *values = luaL_checkstring(lua, 2);
+  size_t vlen;
+  const char *values = luaL_checklstring(lua, 2, &vlen);
+
+  if (vlen >= sizeof(BINARY_MAGIC) - 1
+      && memcmp(values, BINARY_MAGIC, sizeof(BINARY_MAGIC) - 1) == 0) {
+    binary_fromstring(lua, cb, values, vlen);
+    return 0;
+  }
 
   char *p = (char *)values;
   read_time_row(&p, cb);
@@ -640,7 +1662,8 @@ static int cb_fromstring(lua_State *lua)
   size_t len = cb->rows * cb->columns;
   double value;
   while (pos < len && read_double(&p, &value)) {
-    cb->values[pos++ * 2] = value;
+    cb->values[value_index(cb, pos / cb->columns, pos % cb->columns)] = value;
+    ++pos;
   }
 
   if (pos == len) {
@@ -654,6 +1677,13 @@ static int cb_fromstring(lua_State *lua)
   return 0;
 }
 
+static lsb_err_value output_double(lsb_output_buffer *ob, double d)
+{
+  char buf[DC_BUFFER_SIZE];
+  return lsb_outputs(ob, buf, dc_format(d, buf));
+}
+
+
 static int output_cbuf(circular_buffer *cb, lsb_output_buffer *ob)
 {
   unsigned col;
@@ -664,8 +1694,7 @@ static int output_cbuf(circular_buffer *cb, lsb_output_buffer *ob)
       if (col != 0) {
         if (lsb_outputc(ob, '\t')) return 1;
       }
-      if (lsb_outputd(ob,
-                      cb->values[(row * cb->tcolumns) + col * 2])) {
+      if (output_double(ob, cb->values[value_index(cb, row, col)])) {
         return 1;
       }
     }
@@ -677,14 +1706,7 @@ static int output_cbuf(circular_buffer *cb, lsb_output_buffer *ob)
 
 static bool is_row_dirty(circular_buffer *cb, unsigned row)
 {
-  bool dirty = false;
-  for (unsigned col = 0; col < cb->columns; ++col) {
-    if (!isnan(cb->values[(row * cb->tcolumns) + col * 2 + 1])) {
-      dirty = true;
-      break;
-    }
-  }
-  return dirty;
+  return (cb->dirty[row >> 6] >> (row & 63)) & 1;
 }
 
 
@@ -708,10 +1730,54 @@ output_cbufd(circular_buffer *cb, lsb_output_buffer *ob, bool serialize)
       if (lsb_outputf(ob, "%lld", t)) return 1;
       for (col = 0; col < cb->columns; ++col) {
         if (lsb_outputc(ob, sep)) return 1;
-        int idx = (row * cb->tcolumns) + col * 2 + 1;
-        if (lsb_outputd(ob, cb->values[idx])) return 1;
+        size_t idx = delta_index(cb, row, col);
+        if (output_double(ob, cb->values[idx])) return 1;
         cb->values[idx] = NAN;
       }
+      clear_dirty(cb, row);
+      if (lsb_outputc(ob, eol)) return 1;
+    }
+    t += cb->seconds_per_row;
+  }
+  return 0;
+}
+
+
+static int
+output_cbufd_sparse(circular_buffer *cb, lsb_output_buffer *ob, bool serialize)
+{
+  char sep = '\t';
+  char eol = '\n';
+  if (serialize) {
+    sep = ' ';
+    eol = ' ';
+  }
+  long long t = get_start_time(cb);
+  unsigned row = cb->current_row + 1;
+  for (unsigned i = 0; i < cb->rows; ++i, ++row) {
+    if (row >= cb->rows) {
+      row = 0;
+    }
+    if (is_row_dirty(cb, row)) {
+      if (lsb_outputf(ob, "%lld", t)) return 1;
+      size_t cell = (size_t)row * cb->columns;
+      size_t end = cell + cb->columns;
+      while (cell < end) {
+        uint64_t bits = cb->dirty_cells[cell >> 6] >> (cell & 63);
+        if (!bits) { // skip to the next word
+          cell = (cell | 63) + 1;
+          continue;
+        }
+        if (bits & 1) {
+          unsigned col = (unsigned)(cell - (size_t)row * cb->columns);
+          size_t idx = delta_index(cb, row, col);
+          if (lsb_outputf(ob, "%c%u:", sep, col + 1)) return 1;
+          if (output_double(ob, cb->values[idx])) return 1;
+          cb->values[idx] = NAN;
+        }
+        ++cell;
+      }
+      clear_dirty(cb, row);
       if (lsb_outputc(ob, eol)) return 1;
     }
     t += cb->seconds_per_row;
@@ -761,7 +1827,7 @@ output_annotations(lua_State *lua, circular_buffer *cb, lsb_output_buffer *ob,
           lua_pop(lua, 1);
 
           bool output = true;
-          if (!key && OUTPUT_CBUFD == cb->format) {
+          if (!key && OUTPUT_CBUF != cb->format) {
             if (delta) {
               lua_pushnil(lua);
               lua_setfield(lua, -2, "delta");
@@ -856,9 +1922,10 @@ static int cb_output(lua_State *lua)
   if (pos != ob->pos) has_anno = true;
   if (lsb_outputs(ob, "]}\n", 3)) return 1;
 
-  if (OUTPUT_CBUFD == cb->format) {
+  if (OUTPUT_CBUF != cb->format) {
     pos = ob->pos;
-    int rv = output_cbufd(cb, ob, false);
+    int rv = OUTPUT_CBUFD == cb->format ? output_cbufd(cb, ob, false)
+        : output_cbufd_sparse(cb, ob, false);
     if (rv == 0 && ob->pos == pos && !has_anno) {
       ob->pos = 0;
     }
@@ -868,6 +1935,135 @@ static int cb_output(lua_State *lua)
 }
 
 
+static int serialize_text(circular_buffer *cb, lsb_output_buffer *ob)
+{
+  if (lsb_outputf(ob, "%lld %d",
+                  (long long)cb->current_time,
+                  cb->current_row)) {
+    return 1;
+  }
+
+  for (unsigned row = 0; row < cb->rows; ++row) {
+    for (unsigned col = 0; col < cb->columns; ++col) {
+      if (lsb_outputc(ob, ' ')) return 1;
+      // intentionally not serialized as Lua
+      if (output_double(ob, cb->values[value_index(cb, row, col)])) {
+        return 1;
+      }
+    }
+  }
+  if (lsb_outputc(ob, ' ')) return 1;
+  // dense deltas so the preservation data stays readable by older versions
+  if (output_cbufd(cb, ob, true)) {return 1;}
+  if (ob->buf[ob->pos - 1] == ' ') {
+    --ob->pos;
+  }
+  return 0;
+}
+
+
+// writes cnt doubles taken every stride elements of v
+static int serialize_doubles(lsb_output_buffer *ob, const double *v,
+                             size_t cnt, size_t stride)
+{
+  if (stride == 1) {
+    return lsb_serialize_binary(ob, v, sizeof(double) * cnt) ? 1 : 0;
+  }
+  for (size_t i = 0; i < cnt; ++i) {
+    if (lsb_serialize_binary(ob, v + i * stride, sizeof(double))) return 1;
+  }
+  return 0;
+}
+
+
+static int serialize_rle_block(lsb_output_buffer *ob, const double *v,
+                               size_t cnt, size_t stride, bool run)
+{
+  while (cnt > 0) {
+    uint32_t n = cnt < RLE_RUN ? (uint32_t)cnt : RLE_RUN - 1;
+    uint32_t ctl = run ? n | RLE_RUN : n;
+    if (lsb_serialize_binary(ob, &ctl, sizeof(ctl))) return 1;
+    if (serialize_doubles(ob, v, run ? 1 : n, stride)) return 1;
+    if (!run) v += n * stride;
+    cnt -= n;
+  }
+  return 0;
+}
+
+
+static bool has_deltas(circular_buffer *cb)
+{
+  for (unsigned row = 0; row < cb->rows; ++row) {
+    for (unsigned col = 0; col < cb->columns; ++col) {
+      if (!isnan(cb->values[delta_index(cb, row, col)])) return true;
+    }
+  }
+  return false;
+}
+
+
+static int serialize_binary(circular_buffer *cb, lsb_output_buffer *ob)
+{
+  binary_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, BINARY_MAGIC, sizeof(h.magic));
+  h.byte_order = BINARY_BYTE_ORDER;
+  h.version = BINARY_VERSION;
+  h.rows = cb->rows;
+  h.columns = cb->columns;
+  h.seconds_per_row = cb->seconds_per_row;
+  h.current_row = cb->current_row;
+  h.current_time = (int64_t)cb->current_time;
+  if (PRESERVE_COMPRESSED == cb->preservation) {
+    h.flags |= BINARY_FLAG_COMPRESSED;
+  }
+  if (cb->columnar) {
+    h.flags |= BINARY_FLAG_COLUMNAR;
+  }
+  const double *v = cb->values;
+  size_t len = (size_t)cb->rows * cb->tcolumns;
+  size_t stride = 1;
+  if (!has_deltas(cb)) {
+    // the values are every other cell in-line or the first half column-major
+    h.flags |= BINARY_FLAG_NO_DELTAS;
+    len /= 2;
+    if (!cb->columnar) stride = 2;
+  }
+  if (lsb_serialize_binary(ob, &h, sizeof(h))) return 1;
+
+  if (!(h.flags & BINARY_FLAG_COMPRESSED)) {
+    return serialize_doubles(ob, v, len, stride);
+  }
+
+  // the bit patterns are compared so NaN (unset) cells collapse into runs
+  size_t literal = 0;
+  size_t i = 0;
+  while (i < len) {
+    size_t j = i + 1;
+    while (j < len
+           && memcmp(&v[i * stride], &v[j * stride], sizeof(double)) == 0) {
+      ++j;
+    }
+    if (j - i >= RLE_MIN_RUN) {
+      if (literal < i && serialize_rle_block(ob, v + literal * stride,
+                                             i - literal, stride, false)) {
+        return 1;
+      }
+      if (serialize_rle_block(ob, v + i * stride, j - i, stride, true)) {
+        return 1;
+      }
+      literal = j;
+    }
+    i = j;
+  }
+  if (literal < len && serialize_rle_block(ob, v + literal * stride,
+                                           len - literal, stride, false)) {
+    return 1;
+  }
+  return 0;
+}
+
+
 static int cb_serialize(lua_State *lua)
 {
   lsb_output_buffer *ob = lua_touserdata(lua, -1);
@@ -876,12 +2072,13 @@ static int cb_serialize(lua_State *lua)
   if (!(ob && key && cb)) {return 1;}
   if (lsb_outputf(ob,
                   "if %s == nil then "
-                  "%s = circular_buffer.new(%d, %d, %d) end\n",
+                  "%s = circular_buffer.new(%d, %d, %d%s) end\n",
                   key,
                   key,
                   cb->rows,
                   cb->columns,
-                  cb->seconds_per_row)) {
+                  cb->seconds_per_row,
+                  cb->columnar ? ", true" : "")) {
     return 1;
   }
 
@@ -897,33 +2094,30 @@ static int cb_serialize(lua_State *lua)
     }
   }
 
-  if (lsb_outputf(ob, "%s:fromstring(\"%lld %d",
-                  key,
-                  (long long)cb->current_time,
-                  cb->current_row)) {
-    return 1;
+  if (lsb_outputf(ob, "%s:fromstring(\"", key)) return 1;
+  if (PRESERVE_TEXT == cb->preservation) {
+    if (serialize_text(cb, ob)) return 1;
+  } else {
+    if (serialize_binary(cb, ob)) return 1;
   }
+  if (lsb_outputs(ob, "\")\n", 3)) {return 1;}
+  if (output_annotations(lua, cb, ob, key)) return 1;
+  return 0;
+}
 
+#else
+static int cb_reset_delta(lua_State *lua)
+{
+  circular_buffer *cb = check_circular_buffer(lua, 0);
   for (unsigned row = 0; row < cb->rows; ++row) {
-    for (col = 0; col < cb->columns; ++col) {
-      if (lsb_outputc(ob, ' ')) return 1;
-      // intentionally not serialized as Lua
-      if (lsb_outputd(ob,
-                      cb->values[(row * cb->tcolumns) + col * 2])) {
-        return 1;
-      }
+    for (unsigned col = 0; col < cb->columns; ++col) {
+      cb->values[delta_index(cb, row, col)] = NAN;
     }
   }
-  if (lsb_outputc(ob, ' ')) return 1;
-  if (output_cbufd(cb, ob, true)) {return 1;}
-  if (ob->buf[ob->pos - 1] == ' ') {
-    --ob->pos;
-  }
-  if (lsb_outputs(ob, "\")\n", 3)) {return 1;}
-  if (output_annotations(lua, cb, ob, key)) return 1;
+  memset(cb->dirty, 0, dirty_size(cb));
   return 0;
 }
-
+#endif
 
 static int cb_gc(lua_State *lua)
 {
@@ -936,22 +2130,14 @@ static int cb_gc(lua_State *lua)
     lua_pop(lua, 1);
     cb->ref = LUA_NOREF;
   }
-  return 0;
-}
-
-#else
-static int cb_reset_delta(lua_State *lua)
-{
-  circular_buffer *cb = check_circular_buffer(lua, 0);
-  for (unsigned row = 0; row < cb->rows; ++row) {
-    for (unsigned col = 0; col < cb->columns; ++col) {
-      int idx = (row * cb->tcolumns) + col * 2 + 1;
-      cb->values[idx] = NAN;
-    }
+  if (cb->tier_ref != LUA_NOREF) {
+    luaL_unref(lua, LUA_REGISTRYINDEX, cb->tier_ref);
+    cb->tier_ref = LUA_NOREF;
+    cb->tier = NULL;
   }
   return 0;
 }
-#endif
+
 
 static const struct luaL_reg circular_bufferlib_f[] =
 {
@@ -963,11 +2149,16 @@ static const struct luaL_reg circular_bufferlib_f[] =
 static const struct luaL_reg circular_bufferlib_m[] =
 {
   { "add", cb_add },
+  { "add_tier", cb_add_tier },
+  { "add_many", cb_add_many },
+  { "add_row", cb_add_row },
+  { "compute", cb_compute },
   { "get", cb_get },
   { "get_configuration", cb_get_configuration },
   { "current_time", cb_current_time },
   { "get_header", cb_get_header },
   { "get_range", cb_get_range },
+  { "mannwhitneyu", cb_mannwhitneyu },
   { "set", cb_set },
   { "set_header", cb_set_header },
   // @todo add __tostring for non sandbox use
@@ -975,11 +2166,21 @@ static const struct luaL_reg circular_bufferlib_m[] =
 #ifdef LUA_SANDBOX
   { "annotate", cb_annotate },
   { "format", cb_format },
+  { "preservation", cb_preservation },
   { "fromstring", cb_fromstring }, // used for sandbox data restoration
-  { "__gc", cb_gc },
 #else
   { "reset_delta", cb_reset_delta },
 #endif
+  { "__gc", cb_gc },
+  { NULL, NULL }
+};
+
+static const struct luaL_reg circular_buffer_viewlib_m[] =
+{
+  { "__gc", cbv_gc },
+  { "__index", cbv_index },
+  { "__len", cbv_len },
+  { "__newindex", cbv_newindex },
   { NULL, NULL }
 };
 
@@ -992,6 +2193,10 @@ int luaopen_circular_buffer(lua_State *lua)
   lsb_add_output_function(lua, cb_output);
   lua_replace(lua, LUA_ENVIRONINDEX);
 #endif
+  luaL_newmetatable(lua, mozsvc_circular_buffer_view);
+  luaL_register(lua, NULL, circular_buffer_viewlib_m);
+  lua_pop(lua, 1);
+
   luaL_newmetatable(lua, mozsvc_circular_buffer);
   lua_pushvalue(lua, -1);
   lua_setfield(lua, -2, "__index");
@@ -1005,6 +2210,10 @@ int luaopen_circular_buffer(lua_State *lua)
   lua_pushcclosure(lua, cb_get_range, 1);
   lua_setfield(lua, -2, "get_range_delta");
 
+  lua_newtable(lua); // shared empty environment for the views
+  lua_pushcclosure(lua, cb_get_view, 1);
+  lua_setfield(lua, -2, "get_view");
+
   luaL_register(lua, mozsvc_circular_buffer_table, circular_bufferlib_f);
   return 1;
 }
@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Lua circular buffer view for native consumers  @file */
+
+#ifndef circular_buffer_h_
+#define circular_buffer_h_
+
+#include <stddef.h>
+#include <time.h>
+
+/**
+ * Metatable name of the userdata returned by cb:get_view(). Native modules
+ * can retrieve the view with luaL_checkudata(lua, idx,
+ * mozsvc_circular_buffer_view) and read the column values in place.
+ */
+#define mozsvc_circular_buffer_view "mozsvc.circular_buffer_view"
+
+/**
+ * Read-only window onto a contiguous time range of a single circular buffer
+ * column. The values are not copied; when the range wraps around the end of the
+ * buffer it is split into two segments. Value i (0 based) of segment j is
+ * v[j][i * stride].
+ */
+typedef struct circular_buffer_view
+{
+  const double  *v[2];          // first and (on wrap) second segment
+  size_t        n[2];           // number of values in each segment
+  size_t        stride;         // distance between consecutive values
+  const time_t  *current_time;  // clock of the owning buffer
+  time_t        created;        // owning buffer clock when the view was taken
+} circular_buffer_view;
+
+/**
+ * The view is only valid until the owning buffer advances (the rows are then
+ * reused for newer data).
+ *
+ * @param view circular_buffer_view pointer
+ */
+#define circular_buffer_view_valid(view) \
+  (*(view)->current_time == (view)->created)
+
+#endif
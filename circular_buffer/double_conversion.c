@@ -0,0 +1,412 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Fast double to/from text conversion  @file */
+
+#include "double_conversion.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Grisu2 - Florian Loitsch, "Printing Floating-Point Numbers Quickly and
+// Accurately with Integers", PLDI 2010
+
+#define DP_SIGNIFICAND_MASK UINT64_C(0x000FFFFFFFFFFFFF)
+#define DP_HIDDEN_BIT       UINT64_C(0x0010000000000000)
+#define DP_EXPONENT_BIAS    1075 // 0x3FF + 52
+#define DP_MIN_EXPONENT     (-DP_EXPONENT_BIAS + 1)
+
+typedef struct diy_fp
+{
+  uint64_t  f;
+  int       e;
+} diy_fp;
+
+// normalized 64 bit approximations of 10^k for k = -348, -340, ..., 340
+static const diy_fp cached_powers[] = {
+  { UINT64_C(0xfa8fd5a0081c0288), -1220 },
+  { UINT64_C(0xbaaee17fa23ebf76), -1193 },
+  { UINT64_C(0x8b16fb203055ac76), -1166 },
+  { UINT64_C(0xcf42894a5dce35ea), -1140 },
+  { UINT64_C(0x9a6bb0aa55653b2d), -1113 },
+  { UINT64_C(0xe61acf033d1a45df), -1087 },
+  { UINT64_C(0xab70fe17c79ac6ca), -1060 },
+  { UINT64_C(0xff77b1fcbebcdc4f), -1034 },
+  { UINT64_C(0xbe5691ef416bd60c), -1007 },
+  { UINT64_C(0x8dd01fad907ffc3c), -980 },
+  { UINT64_C(0xd3515c2831559a83), -954 },
+  { UINT64_C(0x9d71ac8fada6c9b5), -927 },
+  { UINT64_C(0xea9c227723ee8bcb), -901 },
+  { UINT64_C(0xaecc49914078536d), -874 },
+  { UINT64_C(0x823c12795db6ce57), -847 },
+  { UINT64_C(0xc21094364dfb5637), -821 },
+  { UINT64_C(0x9096ea6f3848984f), -794 },
+  { UINT64_C(0xd77485cb25823ac7), -768 },
+  { UINT64_C(0xa086cfcd97bf97f4), -741 },
+  { UINT64_C(0xef340a98172aace5), -715 },
+  { UINT64_C(0xb23867fb2a35b28e), -688 },
+  { UINT64_C(0x84c8d4dfd2c63f3b), -661 },
+  { UINT64_C(0xc5dd44271ad3cdba), -635 },
+  { UINT64_C(0x936b9fcebb25c996), -608 },
+  { UINT64_C(0xdbac6c247d62a584), -582 },
+  { UINT64_C(0xa3ab66580d5fdaf6), -555 },
+  { UINT64_C(0xf3e2f893dec3f126), -529 },
+  { UINT64_C(0xb5b5ada8aaff80b8), -502 },
+  { UINT64_C(0x87625f056c7c4a8b), -475 },
+  { UINT64_C(0xc9bcff6034c13053), -449 },
+  { UINT64_C(0x964e858c91ba2655), -422 },
+  { UINT64_C(0xdff9772470297ebd), -396 },
+  { UINT64_C(0xa6dfbd9fb8e5b88f), -369 },
+  { UINT64_C(0xf8a95fcf88747d94), -343 },
+  { UINT64_C(0xb94470938fa89bcf), -316 },
+  { UINT64_C(0x8a08f0f8bf0f156b), -289 },
+  { UINT64_C(0xcdb02555653131b6), -263 },
+  { UINT64_C(0x993fe2c6d07b7fac), -236 },
+  { UINT64_C(0xe45c10c42a2b3b06), -210 },
+  { UINT64_C(0xaa242499697392d3), -183 },
+  { UINT64_C(0xfd87b5f28300ca0e), -157 },
+  { UINT64_C(0xbce5086492111aeb), -130 },
+  { UINT64_C(0x8cbccc096f5088cc), -103 },
+  { UINT64_C(0xd1b71758e219652c), -77 },
+  { UINT64_C(0x9c40000000000000), -50 },
+  { UINT64_C(0xe8d4a51000000000), -24 },
+  { UINT64_C(0xad78ebc5ac620000), 3 },
+  { UINT64_C(0x813f3978f8940984), 30 },
+  { UINT64_C(0xc097ce7bc90715b3), 56 },
+  { UINT64_C(0x8f7e32ce7bea5c70), 83 },
+  { UINT64_C(0xd5d238a4abe98068), 109 },
+  { UINT64_C(0x9f4f2726179a2245), 136 },
+  { UINT64_C(0xed63a231d4c4fb27), 162 },
+  { UINT64_C(0xb0de65388cc8ada8), 189 },
+  { UINT64_C(0x83c7088e1aab65db), 216 },
+  { UINT64_C(0xc45d1df942711d9a), 242 },
+  { UINT64_C(0x924d692ca61be758), 269 },
+  { UINT64_C(0xda01ee641a708dea), 295 },
+  { UINT64_C(0xa26da3999aef774a), 322 },
+  { UINT64_C(0xf209787bb47d6b85), 348 },
+  { UINT64_C(0xb454e4a179dd1877), 375 },
+  { UINT64_C(0x865b86925b9bc5c2), 402 },
+  { UINT64_C(0xc83553c5c8965d3d), 428 },
+  { UINT64_C(0x952ab45cfa97a0b3), 455 },
+  { UINT64_C(0xde469fbd99a05fe3), 481 },
+  { UINT64_C(0xa59bc234db398c25), 508 },
+  { UINT64_C(0xf6c69a72a3989f5c), 534 },
+  { UINT64_C(0xb7dcbf5354e9bece), 561 },
+  { UINT64_C(0x88fcf317f22241e2), 588 },
+  { UINT64_C(0xcc20ce9bd35c78a5), 614 },
+  { UINT64_C(0x98165af37b2153df), 641 },
+  { UINT64_C(0xe2a0b5dc971f303a), 667 },
+  { UINT64_C(0xa8d9d1535ce3b396), 694 },
+  { UINT64_C(0xfb9b7cd9a4a7443c), 720 },
+  { UINT64_C(0xbb764c4ca7a44410), 747 },
+  { UINT64_C(0x8bab8eefb6409c1a), 774 },
+  { UINT64_C(0xd01fef10a657842c), 800 },
+  { UINT64_C(0x9b10a4e5e9913129), 827 },
+  { UINT64_C(0xe7109bfba19c0c9d), 853 },
+  { UINT64_C(0xac2820d9623bf429), 880 },
+  { UINT64_C(0x80444b5e7aa7cf85), 907 },
+  { UINT64_C(0xbf21e44003acdd2d), 933 },
+  { UINT64_C(0x8e679c2f5e44ff8f), 960 },
+  { UINT64_C(0xd433179d9c8cb841), 986 },
+  { UINT64_C(0x9e19db92b4e31ba9), 1013 },
+  { UINT64_C(0xeb96bf6ebadf77d9), 1039 },
+  { UINT64_C(0xaf87023b9bf0ee6b), 1066 }
+};
+
+static const uint64_t pow10_u64[] = {
+  UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000), UINT64_C(10000),
+  UINT64_C(100000), UINT64_C(1000000), UINT64_C(10000000),
+  UINT64_C(100000000), UINT64_C(1000000000), UINT64_C(10000000000),
+  UINT64_C(100000000000), UINT64_C(1000000000000),
+  UINT64_C(10000000000000), UINT64_C(100000000000000),
+  UINT64_C(1000000000000000), UINT64_C(10000000000000000),
+  UINT64_C(100000000000000000), UINT64_C(1000000000000000000),
+  UINT64_C(10000000000000000000)
+};
+
+// powers of ten that are exactly representable as a double
+static const double exact_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+  1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+static diy_fp fp_sub(diy_fp a, diy_fp b)
+{
+  diy_fp r = { a.f - b.f, a.e };
+  return r;
+}
+
+
+static diy_fp fp_mul(diy_fp a, diy_fp b)
+{
+  const uint64_t m32 = UINT64_C(0xFFFFFFFF);
+  uint64_t ah = a.f >> 32, al = a.f & m32;
+  uint64_t bh = b.f >> 32, bl = b.f & m32;
+  uint64_t hh = ah * bh, lh = al * bh, hl = ah * bl, ll = al * bl;
+  uint64_t tmp = (ll >> 32) + (hl & m32) + (lh & m32);
+  tmp += UINT64_C(1) << 31; // round
+  diy_fp r = { hh + (hl >> 32) + (lh >> 32) + (tmp >> 32), a.e + b.e + 64 };
+  return r;
+}
+
+
+static diy_fp fp_normalize(diy_fp x)
+{
+  while (!(x.f & (UINT64_C(1) << 63))) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+
+static diy_fp fp_from_double(double d)
+{
+  uint64_t u;
+  memcpy(&u, &d, sizeof(u));
+  int biased_e = (int)((u >> 52) & 0x7FF);
+  diy_fp r;
+  r.f = u & DP_SIGNIFICAND_MASK;
+  if (biased_e) {
+    r.f += DP_HIDDEN_BIT;
+    r.e = biased_e - DP_EXPONENT_BIAS;
+  } else {
+    r.e = DP_MIN_EXPONENT;
+  }
+  return r;
+}
+
+
+// computes the normalized upper (m_plus) and lower (m_minus) rounding
+// boundaries of v, sharing the exponent of m_plus
+static void normalized_boundaries(diy_fp v, diy_fp *m_minus, diy_fp *m_plus)
+{
+  diy_fp pl = { (v.f << 1) + 1, v.e - 1 };
+  while (!(pl.f & (DP_HIDDEN_BIT << 1))) {
+    pl.f <<= 1;
+    pl.e--;
+  }
+  pl.f <<= 64 - 52 - 2;
+  pl.e -= 64 - 52 - 2;
+
+  diy_fp mi;
+  if (v.f == DP_HIDDEN_BIT) { // the lower boundary is closer
+    mi.f = (v.f << 2) - 1;
+    mi.e = v.e - 2;
+  } else {
+    mi.f = (v.f << 1) - 1;
+    mi.e = v.e - 1;
+  }
+  mi.f <<= mi.e - pl.e;
+  mi.e = pl.e;
+  *m_plus = pl;
+  *m_minus = mi;
+}
+
+
+static diy_fp get_cached_power(int e, int *k)
+{
+  double dk = (-61 - e) * 0.30102999566398114 + 347; // 1 / lg(10)
+  int ik = (int)dk;
+  if (dk - ik > 0.0) ik++;
+  unsigned idx = (unsigned)((ik >> 3) + 1);
+  *k = -(-348 + (int)(idx << 3)); // decimal exponent of the cached power
+  return cached_powers[idx];
+}
+
+
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+                        uint64_t ten_kappa, uint64_t wp_w)
+{
+  while (rest < wp_w && delta - rest >= ten_kappa
+         && (rest + ten_kappa < wp_w
+             || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+}
+
+
+static int count_digits(uint32_t n)
+{
+  int d = 1;
+  while (d < 10 && n >= pow10_u64[d]) ++d;
+  return d;
+}
+
+
+static int digit_gen(diy_fp w, diy_fp mp, uint64_t delta, char *buf, int *k)
+{
+  const diy_fp one = { UINT64_C(1) << -mp.e, mp.e };
+  const diy_fp wp_w = fp_sub(mp, w);
+  uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+  uint64_t p2 = mp.f & (one.f - 1);
+  int kappa = count_digits(p1);
+  int len = 0;
+
+  while (kappa > 0) {
+    uint32_t div = (uint32_t)pow10_u64[kappa - 1];
+    uint32_t d = p1 / div;
+    p1 %= div;
+    if (d || len) buf[len++] = (char)('0' + d);
+    kappa--;
+    uint64_t tmp = ((uint64_t)p1 << -one.e) + p2;
+    if (tmp <= delta) {
+      *k += kappa;
+      grisu_round(buf, len, delta, tmp, pow10_u64[kappa] << -one.e, wp_w.f);
+      return len;
+    }
+  }
+
+  for (;;) {
+    p2 *= 10;
+    delta *= 10;
+    char d = (char)(p2 >> -one.e);
+    if (d || len) buf[len++] = (char)('0' + d);
+    p2 &= one.f - 1;
+    kappa--;
+    if (p2 < delta) {
+      *k += kappa;
+      grisu_round(buf, len, delta, p2, one.f, wp_w.f * pow10_u64[-kappa]);
+      return len;
+    }
+  }
+}
+
+
+static int write_exponent(int k, char *buf)
+{
+  int n = 0;
+  if (k < 0) {
+    buf[n++] = '-';
+    k = -k;
+  }
+  if (k >= 100) {
+    buf[n++] = (char)('0' + k / 100);
+    k %= 100;
+    buf[n++] = (char)('0' + k / 10);
+  } else if (k >= 10) {
+    buf[n++] = (char)('0' + k / 10);
+  }
+  buf[n++] = (char)('0' + k % 10);
+  return n;
+}
+
+
+// lays out the digits (value = digits * 10^k) the way JavaScript does
+static int prettify(char *buf, int len, int k)
+{
+  const int kk = len + k; // 10^(kk - 1) <= v < 10^kk
+
+  if (len <= kk && kk <= 21) { // 1234e7 -> 12340000000
+    for (int i = len; i < kk; ++i) {
+      buf[i] = '0';
+    }
+    return kk;
+  } else if (0 < kk && kk <= 21) { // 1234e-2 -> 12.34
+    memmove(&buf[kk + 1], &buf[kk], len - kk);
+    buf[kk] = '.';
+    return len + 1;
+  } else if (-6 < kk && kk <= 0) { // 1234e-6 -> 0.001234
+    const int offset = 2 - kk;
+    memmove(&buf[offset], &buf[0], len);
+    buf[0] = '0';
+    buf[1] = '.';
+    for (int i = 2; i < offset; ++i) {
+      buf[i] = '0';
+    }
+    return len + offset;
+  } else if (len == 1) { // 1e30
+    buf[1] = 'e';
+    return 2 + write_exponent(kk - 1, &buf[2]);
+  }
+  // 1234e30 -> 1.234e33
+  memmove(&buf[2], &buf[1], len - 1);
+  buf[1] = '.';
+  buf[len + 1] = 'e';
+  return len + 2 + write_exponent(kk - 1, &buf[len + 2]);
+}
+
+
+size_t dc_format(double d, char *buf)
+{
+  if (isnan(d)) {
+    memcpy(buf, "nan", 3);
+    return 3;
+  }
+
+  size_t n = 0;
+  if (signbit(d)) {
+    buf[n++] = '-';
+    d = -d;
+  }
+  if (isinf(d)) {
+    memcpy(buf + n, "inf", 3);
+    return n + 3;
+  }
+  if (d == 0) {
+    buf[n++] = '0';
+    return n;
+  }
+
+  diy_fp v = fp_from_double(d);
+  diy_fp w_m, w_p;
+  normalized_boundaries(v, &w_m, &w_p);
+  int k;
+  const diy_fp c_mk = get_cached_power(w_p.e, &k);
+  const diy_fp w = fp_mul(fp_normalize(v), c_mk);
+  diy_fp wp = fp_mul(w_p, c_mk);
+  diy_fp wm = fp_mul(w_m, c_mk);
+  wm.f++;
+  wp.f--;
+  int len = digit_gen(w, wp, wp.f - wm.f, buf + n, &k);
+  return n + prettify(buf + n, len, k);
+}
+
+
+double dc_parse(const char *s, char **end)
+{
+#if FLT_EVAL_METHOD == 0 // the fast path requires strict double arithmetic
+  const char *p = s;
+  bool neg = false;
+  if (*p == '-') {
+    neg = true;
+    ++p;
+  } else if (*p == '+') {
+    ++p;
+  }
+
+  uint64_t m = 0;
+  int sig = 0;    // significant digits accumulated in m
+  int e10 = 0;
+  int ndigits = 0;
+  for (; *p >= '0' && *p <= '9'; ++p, ++ndigits) {
+    m = m * 10 + (uint64_t)(*p - '0');
+    if (m) ++sig;
+  }
+  if (*p == '.') {
+    ++p;
+    for (; *p >= '0' && *p <= '9'; ++p, ++ndigits) {
+      m = m * 10 + (uint64_t)(*p - '0');
+      if (m) ++sig;
+      --e10;
+    }
+  }
+  if (ndigits > 0 && sig <= 15 && e10 >= -22
+      && *p != 'e' && *p != 'E' && *p != 'x' && *p != 'X') {
+    double v = (double)m; // exact, m < 10^15 < 2^53
+    if (e10 < 0) v /= exact_pow10[-e10];
+    *end = (char *)p;
+    return neg ? -v : v;
+  }
+#endif
+  return strtod(s, end);
+}
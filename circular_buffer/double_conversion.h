@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Fast double to/from text conversion  @file */
+
+#ifndef double_conversion_h_
+#define double_conversion_h_
+
+#include <stddef.h>
+
+/**
+ * Minimum buffer size required by dc_format
+ */
+#define DC_BUFFER_SIZE 32
+
+/**
+ * Formats a double using the shortest representation that parses back to the
+ * identical value (Grisu2). Integers are written without a decimal point,
+ * numbers outside of [1e-6, 1e21) use exponential notation and the
+ * non-finite values are written as nan, inf and -inf.
+ *
+ * @param d Value to format
+ * @param buf Output buffer, at least DC_BUFFER_SIZE bytes (not NUL terminated)
+ *
+ * @return size_t Number of characters written
+ */
+size_t dc_format(double d, char *buf);
+
+/**
+ * Parses a double with the same semantics as strtod. Plain decimal numbers
+ * with up to 15 significant digits are converted exactly without calling
+ * strtod (Clinger's fast path), everything else falls back to strtod.
+ *
+ * @param s String to parse
+ * @param end Set to the first character after the number (s on failure)
+ *
+ * @return double Parsed value
+ */
+double dc_parse(const char *s, char **end);
+
+#endif
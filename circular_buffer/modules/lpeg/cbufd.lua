@@ -33,6 +33,14 @@ end
 1379660280      11837   154880
 ```
 
+### Sparse Circular Buffer Delta Input
+Produced by `cb:format("cbufd_sparse")`, only the changed cells are listed as
+`column:delta` pairs.
+```
+{"time":1379574900,"rows":1440,"columns":2,"seconds_per_row":60,"column_info":[{"name":"Requests","unit":"count","aggregation":"sum"},{"name":"Total_Size","unit":"KiB","aggregation":"sum"}]}
+1379660520      2:159901
+```
+
 ### Lua Table Output
 ```lua
 {
@@ -41,12 +49,16 @@ header='{"time":1379574900,"rows":1440,"columns":2,"seconds_per_row":60,"column_
 {11837, 154880, time = 1379660280000000000}
 }
 ```
+
+Sparse rows produce the same table shape with the unchanged columns left nil
+e.g. `{[2] = 159901, time = 1379660520000000000}`.
 --]]
 
 -- Imports
 local l = require "lpeg"
 l.locale(l)
 local tonumber = tonumber
+local rawset = rawset
 
 local M = {}
 setfenv(1, M) -- Remove external access to contain everything in the module
@@ -60,10 +72,15 @@ local header = l.Cg((1 - eol)^1, "header") * eol
 local timestamp = l.digit^1 / "%0000000000" / tonumber
 local sign = l.P"-"
 local float = l.digit^1 * "." * l.digit^1
+local exponent = l.S"eE" * l.S"+-"^-1 * l.digit^1
 local nan = l.P"nan" / not_a_number
-local number = (sign^-1 * (float + l.digit^1)) / tonumber
+local number = (sign^-1 * (float + l.digit^1) * exponent^-1) / tonumber
 + nan
-local row = l.Ct(l.Cg(timestamp, "time") * ("\t" * number)^1 * eol)
+local dense_row = l.Ct(l.Cg(timestamp, "time") * ("\t" * number)^1 * eol)
+local column = l.digit^1 / tonumber
+local cell = l.Cg(column * ":" * number)
+local sparse_row = l.Cf(l.Ct(l.Cg(timestamp, "time")) * ("\t" * cell)^1, rawset) * eol
+local row = sparse_row + dense_row
 
 grammar = l.Ct(header * row^1) * -1
 
@@ -150,6 +150,10 @@ static char* test_sandbox_delta()
               lsb_test_output);
   }
 
+  result = lsb_test_report(sb, 9);
+  mu_assert(result == 0, "report() received: %d error: %s", result,
+            lsb_get_error(sb));
+
   e = lsb_destroy(sb);
   mu_assert(!e, "lsb_destroy() received: %s", e);
 
@@ -164,6 +168,18 @@ static char* test_sandbox_delta()
   result = lsb_test_report(sb, 7);
   mu_assert(result == 0, "report() received: %d", result);
   mu_assert(strcmp("{\"time\":4,\"rows\":3,\"columns\":3,\"seconds_per_row\":1,\"column_info\":[{\"name\":\"Add_column\",\"unit\":\"count\",\"aggregation\":\"sum\"},{\"name\":\"Set_column\",\"unit\":\"count\",\"aggregation\":\"sum\"},{\"name\":\"Get_column\",\"unit\":\"count\",\"aggregation\":\"sum\"}],\"annotations\":[{\"x\":6000,\"col\":1,\"shortText\":\"i\",\"text\":\"anno preserve\"}]}\n6\t1\tnan\tnan\n", lsb_test_output) == 0, "received: %s", lsb_test_output);
+
+  result = lsb_test_report(sb, 8);
+  mu_assert(result == 0, "report() received: %d", result);
+  mu_assert(strcmp("{\"time\":5,\"rows\":3,\"columns\":3,\"seconds_per_row\":1,\"column_info\":[{\"name\":\"Add_column\",\"unit\":\"count\",\"aggregation\":\"sum\"},{\"name\":\"Set_column\",\"unit\":\"count\",\"aggregation\":\"sum\"},{\"name\":\"Get_column\",\"unit\":\"count\",\"aggregation\":\"sum\"}],\"annotations\":[]}\n7\t1:2\n", lsb_test_output) == 0, "received: %s", lsb_test_output);
+
+  result = lsb_test_report(sb, 10);
+  mu_assert(result == 0, "report() received: %d error: %s", result,
+            lsb_get_error(sb));
+
+  result = lsb_test_report(sb, 11);
+  mu_assert(result == 0, "report() received: %d error: %s", result,
+            lsb_get_error(sb));
   e = lsb_destroy(sb);
   mu_assert(!e, "lsb_destroy() received: %s", e);
   return NULL;
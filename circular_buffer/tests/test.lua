@@ -3,10 +3,11 @@
 -- file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
 require "circular_buffer"
+require "math"
 require "string"
 require "lpeg"
 local cbufd = require "lpeg.cbufd"
-assert(circular_buffer.version() == "1.0.2", circular_buffer.version())
+assert(circular_buffer.version() == "1.8.0", circular_buffer.version())
 
 local errors = {
     function() local cb = circular_buffer.new(2) end, -- new() incorrect # args
@@ -17,6 +18,8 @@ local errors = {
     function() local cb = circular_buffer.new(2, 1, nil) end, -- new() non numeric seconds_per_row
     function() local cb = circular_buffer.new(2, 1, 0) end, -- new() zero seconds_per_row
     function() local cb = circular_buffer.new(2, 257, 0) end, -- new() too many columns
+    function() local cb = circular_buffer.new(2, 1, 1, 1) end, -- new() non boolean columnar
+    function() local cb = circular_buffer.new(2, 1, 1, true, 1) end, -- new() incorrect # args
     function() local cb = circular_buffer.new(2, 1, 1) -- set() out of range column
     cb:set(0, 2, 1.0) end,
     function() local cb = circular_buffer.new(2, 1, 1) -- set() zero column
@@ -52,6 +55,42 @@ local errors = {
     cb:get_header() end, -- incorrect # args
     function() local cb = circular_buffer.new(10, 1, 1)
     cb:get_header(99) end, -- out of range column
+    function() local cb = circular_buffer.new(2, 1, 1) -- add_row() incorrect # args
+    cb:add_row(0) end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- add_row() non numeric value
+    cb:add_row(0, {"a"}) end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- add_row() too many values
+    cb:add_row(0, {1, 2}) end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- add_many() length mismatch
+    cb:add_many(0, {1, 1}, {1}) end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- add_many() column out of range
+    cb:add_many(0, {2}, {1}) end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- add_row() NaN value
+    cb:add_row(0, {0/0}) end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- add_many() NaN value
+    cb:add_many(0, {1}, {0/0}) end,
+    function() local cb = circular_buffer.new(2, 1, 60) -- add_tier() not a multiple
+    cb:add_tier(2, 90) end,
+    function() local cb = circular_buffer.new(2, 1, 60) -- add_tier() not coarser
+    cb:add_tier(2, 60) end,
+    function() local cb = circular_buffer.new(2, 1, 60) -- add_tier() already added
+    cb:add_tier(2, 3600); cb:add_tier(2, 7200) end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- compute() invalid op
+    cb:compute("invalid", 1) end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- compute() start > end
+    cb:compute("sum", 1, 2e9, 1e9) end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- compute() missing percentile
+    cb:compute("percentile", 1) end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- compute() invalid percentile
+    cb:compute("percentile", 1, nil, nil, 101) end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- mannwhitneyu() incorrect # args
+    cb:mannwhitneyu(1, 0, 0, 1e9) end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- get_view() start > end
+    cb:get_view(1, 1e9, 0) end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- view is read-only
+    local v = cb:get_view(1); v[1] = 1 end,
+    function() local cb = circular_buffer.new(2, 1, 1) -- view invalidated
+    local v = cb:get_view(1); cb:add(2e9, 1, 1); return v[1] end,
     function() local cb = circular_buffer.new(2, 1, 1) -- uninitialize a value
     cb:set(0, 1, 1); cb:set(0, 1, 0/0) end,
     function() local cb = circular_buffer.new(2, 1, 1) -- uninitialize a value
@@ -97,6 +136,24 @@ local tests = {
         assert(#a == 5, #a)
         for i=1, #a do assert(i == a[i]) end
         end,
+    function()
+        local stats = circular_buffer.new(4, 2, 1, true)
+        for i=1, 6 do
+            stats:set(i * 1e9, 1, i)
+            stats:add(i * 1e9, 2, -i)
+        end
+        local a = stats:get_range(1)
+        assert(#a == 4, #a)
+        for i=1, 4 do assert(a[i] == i + 2, a[i]) end
+        a = stats:get_range_delta(2)
+        for i=1, 4 do assert(a[i] == -(i + 2), a[i]) end
+        assert(stats:get(6e9, 2) == -6)
+        assert(not stats:get(2e9, 1), "value found beyond the start of the buffer")
+
+        stats:set(8e9, 1, 1) -- advance two rows
+        a = stats:get_range(1)
+        assert(a[1] == 5 and a[2] == 6 and a[3] ~= a[3] and a[4] == 1)
+        end,
     function()
         local stats = circular_buffer.new(2, 1, 1)
         local nan = stats:get(0, 1)
@@ -265,6 +322,116 @@ local tests = {
         if v == v then error(string.format("invalid delta value %G", v)) end
         end,
 
+    function()
+        local cb = circular_buffer.new(2, 3, 1)
+        assert(cb:add_row(1e9, {1, 2}) == 2)
+        assert(cb:add_row(1e9, {1, 2, 3}) == 3)
+        assert(cb:get(1e9, 1) == 2 and cb:get(1e9, 2) == 4 and cb:get(1e9, 3) == 3)
+        assert(cb:add_many(1e9, {3, 1}, {1, 5}) == 2)
+        assert(cb:get(1e9, 1) == 7 and cb:get(1e9, 3) == 4)
+        assert(cb:get_delta(1e9, 1) == 7)
+        assert(cb:add_row(3e9, {1}) == 1) -- advance the buffer
+        local v = cb:get(2e9, 1)
+        assert(v ~= v, "the skipped row was not cleared")
+        assert(not cb:add_row(0, {1}), "row outside of the buffer")
+        assert(not cb:add_many(0, {1}, {1}), "row outside of the buffer")
+
+        -- an invalid value rejects the whole row before anything is changed
+        cb:set(3e9, 2, 1/0)
+        assert(not pcall(cb.add_row, cb, 3e9, {1, -1/0}))
+        assert(not pcall(cb.add_many, cb, 3e9, {3, 2}, {1, -1/0}))
+        assert(not pcall(cb.add_many, cb, 3e9, {3, 3}, {1/0, -1/0}))
+        assert(not pcall(cb.add_many, cb, 3e9, {3, 1}, {1, 0/0}))
+        assert(cb:get(3e9, 1) == 1 and cb:get(3e9, 2) == 1/0)
+        v = cb:get(3e9, 3)
+        assert(v ~= v, "the row was partially updated")
+        assert(not pcall(cb.add_row, cb, 4e9, {1, 0/0}))
+        assert(cb:current_time() == 3e9, "the buffer was advanced")
+        end,
+    function()
+        for _, columnar in ipairs({false, true}) do
+            local cb = circular_buffer.new(4, 2, 1, columnar)
+            for i=0, 5 do cb:set(i * 1e9, 2, i) end -- wraps the buffer
+            local v = cb:get_view(2)
+            local r = cb:get_range(2)
+            assert(#v == 4 and #v == #r, #v)
+            for i=1, #r do assert(v[i] == r[i], i) end
+            assert(v[0] == nil and v[5] == nil and v.foo == nil)
+            v = cb:get_view(2, 3e9, 4e9)
+            assert(#v == 2 and v[1] == 3 and v[2] == 4)
+            assert(not cb:get_view(1, 0, 1e9), "range outside of the buffer")
+        end
+        end,
+    function()
+        local minute = circular_buffer.new(2, 4, 60)
+        minute:set_header(1, "count")
+        local hour = minute:add_tier(2, 3600)
+        local day = hour:add_tier(2, 86400)
+        minute:set_header(2, "low", "count", "min")
+        minute:set_header(3, "high", "count", "max")
+        minute:set_header(4, "last", "count", "none")
+        assert(select(3, day:get_header(3)) == "max")
+        for m=0, 181 do
+            local ns = m * 60e9
+            minute:add(ns, 1, 1)
+            minute:set(ns, 2, m)
+            minute:set(ns, 3, m)
+            minute:set(ns, 4, m)
+        end
+        -- minutes 0-179 have expired into the hour tier and hour 0 into the day
+        assert(hour:get(3600e9, 1) == 60 and hour:get(7200e9, 1) == 60)
+        assert(hour:get(7200e9, 2) == 120 and hour:get(7200e9, 3) == 179)
+        assert(hour:get(7200e9, 4) == 179)
+        assert(not hour:get(0, 1), "hour 0 should have expired")
+        assert(day:get(0, 1) == 60 and day:get(0, 2) == 0 and day:get(0, 3) == 59)
+        assert(minute:get(10860e9, 1) == 1)
+        end,
+    function()
+        for _, columnar in ipairs({false, true}) do
+            local cb = circular_buffer.new(5, 1, 1, columnar)
+            local v = {0/0, 1, 2, 3, 4}
+            for i=1, #v do cb:set(i * 1e9, 1, v[i]) end
+
+            local r, c = cb:compute("sum", 1)
+            assert(r == 10 and c == 4, r)
+            r, c = cb:compute("avg", 1)
+            assert(r == 2.5 and c == 4, r)
+            r = cb:compute("min", 1)
+            assert(r == 1, r)
+            r = cb:compute("max", 1)
+            assert(r == 4, r)
+            r = cb:compute("variance", 1)
+            assert(r == 1.25, r)
+            r = cb:compute("sd", 1)
+            assert(r == math.sqrt(1.25), r)
+            r = cb:compute("percentile", 1, nil, nil, 50)
+            assert(r == 2.5, r)
+            r = cb:compute("percentile", 1, nil, nil, 100)
+            assert(r == 4, r)
+            r, c = cb:compute("sum", 1, 3e9, 4e9)
+            assert(r == 5 and c == 2, r)
+            r, c = cb:compute("min", 1, 1e9, 1e9)
+            assert(r ~= r and c == 0, r)
+            assert(not cb:compute("sum", 1, 0, 1e9), "out of range")
+
+            cb:set(7e9, 1, 10) -- wrap the range
+            r, c = cb:compute("sum", 1)
+            assert(r == 19 and c == 4, r)
+        end
+        end,
+    function()
+        local x = {15309,14092,13661,13412,14205,15042,14142,13820,14917,13953,14320,14472,15133,13790,14539,14129,14363,14202,13841,13610}
+        local y = {13759,14428,14851,13838,13819,14468,14989,15557,14380,13500,14818,14632,13631,14663,14532,14188,14537,14109,13925,15022}
+        local cb = circular_buffer.new(40, 1, 1)
+        for i=1, #x do cb:set((i - 1) * 1e9, 1, x[i]) end
+        for i=1, #y do cb:set((i + 19) * 1e9, 1, y[i]) end
+        local u, p = cb:mannwhitneyu(1, 0, 19e9, 20e9, 39e9)
+        assert(u == 171, u)
+        assert(math.abs(p - 0.220374) < 0.000001, p)
+        u, p = cb:mannwhitneyu(1, 0, 19e9, 20e9, 39e9, false)
+        assert(u == 171, u)
+        assert(math.abs(p - 0.216387) < 0.000001, p)
+        end,
     function()
         local t = lpeg.match(cbufd.grammar, "header\n1\t2\t3\n2\tnan\t-4\n3\t-4.56\t5.67\n")
         assert(t)
@@ -282,6 +449,16 @@ local tests = {
         if t[3][1] ~= -4.56 then error("col 3 val 1:" .. t[3][1]) end
         if t[3][2] ~= 5.67 then error("col 3 val 2:" .. t[3][2]) end
     end,
+    function()
+        local t = lpeg.match(cbufd.grammar, "header\n1\t2:3\n2\t1:nan\t3:-4.5\n3\t1\t2\t3\n")
+        assert(t)
+        assert(t[1].time == 1e9 and t[1][1] == nil and t[1][2] == 3)
+        assert(t[2].time == 2e9 and t[2][1] ~= t[2][1] and t[2][2] == nil and t[2][3] == -4.5)
+        assert(t[3].time == 3e9 and t[3][1] == 1 and t[3][3] == 3)
+        assert(not lpeg.match(cbufd.grammar, "header\n1\t2:\n"))
+        t = lpeg.match(cbufd.grammar, "header\n1\t1e21\t-2.5e-7\n")
+        assert(t and t[1][1] == 1e21 and t[1][2] == -2.5e-7)
+    end,
 }
 
 for i, v in ipairs(tests) do
@@ -9,6 +9,9 @@ local ADD_COL = data:set_header(1, "Add column")
 local SET_COL = data:set_header(2, "Set column", "count")
 local GET_COL = data:set_header(3, "Get column", "count", "sum")
 
+local ok, err = pcall(data.fromstring, data, "CBUF" .. string.rep("\0", 28))
+assert(not ok and err:match("invalid binary header"), err)
+
 function process(ts)
     if data:add(ts, ADD_COL, 1) then
         data:set(ts, GET_COL, data:get(ts, ADD_COL))
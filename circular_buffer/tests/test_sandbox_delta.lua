@@ -9,15 +9,42 @@ local ADD_COL = data:set_header(1, "Add column")
 local SET_COL = data:set_header(2, "Set column", "count")
 local GET_COL = data:set_header(3, "Get column", "count", "sum")
 
+-- the same values kept in the binary preservation and columnar layouts
+binary = circular_buffer.new(3, 3, 1):preservation("binary")
+columnar = circular_buffer.new(3, 3, 1, true)
+
 local cb = circular_buffer.new(2, 2, 1)
+
+-- text preservation must restore every value bit for bit
+roundtrip = circular_buffer.new(2, 5, 1):preservation("text")
+local rt_values = {0.1, 1/3, 5e-324, 1.7976931348623157e308, 123456.789,
+    1e21, 1e-7, -2.5e-300, 9007199254740993, -0.0}
 local SUM_COL = cb:set_header(1, "Sum column")
 local MIN_COL = cb:set_header(2, "Min", "count", "min")
 
-function process(ts)
-    if data:add(ts, ADD_COL, 1) then
-        data:set(ts, GET_COL, data:get(ts, ADD_COL))
+local function update(b, ts)
+    if b:add(ts, ADD_COL, 1) then
+        b:set(ts, GET_COL, b:get(ts, ADD_COL))
     end
-    data:set(ts, SET_COL, 1)
+    b:set(ts, SET_COL, 1)
+end
+
+local function assert_same(b)
+    assert(b:current_time() == data:current_time(), b:current_time())
+    for c = 1, 3 do
+        local expected, received = data:get_range(c), b:get_range(c)
+        for i = 1, #expected do
+            local e, r = expected[i], received[i]
+            assert(e == r or (e ~= e and r ~= r),
+                   string.format("column %d row %d: %g", c, i, r))
+        end
+    end
+end
+
+function process(ts)
+    update(data, ts)
+    update(binary, ts)
+    update(columnar, ts)
     return 0
 end
 
@@ -47,6 +74,8 @@ function report(tc)
         write_output(data:format("cbufd"))
         data:add(6e9, ADD_COL, 1)
         data:annotate(6e9, ADD_COL, "info", "anno preserve")
+        binary:add(6e9, ADD_COL, 1)
+        columnar:add(6e9, ADD_COL, 1)
     elseif tc == 5 then
         cb:annotate(1e9, ADD_COL, "info", "delta anno")
         write_output(cb:format("cbufd")) -- annotation delta only
@@ -54,5 +83,20 @@ function report(tc)
         write_output(cb:format("cbufd")) -- no delta
     elseif tc == 7 then
         write_output(data:format("cbufd")) -- delta after restoration
+    elseif tc == 8 then
+        data:add(7e9, ADD_COL, 2)
+        write_output(data:format("cbufd_sparse"))
+    elseif tc == 9 then
+        for i, v in ipairs(rt_values) do
+            roundtrip:set((i > 5 and 1 or 0) * 1e9, (i - 1) % 5 + 1, v)
+        end
+    elseif tc == 10 then
+        for i, v in ipairs(rt_values) do
+            local r = roundtrip:get((i > 5 and 1 or 0) * 1e9, (i - 1) % 5 + 1)
+            assert(r == v and 1/r == 1/v, string.format("value %d: %.17g", i, r))
+        end
+    elseif tc == 11 then
+        assert_same(binary)
+        assert_same(columnar)
     end
 end
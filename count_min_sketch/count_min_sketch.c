@@ -0,0 +1,639 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+/** @brief Lua count-min sketch with a heavy hitters list @file */
+
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "../common/xxhash.h"
+
+#ifdef LUA_SANDBOX
+#include "luasandbox_output.h"
+#include "luasandbox_serialize.h"
+#endif
+
+static const char *module_name  = "mozsvc.count_min_sketch";
+static const char *module_table = "count_min_sketch";
+
+#define MAX_TOPK 100000
+#define MAX_COUNTERS (1 << 28)
+
+typedef struct topk_entry
+{
+  char *key; // allocated with the Lua allocator, NULL when unused
+  size_t len;
+  unsigned long long h;
+  uint32_t count;
+  unsigned heap; // position in the min heap
+  int type; // LUA_TSTRING or LUA_TNUMBER
+} topk_entry;
+
+typedef struct count_min_sketch
+{
+  double epsilon;
+  double delta;
+  unsigned width;
+  unsigned depth;
+  unsigned k;
+  unsigned k_cnt;
+  unsigned index_mask;
+  unsigned long long item_count;
+  unsigned long long unique_count;
+  topk_entry *entries;
+  unsigned *heap;  // entry indexes ordered by count (min first)
+  int *index;      // open addressing hash index of the entries, -1 is empty
+  uint32_t counters[]; // depth rows of width counters
+} count_min_sketch;
+
+
+static count_min_sketch* check_cms(lua_State *lua, int min, int max)
+{
+  count_min_sketch *cms = luaL_checkudata(lua, 1, module_name);
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n >= min && n <= max, 0,
+                "incorrect number of arguments");
+  return cms;
+}
+
+
+static void* check_key(lua_State *lua, int idx, size_t *len, double *val,
+                       int *type)
+{
+  void *key = NULL;
+  *type = lua_type(lua, idx);
+  switch (*type) {
+  case LUA_TSTRING:
+    key = (void *)lua_tolstring(lua, idx, len);
+    break;
+  case LUA_TNUMBER:
+    *val = lua_tonumber(lua, idx);
+    *len = sizeof(double);
+    key = val;
+    break;
+  default:
+    luaL_argerror(lua, idx, "must be a string or number");
+    break;
+  }
+  return key;
+}
+
+
+static void* cms_realloc(lua_State *lua, void *ptr, size_t osize,
+                         size_t nsize)
+{
+  void *ud;
+  lua_Alloc alloc = lua_getallocf(lua, &ud);
+  void *p = alloc(ud, ptr, osize, nsize);
+  if (!p && nsize) {
+    luaL_error(lua, "memory allocation failed");
+  }
+  return p;
+}
+
+
+static size_t align8(size_t n)
+{
+  return (n + 7) & ~(size_t)7;
+}
+
+
+static int cms_new(lua_State *lua)
+{
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n >= 2 && n <= 3, 0, "incorrect number of arguments");
+  double epsilon = luaL_checknumber(lua, 1);
+  luaL_argcheck(lua, 0 < epsilon && 1 > epsilon, 1,
+                "epsilon must be between 0 and 1");
+  double delta = luaL_checknumber(lua, 2);
+  luaL_argcheck(lua, 0 < delta && 1 > delta, 2,
+                "delta must be between 0 and 1");
+  lua_Integer k = luaL_optinteger(lua, 3, 0);
+  luaL_argcheck(lua, 0 <= k && k <= MAX_TOPK, 3,
+                "topk must be between 0 and 100000");
+
+  double width = ceil(exp(1) / epsilon);
+  double depth = ceil(log(1 / delta));
+  luaL_argcheck(lua, width * depth <= MAX_COUNTERS, 1,
+                "epsilon/delta require too many counters");
+
+  unsigned index_size = 0;
+  if (k) {
+    index_size = 2;
+    while (index_size < (unsigned)k * 2) index_size <<= 1;
+  }
+
+  size_t counters = (size_t)width * (size_t)depth;
+  size_t entries_off = align8(sizeof(count_min_sketch)
+                              + sizeof(uint32_t) * counters);
+  size_t heap_off = entries_off + sizeof(topk_entry) * k;
+  size_t index_off = align8(heap_off + sizeof(unsigned) * k);
+  size_t nbytes = index_off + sizeof(int) * index_size;
+
+  count_min_sketch *cms = lua_newuserdata(lua, nbytes);
+  cms->epsilon = epsilon;
+  cms->delta = delta;
+  cms->width = (unsigned)width;
+  cms->depth = (unsigned)depth;
+  cms->k = (unsigned)k;
+  cms->k_cnt = 0;
+  cms->index_mask = index_size - 1;
+  cms->item_count = 0;
+  cms->unique_count = 0;
+  cms->entries = (topk_entry *)((char *)cms + entries_off);
+  cms->heap = (unsigned *)((char *)cms + heap_off);
+  cms->index = (int *)((char *)cms + index_off);
+  memset(cms->counters, 0, sizeof(uint32_t) * counters);
+  memset(cms->entries, 0, sizeof(topk_entry) * k);
+  memset(cms->index, 0xff, sizeof(int) * index_size);
+
+  luaL_getmetatable(lua, module_name);
+  lua_setmetatable(lua, -2);
+  return 1;
+}
+
+
+/*
+ * Returns the counter position for the key hash in the given row, the key is
+ * hashed once with XXH64 and the rows are derived by double hashing (same
+ * scheme as the bloom_filter module).
+ */
+static inline size_t probe_counter(count_min_sketch *cms,
+                                   unsigned long long h, unsigned row)
+{
+  return (size_t)row * cms->width
+      + (size_t)(((h & 0xffffffff) + row * (h >> 32)) % cms->width);
+}
+
+
+static uint32_t point_query(count_min_sketch *cms, unsigned long long h)
+{
+  uint32_t est = UINT32_MAX;
+  for (unsigned i = 0; i < cms->depth; ++i) {
+    uint32_t c = cms->counters[probe_counter(cms, h, i)];
+    if (c < est) est = c;
+  }
+  return est;
+}
+
+
+/* Conservative update: only the counters below the new estimate are raised. */
+static uint32_t update(count_min_sketch *cms, unsigned long long h, uint32_t n)
+{
+  uint32_t est = point_query(cms, h);
+  if (est == 0) ++cms->unique_count;
+  cms->item_count += n;
+  est = est > UINT32_MAX - n ? UINT32_MAX : est + n;
+  for (unsigned i = 0; i < cms->depth; ++i) {
+    uint32_t *c = &cms->counters[probe_counter(cms, h, i)];
+    if (*c < est) *c = est;
+  }
+  return est;
+}
+
+
+static int find_entry(count_min_sketch *cms, unsigned long long h,
+                      const void *key, size_t len, int type)
+{
+  for (unsigned i = (unsigned)h & cms->index_mask;;
+       i = (i + 1) & cms->index_mask) {
+    int idx = cms->index[i];
+    if (idx < 0) return -1;
+    topk_entry *e = &cms->entries[idx];
+    if (e->h == h && e->type == type && e->len == len
+        && memcmp(e->key, key, len) == 0) {
+      return idx;
+    }
+  }
+}
+
+
+static void index_insert(count_min_sketch *cms, int idx)
+{
+  unsigned i = (unsigned)cms->entries[idx].h & cms->index_mask;
+  while (cms->index[i] >= 0) {
+    i = (i + 1) & cms->index_mask;
+  }
+  cms->index[i] = idx;
+}
+
+
+/* Linear probing deletion without tombstones (backward shift). */
+static void index_remove(count_min_sketch *cms, int idx)
+{
+  unsigned i = (unsigned)cms->entries[idx].h & cms->index_mask;
+  while (cms->index[i] != idx) {
+    i = (i + 1) & cms->index_mask;
+  }
+  unsigned j = i;
+  for (;;) {
+    cms->index[i] = -1;
+    for (;;) {
+      j = (j + 1) & cms->index_mask;
+      if (cms->index[j] < 0) return;
+      unsigned home = (unsigned)cms->entries[cms->index[j]].h
+          & cms->index_mask;
+      // move the entry back unless its home slot lies cyclically in (i, j]
+      if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+        continue;
+      }
+      break;
+    }
+    cms->index[i] = cms->index[j];
+    i = j;
+  }
+}
+
+
+static void heap_swap(count_min_sketch *cms, unsigned a, unsigned b)
+{
+  unsigned t = cms->heap[a];
+  cms->heap[a] = cms->heap[b];
+  cms->heap[b] = t;
+  cms->entries[cms->heap[a]].heap = a;
+  cms->entries[cms->heap[b]].heap = b;
+}
+
+
+static uint32_t heap_count(count_min_sketch *cms, unsigned pos)
+{
+  return cms->entries[cms->heap[pos]].count;
+}
+
+
+static void sift_up(count_min_sketch *cms, unsigned pos)
+{
+  while (pos > 0) {
+    unsigned parent = (pos - 1) / 2;
+    if (heap_count(cms, parent) <= heap_count(cms, pos)) break;
+    heap_swap(cms, parent, pos);
+    pos = parent;
+  }
+}
+
+
+static void sift_down(count_min_sketch *cms, unsigned pos)
+{
+  for (;;) {
+    unsigned min = pos;
+    unsigned l = pos * 2 + 1;
+    unsigned r = l + 1;
+    if (l < cms->k_cnt && heap_count(cms, l) < heap_count(cms, min)) min = l;
+    if (r < cms->k_cnt && heap_count(cms, r) < heap_count(cms, min)) min = r;
+    if (min == pos) break;
+    heap_swap(cms, pos, min);
+    pos = min;
+  }
+}
+
+
+// keys are allocated with at least one byte so empty strings have a buffer
+static void free_entry_key(lua_State *lua, topk_entry *e)
+{
+  if (e->key) {
+    cms_realloc(lua, e->key, e->len ? e->len : 1, 0);
+    e->key = NULL;
+    e->len = 0;
+  }
+}
+
+
+static char* copy_key(lua_State *lua, const void *key, size_t len)
+{
+  char *k = cms_realloc(lua, NULL, 0, len ? len : 1);
+  memcpy(k, key, len);
+  return k;
+}
+
+
+// takes ownership of k (allocated by copy_key)
+static void set_entry_key(lua_State *lua, topk_entry *e, unsigned long long h,
+                          char *k, size_t len, int type)
+{
+  free_entry_key(lua, e);
+  e->key = k;
+  e->len = len;
+  e->h = h;
+  e->type = type;
+}
+
+
+/*
+ * Space-Saving style top-K maintenance: a tracked key has its count refreshed,
+ * an untracked key replaces the minimum entry when its estimate is larger.
+ * The counts are the conservative update estimates of the sketch. NaN keys
+ * are not tracked since they cannot be used as a heavy_hitters table key.
+ */
+static void topk_offer(lua_State *lua, count_min_sketch *cms,
+                       unsigned long long h, const void *key, size_t len,
+                       int type, uint32_t count)
+{
+  if (!cms->k) return;
+  if (type == LUA_TNUMBER && isnan(*(const double *)key)) return;
+
+  int idx = find_entry(cms, h, key, len, type);
+  if (idx >= 0) {
+    topk_entry *e = &cms->entries[idx];
+    if (count > e->count) {
+      e->count = count;
+      sift_down(cms, e->heap);
+    }
+    return;
+  }
+
+  if (cms->k_cnt < cms->k) {
+    idx = (int)cms->k_cnt;
+    topk_entry *e = &cms->entries[idx];
+    set_entry_key(lua, e, h, copy_key(lua, key, len), len, type);
+    e->count = count;
+    e->heap = cms->k_cnt;
+    cms->heap[cms->k_cnt++] = (unsigned)idx;
+    index_insert(cms, idx);
+    sift_up(cms, e->heap);
+    return;
+  }
+
+  idx = (int)cms->heap[0];
+  topk_entry *e = &cms->entries[idx];
+  if (count <= e->count) return;
+  // allocate before unlinking so an allocation error leaves the index intact
+  char *k = copy_key(lua, key, len);
+  index_remove(cms, idx);
+  set_entry_key(lua, e, h, k, len, type);
+  e->count = count;
+  index_insert(cms, idx);
+  sift_down(cms, 0);
+}
+
+
+static void topk_clear(lua_State *lua, count_min_sketch *cms)
+{
+  for (unsigned i = 0; i < cms->k_cnt; ++i) {
+    free_entry_key(lua, &cms->entries[i]);
+  }
+  cms->k_cnt = 0;
+  if (cms->k) {
+    memset(cms->index, 0xff, sizeof(int) * (cms->index_mask + 1));
+  }
+}
+
+
+static int cms_update(lua_State *lua)
+{
+  count_min_sketch *cms = check_cms(lua, 2, 3);
+  size_t len = 0;
+  double val = 0;
+  int type;
+  void *key = check_key(lua, 2, &len, &val, &type);
+  lua_Integer n = luaL_optinteger(lua, 3, 1);
+  luaL_argcheck(lua, n > 0 && (unsigned long long)n <= UINT32_MAX, 3,
+                "n must be > 0");
+
+  unsigned long long h = XXH64(key, len, 0);
+  uint32_t est = update(cms, h, (uint32_t)n);
+  topk_offer(lua, cms, h, key, len, type, est);
+  lua_pushnumber(lua, est);
+  return 1;
+}
+
+
+static int cms_point_query(lua_State *lua)
+{
+  count_min_sketch *cms = check_cms(lua, 2, 2);
+  size_t len = 0;
+  double val = 0;
+  int type;
+  void *key = check_key(lua, 2, &len, &val, &type);
+  lua_pushnumber(lua, point_query(cms, XXH64(key, len, 0)));
+  return 1;
+}
+
+
+static int cms_item_count(lua_State *lua)
+{
+  count_min_sketch *cms = check_cms(lua, 1, 1);
+  lua_pushnumber(lua, (lua_Number)cms->item_count);
+  return 1;
+}
+
+
+static int cms_unique_count(lua_State *lua)
+{
+  count_min_sketch *cms = check_cms(lua, 1, 1);
+  lua_pushnumber(lua, (lua_Number)cms->unique_count);
+  return 1;
+}
+
+
+static void push_key(lua_State *lua, topk_entry *e)
+{
+  if (e->type == LUA_TNUMBER) {
+    double d;
+    memcpy(&d, e->key, sizeof(d));
+    lua_pushnumber(lua, d);
+  } else {
+    lua_pushlstring(lua, e->key, e->len);
+  }
+}
+
+
+static int cms_heavy_hitters(lua_State *lua)
+{
+  count_min_sketch *cms = check_cms(lua, 1, 1);
+  lua_createtable(lua, 0, cms->k_cnt);
+  for (unsigned i = 0; i < cms->k_cnt; ++i) {
+    topk_entry *e = &cms->entries[i];
+    push_key(lua, e);
+    lua_pushnumber(lua, e->count);
+    lua_rawset(lua, -3);
+  }
+  return 1;
+}
+
+
+static int cms_merge(lua_State *lua)
+{
+  count_min_sketch *cms = check_cms(lua, 2, 2);
+  count_min_sketch *other = luaL_checkudata(lua, 2, module_name);
+  luaL_argcheck(lua, cms->width == other->width
+                && cms->depth == other->depth, 2,
+                "the sketch dimensions must match");
+  if (cms == other) return 0;
+
+  size_t counters = (size_t)cms->width * cms->depth;
+  for (size_t i = 0; i < counters; ++i) {
+    uint32_t c = cms->counters[i];
+    uint32_t o = other->counters[i];
+    cms->counters[i] = c > UINT32_MAX - o ? UINT32_MAX : c + o;
+  }
+  cms->item_count += other->item_count;
+  cms->unique_count += other->unique_count;
+
+  if (cms->k) {
+    // refresh the tracked estimates and offer the other heavy hitters
+    for (unsigned i = 0; i < cms->k_cnt; ++i) {
+      cms->entries[i].count = point_query(cms, cms->entries[i].h);
+    }
+    for (unsigned i = cms->k_cnt / 2; i-- > 0;) {
+      sift_down(cms, i);
+    }
+    for (unsigned i = 0; i < other->k_cnt; ++i) {
+      topk_entry *e = &other->entries[i];
+      topk_offer(lua, cms, e->h, e->key, e->len, e->type,
+                 point_query(cms, e->h));
+    }
+  }
+  return 0;
+}
+
+
+static int cms_clear(lua_State *lua)
+{
+  count_min_sketch *cms = check_cms(lua, 1, 1);
+  memset(cms->counters, 0, sizeof(uint32_t) * cms->width * cms->depth);
+  cms->item_count = 0;
+  cms->unique_count = 0;
+  topk_clear(lua, cms);
+  return 0;
+}
+
+
+static int cms_gc(lua_State *lua)
+{
+  count_min_sketch *cms = luaL_checkudata(lua, 1, module_name);
+  topk_clear(lua, cms);
+  return 0;
+}
+
+
+static int cms_version(lua_State *lua)
+{
+  lua_pushstring(lua, DIST_VERSION);
+  return 1;
+}
+
+
+#ifdef LUA_SANDBOX
+static int cms_fromstring(lua_State *lua)
+{
+  count_min_sketch *cms = check_cms(lua, 4, 5);
+  unsigned long long items = (unsigned long long)luaL_checknumber(lua, 2);
+  unsigned long long uniques = (unsigned long long)luaL_checknumber(lua, 3);
+  size_t len = 0;
+  const char *values = luaL_checklstring(lua, 4, &len);
+  size_t bytes = sizeof(uint32_t) * cms->width * cms->depth;
+  if (len != bytes) {
+    luaL_error(lua, "fromstring() bytes found: %d, expected %d", (int)len,
+               (int)bytes);
+  }
+  if (!lua_isnoneornil(lua, 5)) {
+    luaL_checktype(lua, 5, LUA_TTABLE);
+  }
+  topk_clear(lua, cms);
+  memcpy(cms->counters, values, len);
+  cms->item_count = items;
+  cms->unique_count = uniques;
+
+  // re-populate the heavy hitters with the restored estimates
+  int cnt = lua_isnoneornil(lua, 5) ? 0 : (int)lua_objlen(lua, 5);
+  for (int i = 1; i <= cnt; ++i) {
+    lua_rawgeti(lua, 5, i);
+    size_t klen = 0;
+    double val = 0;
+    int type;
+    void *key = check_key(lua, -1, &klen, &val, &type);
+    unsigned long long h = XXH64(key, klen, 0);
+    topk_offer(lua, cms, h, key, klen, type, point_query(cms, h));
+    lua_pop(lua, 1);
+  }
+  return 0;
+}
+
+
+static int serialize_count_min_sketch(lua_State *lua)
+{
+  lsb_output_buffer *ob = lua_touserdata(lua, -1);
+  const char *key = lua_touserdata(lua, -2);
+  count_min_sketch *cms = lua_touserdata(lua, -3);
+  if (!(ob && key && cms)) {
+    return 1;
+  }
+  if (lsb_outputf(ob, "if %s == nil then %s = %s.new(%.17g, %.17g, %u) end\n",
+                  key, key, module_table, cms->epsilon, cms->delta, cms->k)) {
+    return 1;
+  }
+
+  if (lsb_outputf(ob, "%s:fromstring(%llu, %llu, \"", key, cms->item_count,
+                  cms->unique_count)) {
+    return 1;
+  }
+  if (lsb_serialize_binary(ob, cms->counters,
+                           sizeof(uint32_t) * cms->width * cms->depth)) {
+    return 1;
+  }
+  if (lsb_outputs(ob, "\", {", 4)) return 1;
+  for (unsigned i = 0; i < cms->k_cnt; ++i) {
+    topk_entry *e = &cms->entries[i];
+    if (e->type == LUA_TNUMBER) {
+      double d;
+      memcpy(&d, e->key, sizeof(d));
+      if (lsb_serialize_double(ob, d)) return 1;
+      if (lsb_outputc(ob, ',')) return 1;
+    } else {
+      if (lsb_outputc(ob, '"')) return 1;
+      if (lsb_serialize_binary(ob, e->key, e->len)) return 1;
+      if (lsb_outputs(ob, "\",", 2)) return 1;
+    }
+  }
+  if (lsb_outputs(ob, "})\n", 3)) return 1;
+  return 0;
+}
+#endif
+
+
+static const struct luaL_reg count_min_sketchlib_f[] =
+{
+  { "new", cms_new }
+  , { "version", cms_version }
+  , { NULL, NULL }
+};
+
+
+static const struct luaL_reg count_min_sketchlib_m[] =
+{
+  { "update", cms_update }
+  , { "point_query", cms_point_query }
+  , { "item_count", cms_item_count }
+  , { "unique_count", cms_unique_count }
+  , { "heavy_hitters", cms_heavy_hitters }
+  , { "merge", cms_merge }
+  , { "clear", cms_clear }
+#ifdef LUA_SANDBOX
+  , { "fromstring", cms_fromstring } // used for data restoration
+#endif
+  , { "__gc", cms_gc }
+  , { NULL, NULL }
+};
+
+
+int luaopen_count_min_sketch(lua_State *lua)
+{
+#ifdef LUA_SANDBOX
+  lua_newtable(lua);
+  lsb_add_serialize_function(lua, serialize_count_min_sketch);
+  lua_replace(lua, LUA_ENVIRONINDEX);
+#endif
+  luaL_newmetatable(lua, module_name);
+  lua_pushvalue(lua, -1);
+  lua_setfield(lua, -2, "__index");
+  luaL_register(lua, NULL, count_min_sketchlib_m);
+  luaL_register(lua, module_table, count_min_sketchlib_f);
+  return 1;
+}
@@ -0,0 +1,151 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <luasandbox/heka/sandbox.h>
+#include <luasandbox/test/mu_test.h>
+#include <luasandbox/test/sandbox.h>
+
+#include "test_module.h"
+
+char *e = NULL;
+
+
+static char* test_core()
+{
+  lsb_lua_sandbox *sb = lsb_create(NULL, "test.lua", TEST_MODULE_PATH, NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+
+  lsb_err_value ret = lsb_init(sb, NULL);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+  return NULL;
+}
+
+
+static char* test_sandbox()
+{
+  const char *output_file = "count_min_sketch.preserve";
+  const char *tests[] = {
+    "2 2 1 1",
+    "3 3 1 1",
+    "4 4 1 1",
+    NULL
+  };
+
+  remove(output_file);
+  lsb_lua_sandbox *sb = lsb_create(NULL, "test_sandbox.lua", TEST_MODULE_PATH,
+                                   NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+
+  lsb_err_value ret = lsb_init(sb, output_file);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+  lsb_add_function(sb, &lsb_test_write_output, "write_output");
+
+  int i = 0;
+  for (; tests[i]; ++i) {
+    int result = lsb_test_process(sb, i);
+    mu_assert(result == 0, "lsb_test_process() received: %d %s", result,
+              lsb_get_error(sb));
+    result = lsb_test_report(sb, 0);
+    mu_assert(result == 0, "lsb_test_report() received: %d", result);
+    mu_assert(strcmp(tests[i], lsb_test_output) == 0, "test: %d received: %s",
+              i, lsb_test_output);
+  }
+
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+
+  // re-load to test the preserved data (including the heavy hitters)
+  sb = lsb_create(NULL, "test_sandbox.lua", TEST_MODULE_PATH, NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+
+  ret = lsb_init(sb, output_file);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+  lsb_add_function(sb, &lsb_test_write_output, "write_output");
+
+  lsb_test_report(sb, 0);
+  mu_assert(strcmp("4 4 1 1", lsb_test_output) == 0,
+            "test: reload received: %s", lsb_test_output);
+
+  for (i = 0; tests[i]; ++i) {
+    int result = lsb_test_process(sb, i);
+    mu_assert(result == 0, "lsb_test_process() received: %d %s", result,
+              lsb_get_error(sb));
+  }
+  int result = lsb_test_report(sb, 0);
+  mu_assert(result == 0, "lsb_test_report() received: %d", result);
+  mu_assert(strcmp("8 4 2 2", lsb_test_output) == 0,
+            "test: data replay received: %s", lsb_test_output);
+
+  // test clear
+  lsb_test_report(sb, 99);
+  lsb_test_process(sb, 0);
+  lsb_test_report(sb, 0);
+  mu_assert(strcmp("2 2 1 1", lsb_test_output) == 0,
+            "test: clear received: %s", lsb_test_output);
+
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+  return NULL;
+}
+
+
+static char* benchmark()
+{
+  int iter = 1000000;
+
+  lsb_lua_sandbox *sb = lsb_create(NULL, "test_sandbox.lua", TEST_MODULE_PATH,
+                                   NULL);
+  mu_assert(sb, "lsb_create() received: NULL");
+  lsb_err_value ret = lsb_init(sb, NULL);
+  mu_assert(!ret, "lsb_init() received: %s %s", ret, lsb_get_error(sb));
+  lsb_add_function(sb, &lsb_test_write_output, "write_output");
+
+  clock_t t = clock();
+  for (int x = 0; x < iter; ++x) { // test update speed
+    mu_assert(0 == lsb_test_process(sb, x), "%s", lsb_get_error(sb));
+  }
+  t = clock() - t;
+  lsb_test_report(sb, 0);
+  mu_assert(strcmp("1333334 4 333334 333334", lsb_test_output) == 0,
+            "received: %s", lsb_test_output);
+  mu_assert(lsb_get_state(sb) == LSB_RUNNING, "benchmark failed %s",
+            lsb_get_error(sb));
+  e = lsb_destroy(sb);
+  mu_assert(!e, "lsb_destroy() received: %s", e);
+  printf("benchmark %g seconds\n", ((double)t) / CLOCKS_PER_SEC / iter);
+  return NULL;
+}
+
+
+static char* all_tests()
+{
+  mu_run_test(test_core);
+  mu_run_test(test_sandbox);
+  mu_run_test(benchmark);
+  return NULL;
+}
+
+
+int main()
+{
+  char *result = all_tests();
+  if (result) {
+    printf("%s\n", result);
+  } else {
+    printf("ALL TESTS PASSED\n");
+  }
+  printf("Tests run: %d\n", mu_tests_run);
+  free(e);
+
+  return result != 0;
+}
@@ -0,0 +1,106 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "count_min_sketch"
+assert(count_min_sketch.version() == "1.0.0", count_min_sketch.version())
+
+local errors = {
+    function() local cms = count_min_sketch.new(0.01) end, -- new() incorrect # args
+    function() local cms = count_min_sketch.new(0.01, 0.01, 1, 1) end, -- new() incorrect # args
+    function() local cms = count_min_sketch.new(nil, 0.01) end, -- new() non numeric epsilon
+    function() local cms = count_min_sketch.new(0, 0.01) end, -- invalid epsilon
+    function() local cms = count_min_sketch.new(0.01, 1) end, -- invalid delta
+    function() local cms = count_min_sketch.new(0.01, 0.01, -1) end, -- invalid topk
+    function() local cms = count_min_sketch.new(1e-9, 1e-9) end, -- too many counters
+    function()
+        local cms = count_min_sketch.new(0.01, 0.01)
+        cms:update() --incorrect # args
+    end,
+    function()
+        local cms = count_min_sketch.new(0.01, 0.01)
+        cms:update({}) --incorrect argument type
+    end,
+    function()
+        local cms = count_min_sketch.new(0.01, 0.01)
+        cms:update("a", 0) --invalid count
+    end,
+    function()
+        local cms = count_min_sketch.new(0.01, 0.01)
+        cms:point_query() --incorrect # args
+    end,
+    function()
+        local cms = count_min_sketch.new(0.01, 0.01)
+        cms:clear(1) --incorrect # args
+    end,
+    function()
+        local cms = count_min_sketch.new(0.01, 0.01)
+        cms:merge(count_min_sketch.new(0.02, 0.01)) -- dimension mismatch
+    end,
+}
+
+for i, v in ipairs(errors) do
+    local ok = pcall(v)
+    if ok then error(string.format("error test %d failed\n", i)) end
+end
+
+local cms = count_min_sketch.new(0.01, 0.01, 3)
+assert(cms:item_count() == 0, cms:item_count())
+assert(cms:unique_count() == 0, cms:unique_count())
+assert(cms:point_query(1) == 0, cms:point_query(1))
+
+for i=1, 100 do
+    for j=1, i % 10 + 1 do
+        cms:update(i)
+    end
+end
+assert(cms:item_count() == 550, cms:item_count())
+assert(cms:unique_count() == 100, cms:unique_count())
+assert(cms:point_query(9) == 10, cms:point_query(9))
+assert(cms:point_query(1) == 2, cms:point_query(1))
+assert(cms:point_query(1000) == 0, cms:point_query(1000))
+
+local hh = cms:heavy_hitters()
+local cnt = 0
+for k, v in pairs(hh) do
+    assert(k % 10 == 9, k)
+    assert(v == 10, v)
+    cnt = cnt + 1
+end
+assert(cnt == 3, cnt)
+
+assert(cms:update("foo", 20) == 20)
+assert(cms:point_query("foo") == 20, cms:point_query("foo"))
+hh = cms:heavy_hitters()
+assert(hh.foo == 20, tostring(hh.foo))
+
+local cms1 = count_min_sketch.new(0.01, 0.01, 3)
+cms1:update("bar", 30)
+cms1:update("foo", 5)
+cms:merge(cms1)
+assert(cms:item_count() == 605, cms:item_count())
+assert(cms:point_query("foo") == 25, cms:point_query("foo"))
+hh = cms:heavy_hitters()
+assert(hh.bar == 30, tostring(hh.bar))
+assert(hh.foo == 25, tostring(hh.foo))
+
+cms:clear()
+assert(cms:item_count() == 0, cms:item_count())
+assert(cms:unique_count() == 0, cms:unique_count())
+assert(cms:point_query("foo") == 0, cms:point_query("foo"))
+assert(next(cms:heavy_hitters()) == nil)
+
+-- NaN keys are counted but not tracked
+assert(cms:update(0/0, 50) == 50)
+assert(cms:point_query(0/0) == 50, cms:point_query(0/0))
+assert(next(cms:heavy_hitters()) == nil)
+cms:clear()
+
+-- no heavy hitter tracking
+cms = count_min_sketch.new(0.001, 0.001)
+for i=1, 10000 do
+    cms:update(tostring(i % 1000))
+end
+assert(cms:point_query("1") == 10, cms:point_query("1"))
+assert(cms:unique_count() == 1000, cms:unique_count())
+assert(next(cms:heavy_hitters()) == nil)
@@ -0,0 +1,29 @@
+-- This Source Code Form is subject to the terms of the Mozilla Public
+-- License, v. 2.0. If a copy of the MPL was not distributed with this
+-- file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+require "count_min_sketch"
+
+cms = count_min_sketch.new(0.01, 0.01, 2)
+
+local ok, err = pcall(cms.fromstring, cms, 0, 0, {})
+assert(not ok) --incorrect argument type
+
+local ok, err = pcall(cms.fromstring, cms, 0, 0, "                       ")
+assert(not ok) --incorrect argument length
+
+function process(ts)
+    cms:update(tostring(ts % 3))
+    if ts % 3 == 0 then cms:update(0) end
+    return 0
+end
+
+function report(tc)
+    if tc == 99 then
+        cms:clear()
+    else
+        local hh = cms:heavy_hitters()
+        write_output(cms:item_count(), " ", cms:unique_count(), " ",
+                     hh["0"] or 0, " ", hh[0] or 0)
+    end
+end
@@ -12,6 +12,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CF_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CF_NEON
+#endif
+
 #include "common.h"
 #include "lauxlib.h"
 #include "lua.h"
@@ -25,11 +33,19 @@
 static const char *module_name  = "mozsvc.cuckoo_filter";
 static const char *module_table = "cuckoo_filter";
 
-typedef struct cuckoo_bucket
-{
-  uint16_t entries[BUCKET_SIZE];
-} cuckoo_bucket;
+#define RNG_SEED 2463534242u
+
+#define CACHE_LINE 64
+#define BFS_MAX_DEPTH 5
+#define BFS_QUEUE_SIZE 512
 
+typedef struct bfs_node
+{
+  unsigned bucket;
+  int parent;   // index of the parent node in the queue, -1 for the roots
+  int slot;     // slot in the parent bucket whose entry moves into this bucket
+  int depth;
+} bfs_node;
 
 typedef struct cuckoo_filter
 {
@@ -38,27 +54,34 @@ typedef struct cuckoo_filter
   size_t num_buckets;
   size_t cnt;
   int nlz;
-  cuckoo_bucket buckets[];
+  unsigned bucket_size;
+  uint32_t rng;
+  unsigned char buf[]; // bytes + CACHE_LINE - 1 (for alignment)
 } cuckoo_filter;
 
 
 static int cf_new(lua_State *lua)
 {
   int n = lua_gettop(lua);
-  luaL_argcheck(lua, n == 1, 0, "incorrect number of arguments");
+  luaL_argcheck(lua, n == 1 || n == 2, 0, "incorrect number of arguments");
   int items = luaL_checkint(lua, 1);
   luaL_argcheck(lua, items > 4, 1, "items must be > 4");
+  int bucket_size = luaL_optint(lua, 2, BUCKET_SIZE);
+  luaL_argcheck(lua, bucket_size == 4 || bucket_size == 8, 2,
+                "bucket_size must be 4 or 8");
 
-  unsigned buckets  = clp2((unsigned)ceil(items / BUCKET_SIZE));
-  size_t bytes      = sizeof(cuckoo_bucket) * buckets;
-  size_t nbytes     = sizeof(cuckoo_filter) + bytes;
+  unsigned buckets  = clp2((unsigned)ceil(items / bucket_size));
+  size_t bytes      = sizeof(uint16_t) * bucket_size * buckets;
+  size_t nbytes     = sizeof(cuckoo_filter) + bytes + CACHE_LINE - 1;
   cuckoo_filter *cf = (cuckoo_filter *)lua_newuserdata(lua, nbytes);
-  cf->items         = buckets * BUCKET_SIZE;
+  cf->items         = buckets * bucket_size;
   cf->num_buckets   = buckets;
   cf->bytes         = bytes;
   cf->cnt           = 0;
   cf->nlz           = nlz(buckets) + 1;
-  memset(cf->buckets, 0, cf->bytes);
+  cf->bucket_size   = bucket_size;
+  cf->rng           = RNG_SEED;
+  memset(cf->buf, 0, cf->bytes + CACHE_LINE - 1);
   luaL_getmetatable(lua, module_name);
   lua_setmetatable(lua, -2);
   return 1;
@@ -74,33 +97,188 @@ static cuckoo_filter* check_cuckoo_filter(lua_State *lua, int args)
 }
 
 
-static bool bucket_lookup(cuckoo_bucket *b, uint16_t fp)
+/*
+ * The bucket array is aligned to a cache line so a bucket (8 or 16 bytes)
+ * never straddles two lines and can be loaded with a single aligned vector
+ * load.
+ */
+static inline uint16_t* get_bucket(cuckoo_filter *cf, unsigned i)
 {
-  for (int i = 0; i < BUCKET_SIZE; ++i) {
-    if (b->entries[i] == fp) return true;
+  uint16_t *entries = (uint16_t *)(((uintptr_t)cf->buf + CACHE_LINE - 1)
+                                   & ~(uintptr_t)(CACHE_LINE - 1));
+  return entries + (size_t)i * cf->bucket_size;
+}
+
+
+/*
+ * Returns the index of the first entry in the bucket matching fp or -1 if it
+ * is not found.
+ */
+static inline int bucket_find(cuckoo_filter *cf, uint16_t *b, uint16_t fp)
+{
+#if defined(CF_SSE2)
+  __m128i v;
+  if (cf->bucket_size == 8) {
+    v = _mm_load_si128((const __m128i *)b);
+  } else {
+    v = _mm_loadl_epi64((const __m128i *)b);
+  }
+  unsigned mask = (unsigned)_mm_movemask_epi8(
+      _mm_cmpeq_epi16(v, _mm_set1_epi16((short)fp)));
+  mask &= (1u << cf->bucket_size * 2) - 1;
+  if (!mask) return -1;
+  int i = 0;
+  while (!(mask & 1u << i * 2)) ++i;
+  return i;
+#elif defined(CF_NEON)
+  uint64_t mask;
+  if (cf->bucket_size == 8) {
+    uint16x8_t c = vceqq_u16(vld1q_u16(b), vdupq_n_u16(fp));
+    mask = vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(c)), 0);
+  } else {
+    uint16x4_t c = vceq_u16(vld1_u16(b), vdup_n_u16(fp));
+    mask = vget_lane_u64(vreinterpret_u64_u16(c), 0);
+  }
+  if (!mask) return -1;
+  int shift = cf->bucket_size == 8 ? 8 : 16;
+  int i = 0;
+  while (!(mask & (uint64_t)1 << i * shift)) ++i;
+  return i;
+#else
+  for (unsigned i = 0; i < cf->bucket_size; ++i) {
+    if (b[i] == fp) return (int)i;
+  }
+  return -1;
+#endif
+}
+
+
+static inline bool bucket_lookup(cuckoo_filter *cf, uint16_t *b, uint16_t fp)
+{
+  return bucket_find(cf, b, fp) >= 0;
+}
+
+
+/*
+ * Checks both candidate buckets for fp, with four entry buckets both are
+ * tested with a single vector compare.
+ */
+static inline bool bucket_pair_lookup(cuckoo_filter *cf, unsigned i1,
+                                      unsigned i2, uint16_t fp)
+{
+  uint16_t *b1 = get_bucket(cf, i1);
+  uint16_t *b2 = get_bucket(cf, i2);
+#if defined(CF_SSE2)
+  if (cf->bucket_size == 4) {
+    __m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)b1),
+                                   _mm_loadl_epi64((const __m128i *)b2));
+    return _mm_movemask_epi8(_mm_cmpeq_epi16(v, _mm_set1_epi16((short)fp)));
+  }
+#elif defined(CF_NEON)
+  if (cf->bucket_size == 4) {
+    uint16x8_t c = vceqq_u16(vcombine_u16(vld1_u16(b1), vld1_u16(b2)),
+                             vdupq_n_u16(fp));
+    return vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(c)), 0);
+  }
+#endif
+  return bucket_lookup(cf, b1, fp) || bucket_lookup(cf, b2, fp);
+}
+
+
+static bool bucket_delete(cuckoo_filter *cf, uint16_t *b, uint16_t fp)
+{
+  int i = bucket_find(cf, b, fp);
+  if (i >= 0) {
+    b[i] = 0;
+    return true;
   }
   return false;
 }
 
 
-static bool bucket_delete(cuckoo_bucket *b, uint16_t fp)
+static bool bucket_add(cuckoo_filter *cf, uint16_t *b, uint16_t fp)
 {
-  for (int i = 0; i < BUCKET_SIZE; ++i) {
-    if (b->entries[i] == fp) {
-      b->entries[i] = 0;
-      return true;
-    }
+  int i = bucket_find(cf, b, 0);
+  if (i >= 0) {
+    b[i] = fp;
+    return true;
   }
   return false;
 }
 
 
-static bool bucket_add(cuckoo_bucket *b, uint16_t fp)
+/*
+ * Marsaglia xorshift32, each filter carries its own state so the eviction
+ * order only depends on the filter's insert history.
+ */
+static inline uint32_t next_rand(cuckoo_filter *cf)
 {
-  for (int i = 0; i < BUCKET_SIZE; ++i) {
-    if (b->entries[i] == 0) {
-      b->entries[i] = fp;
-      return true;
+  uint32_t x = cf->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return cf->rng = x;
+}
+
+
+static inline unsigned alt_index(cuckoo_filter *cf, unsigned i, uint16_t fp)
+{
+  return i ^ (XXH64(&fp, sizeof(uint16_t), 1) >> (cf->nlz + 32));
+}
+
+
+static bool on_path(bfs_node *queue, int node, unsigned bucket)
+{
+  for (; node >= 0; node = queue[node].parent) {
+    if (queue[node].bucket == bucket) return true;
+  }
+  return false;
+}
+
+
+/*
+ * Breadth first search for the shortest cuckoo path from one of the two full
+ * candidate buckets to a bucket with a free slot (libcuckoo). Nothing is
+ * moved until a path is found so the work is bounded by the queue size and a
+ * failed insert leaves the filter unchanged.
+ */
+static bool bfs_insert(cuckoo_filter *cf, unsigned i1, unsigned i2,
+                       uint16_t fp)
+{
+  bfs_node queue[BFS_QUEUE_SIZE];
+  queue[0] = (bfs_node){ i1, -1, -1, 0 };
+  queue[1] = (bfs_node){ i2, -1, -1, 0 };
+  int head = 0, tail = 2;
+  unsigned start = next_rand(cf) % cf->bucket_size;
+
+  while (head < tail) {
+    int n = head++;
+    uint16_t *b = get_bucket(cf, queue[n].bucket);
+    for (unsigned k = 0; k < cf->bucket_size; ++k) {
+      int slot = (int)((start + k) % cf->bucket_size);
+      unsigned alt = alt_index(cf, queue[n].bucket, b[slot]);
+      uint16_t *ab = get_bucket(cf, alt);
+      int free_slot = bucket_find(cf, ab, 0);
+      if (free_slot >= 0) {
+        // walk the path back to the root shifting each entry into its
+        // alternate bucket
+        ab[free_slot] = b[slot];
+        for (; n >= 0; n = queue[n].parent) {
+          uint16_t *nb = get_bucket(cf, queue[n].bucket);
+          if (queue[n].parent < 0) {
+            nb[slot] = fp;
+            break;
+          }
+          uint16_t *pb = get_bucket(cf, queue[queue[n].parent].bucket);
+          nb[slot] = pb[queue[n].slot];
+          slot = queue[n].slot;
+        }
+        return true;
+      }
+      if (queue[n].depth < BFS_MAX_DEPTH && tail < BFS_QUEUE_SIZE
+          && !on_path(queue, n, alt)) {
+        queue[tail++] = (bfs_node){ alt, n, slot, queue[n].depth + 1 };
+      }
     }
   }
   return false;
@@ -113,29 +291,13 @@ static bool bucket_insert(lua_State *lua, cuckoo_filter *cf, unsigned i1,
   // since we must handle duplicates we consider any collision within the bucket
   // to be a duplicate. The 16 bit fingerprint makes the false postive rate very
   // low 0.00012
-  if (bucket_lookup(&cf->buckets[i1], fp)) return false;
-  if (bucket_lookup(&cf->buckets[i2], fp)) return false;
-
-  if (!bucket_add(&cf->buckets[i1], fp)) {
-    if (!bucket_add(&cf->buckets[i2], fp)) {
-      unsigned ri;
-      if (rand() % 2) {
-        ri = i1;
-      } else {
-        ri = i2;
-      }
-      for (int i = 0; i < 512; ++i) {
-        int entry = rand() % BUCKET_SIZE;
-        unsigned tmp = cf->buckets[ri].entries[entry];
-        cf->buckets[ri].entries[entry] = fp;
-        fp = tmp;
-        ri = ri ^ (XXH64(&fp, sizeof(uint16_t), 1) >> (cf->nlz + 32));
-        if (bucket_lookup(&cf->buckets[ri], fp)) return false;
-        if (bucket_add(&cf->buckets[ri], fp)) {
-          return true;
-        }
+  if (bucket_pair_lookup(cf, i1, i2, fp)) return false;
+
+  if (!bucket_add(cf, get_bucket(cf, i1), fp)) {
+    if (!bucket_add(cf, get_bucket(cf, i2), fp)) {
+      if (!bfs_insert(cf, i1, i2, fp)) {
+        luaL_error(lua, "the cuckoo filter is full");
       }
-      luaL_error(lua, "the cuckoo filter is full");
     }
   }
   return true;
@@ -164,7 +326,7 @@ static int cf_add(lua_State *lua)
   uint64_t h = XXH64(key, (int)len, 1);
   uint16_t fp = fingerprint16(h);
   unsigned i1 = h % cf->num_buckets;
-  unsigned i2 = i1 ^ (XXH64(&fp, sizeof(uint16_t), 1) >> (cf->nlz + 32));
+  unsigned i2 = alt_index(cf, i1, fp);
   bool success = bucket_insert(lua, cf, i1, i2, fp);
   if (success) {
     ++cf->cnt;
@@ -196,11 +358,8 @@ static int cf_query(lua_State *lua)
   uint64_t h = XXH64(key, (int)len, 1);
   uint16_t fp = fingerprint16(h);
   unsigned i1 = h % cf->num_buckets;
-  bool found = bucket_lookup(&cf->buckets[i1], fp);
-  if (!found) {
-    unsigned i2 = i1 ^ (XXH64(&fp, sizeof(uint16_t), 1) >> (cf->nlz + 32));
-    found = bucket_lookup(&cf->buckets[i2], fp);
-  }
+  unsigned i2 = alt_index(cf, i1, fp);
+  bool found = bucket_pair_lookup(cf, i1, i2, fp);
   lua_pushboolean(lua, found);
   return 1;
 }
@@ -228,10 +387,10 @@ static int cf_delete(lua_State *lua)
   uint64_t h = XXH64(key, (int)len, 1);
   uint16_t fp = fingerprint16(h);
   unsigned i1 = h % cf->num_buckets;
-  bool deleted = bucket_delete(&cf->buckets[i1], fp);
+  bool deleted = bucket_delete(cf, get_bucket(cf, i1), fp);
   if (!deleted) {
-    unsigned i2 = i1 ^ (XXH64(&fp, sizeof(uint16_t), 1) >> (cf->nlz + 32));
-    deleted = bucket_delete(&cf->buckets[i2], fp);
+    unsigned i2 = alt_index(cf, i1, fp);
+    deleted = bucket_delete(cf, get_bucket(cf, i2), fp);
   }
   if (deleted) {
     --cf->cnt;
@@ -252,12 +411,21 @@ static int cf_count(lua_State *lua)
 static int cf_clear(lua_State *lua)
 {
   cuckoo_filter *cf = check_cuckoo_filter(lua, 1);
-  memset(cf->buckets, 0, cf->bytes);
+  memset(get_bucket(cf, 0), 0, cf->bytes);
   cf->cnt = 0;
+  cf->rng = RNG_SEED;
   return 0;
 }
 
 
+static int cf_load_factor(lua_State *lua)
+{
+  cuckoo_filter *cf = check_cuckoo_filter(lua, 1);
+  lua_pushnumber(lua, (lua_Number)cf->cnt / cf->items);
+  return 1;
+}
+
+
 static int cf_version(lua_State *lua)
 {
   lua_pushstring(lua, DIST_VERSION);
@@ -270,18 +438,19 @@ static int binary_version = 1;
 
 static int cf_fromstring(lua_State *lua)
 {
-  cuckoo_filter *cf = check_cuckoo_filter(lua, 4);
+  cuckoo_filter *cf = check_cuckoo_filter(lua, lua_gettop(lua) == 5 ? 5 : 4);
   cf->cnt = (size_t)luaL_checknumber(lua, 2);
   size_t len = 0;
   const char *values = luaL_checklstring(lua, 3, &len);
   if (luaL_optint(lua, 4, 0) != binary_version) {
     return 0;
   }
+  cf->rng = (uint32_t)luaL_optnumber(lua, 5, RNG_SEED);
   if (len != cf->bytes) {
     luaL_error(lua, "fromstring() bytes found: %d, expected %d", len,
                cf->bytes);
   }
-  memcpy(cf->buckets, values, len);
+  memcpy(get_bucket(cf, 0), values, len);
   return 0;
 }
 
@@ -295,17 +464,20 @@ static int serialize_cuckoo_filter(lua_State *lua)
     return 1;
   }
   if (lsb_outputf(ob,
-                  "if %s == nil then %s = %s.new(%u) end\n",
+                  "if %s == nil then %s = %s.new(%u, %u) end\n",
                   key,
                   key,
                   module_table,
-                  (unsigned)cf->items)) {
+                  (unsigned)cf->items,
+                  cf->bucket_size)) {
     return 1;
   }
 
   if (lsb_outputf(ob, "%s:fromstring(%d, \"", key, (unsigned)cf->cnt)) return 1;
-  if (lsb_serialize_binary(ob, cf->buckets, cf->bytes)) return 1;
-  if (lsb_outputf(ob, "\", %d)\n", binary_version)) return 1;
+  if (lsb_serialize_binary(ob, get_bucket(cf, 0), cf->bytes)) return 1;
+  if (lsb_outputf(ob, "\", %d, %u)\n", binary_version, (unsigned)cf->rng)) {
+    return 1;
+  }
   return 0;
 }
 #endif
@@ -325,6 +497,7 @@ static const struct luaL_reg cuckoo_filterlib_m[] =
   { "query", cf_query },
   { "delete", cf_delete },
   { "count", cf_count },
+  { "load_factor", cf_load_factor },
   { "clear", cf_clear },
 #ifdef LUA_SANDBOX
   { "fromstring", cf_fromstring }, // used for data restoration
@@ -24,6 +24,10 @@
 #endif
 
 #define MAX_INTERVALS 256
+#define MAX_LOAD      0.8
+#define MAX_FILTERS   8 // maximum number of chained filters in scalable mode
+#define SWEEP_BUCKETS 64 // minimum buckets expired per operation while sweeping
+#define SWEEP_PASS_OPS 8192 // operations a sweep pass is spread over (at most)
 
 static const char *module_name  = "mozsvc.cuckoo_filter_expire";
 static const char *module_table = "cuckoo_filter_expire";
@@ -34,28 +38,120 @@ typedef struct cuckoo_bucket
   uint8_t   interval[BUCKET_SIZE];
 } cuckoo_bucket;
 
+/*
+ * Expiration is incremental; when intervals expire their entries are swept
+ * from a bounded number of buckets on each operation. Any bucket accessed
+ * before the sweep reaches it is swept first so expired entries are never
+ * visible.
+ *
+ * Every expiration starts a new epoch and records it for the expired
+ * intervals. Each bucket stores (in an array following the buckets) the low 16
+ * bits of the epoch it was last swept in; an entry is expired when its interval
+ * expired in a later epoch. Expirations during a sweep simply extend it (the
+ * pass is repeated for the buckets swept before them) so a sweep is never
+ * forced to complete. The per operation step is scaled so a pass never spans
+ * more than SWEEP_PASS_OPS operations, bounding the epoch lag of any bucket
+ * well below 2^16.
+ *
+ * The interval, epoch, sweep and interval count state is only maintained in the
+ * head of the chain.
+ */
 typedef struct cuckoo_filter
 {
   size_t  items;
   size_t  bytes;
   size_t  num_buckets;
   size_t  cnt;
+  size_t  cursor;   // next bucket to be swept
+  size_t  pending;  // expired entries that have not been swept
+  size_t  epoch;    // incremented by every expiration
+  size_t  pass_epoch; // epoch the current sweep pass brings the buckets to
   time_t  timet;
   int     nlz;
   int     interval;
   int     interval_size;
   int     lru_interval;
+  bool    sweeping;
+  bool    scalable;
+  int     next_ref; // registry reference keeping the next filter alive
+  struct cuckoo_filter *next;
+  size_t  interval_cnt[MAX_INTERVALS];
+  size_t  expired[MAX_INTERVALS]; // epoch each interval last expired in
   cuckoo_bucket buckets[];
 } cuckoo_filter;
 
 
-static void clear(cuckoo_filter *cf)
+static uint16_t* bucket_epochs(cuckoo_filter *c)
+{
+  return (uint16_t *)(c->buckets + c->num_buckets);
+}
+
+
+static void set_bucket_epochs(cuckoo_filter *c, size_t epoch)
+{
+  uint16_t *e = bucket_epochs(c);
+  for (size_t i = 0; i < c->num_buckets; ++i) {
+    e[i] = (uint16_t)epoch;
+  }
+}
+
+
+static bool is_swept(cuckoo_filter *cf, cuckoo_filter *c, size_t i)
+{
+  return bucket_epochs(c)[i] == (uint16_t)cf->epoch;
+}
+
+
+static void release_next(lua_State *lua, cuckoo_filter *cf)
+{
+  if (cf->next_ref != LUA_NOREF) {
+    luaL_unref(lua, LUA_REGISTRYINDEX, cf->next_ref);
+    cf->next_ref = LUA_NOREF;
+  }
+  cf->next = NULL;
+}
+
+
+static void reset_sweep(cuckoo_filter *cf)
+{
+  cf->sweeping      = false;
+  cf->pending       = 0;
+  cf->epoch         = 0;
+  cf->pass_epoch    = 0;
+  cf->cursor        = cf->num_buckets;
+  memset(cf->expired, 0, sizeof(cf->expired));
+  memset(bucket_epochs(cf), 0, cf->num_buckets * sizeof(uint16_t));
+}
+
+
+static void clear(lua_State *lua, cuckoo_filter *cf)
 {
   cf->interval      = MAX_INTERVALS - 1;
   cf->lru_interval  = -1;
   cf->cnt           = 0;
   cf->timet         = (MAX_INTERVALS - 1) * cf->interval_size;
   memset(cf->buckets, 0, cf->bytes);
+  memset(cf->interval_cnt, 0, sizeof(cf->interval_cnt));
+  reset_sweep(cf);
+  release_next(lua, cf);
+}
+
+
+static size_t total_count(cuckoo_filter *cf)
+{
+  size_t cnt = 0;
+  for (cuckoo_filter *c = cf; c; c = c->next) {
+    cnt += c->cnt;
+  }
+  return cnt > cf->pending ? cnt - cf->pending : 0;
+}
+
+
+static void remove_interval(cuckoo_filter *cf, int interval)
+{
+  if (cf->interval_cnt[interval] > 0) {
+    --cf->interval_cnt[interval];
+  }
 }
 
 
@@ -75,31 +171,70 @@ static unsigned index_v2r(cuckoo_filter *cf, int idx)
 }
 
 
-static int cf_new(lua_State *lua)
+static cuckoo_filter* new_filter(lua_State *lua, unsigned buckets,
+                                 int interval_size)
 {
-  int n = lua_gettop(lua);
-  luaL_argcheck(lua, n == 2, 0, "incorrect number of arguments");
-  int items = luaL_checkint(lua, 1);
-  luaL_argcheck(lua, items > MAX_INTERVALS, 1, "items must be > 256");
-  int mins = luaL_optint(lua, 2, 1);
-  luaL_argcheck(lua, mins > 0 && mins <= 1440, 2, "0 < interval size <= 1440");
-
-  unsigned buckets  = clp2((unsigned)ceil(items / BUCKET_SIZE));
   size_t bytes      = sizeof(cuckoo_bucket) * buckets;
-  size_t nbytes     = sizeof(cuckoo_filter) + bytes;
+  size_t nbytes     = sizeof(cuckoo_filter) + bytes
+      + buckets * sizeof(uint16_t);
   cuckoo_filter *cf = lua_newuserdata(lua, nbytes);
   cf->items         = buckets * BUCKET_SIZE;
   cf->num_buckets   = buckets;
   cf->bytes         = bytes;
   cf->nlz           = nlz(buckets) + 1;
-  cf->interval_size = 60 * mins;
-  clear(cf);
+  cf->interval_size = interval_size;
+  cf->scalable      = false;
+  cf->next_ref      = LUA_NOREF;
+  cf->next          = NULL;
+  clear(lua, cf);
   luaL_getmetatable(lua, module_name);
   lua_setmetatable(lua, -2);
+  return cf;
+}
+
+
+static int cf_new(lua_State *lua)
+{
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n >= 2 && n <= 3, 0, "incorrect number of arguments");
+  int items = luaL_checkint(lua, 1);
+  luaL_argcheck(lua, items > MAX_INTERVALS, 1, "items must be > 256");
+  int mins = luaL_optint(lua, 2, 1);
+  luaL_argcheck(lua, mins > 0 && mins <= 1440, 2, "0 < interval size <= 1440");
+  bool scalable = false;
+  if (n == 3) {
+    luaL_checktype(lua, 3, LUA_TBOOLEAN);
+    scalable = lua_toboolean(lua, 3);
+  }
+
+  cuckoo_filter *cf = new_filter(lua, clp2((unsigned)ceil(items / BUCKET_SIZE)),
+                                 60 * mins);
+  cf->scalable = scalable;
   return 1;
 }
 
 
+/*
+ * Adds a filter with the specified number of buckets to the end of the chain.
+ * The new filter is referenced from its predecessor so it lives as long as the
+ * head.
+ */
+static cuckoo_filter* append_filter(lua_State *lua, cuckoo_filter *cf,
+                                    unsigned buckets)
+{
+  cuckoo_filter *last = cf;
+  while (last->next) {
+    last = last->next;
+  }
+  cuckoo_filter *nf = new_filter(lua, buckets, cf->interval_size);
+  set_bucket_epochs(nf, cf->epoch); // nothing to sweep
+  nf->cursor = cf->sweeping ? 0 : nf->num_buckets;
+  last->next_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+  last->next = nf;
+  return nf;
+}
+
+
 static cuckoo_filter* check_cuckoo_filter(lua_State *lua, int args)
 {
   cuckoo_filter *cf = luaL_checkudata(lua, 1, module_name);
@@ -109,6 +244,147 @@ static cuckoo_filter* check_cuckoo_filter(lua_State *lua, int args)
 }
 
 
+static void sweep_bucket(cuckoo_filter *cf, cuckoo_filter *c, size_t i)
+{
+  uint16_t *be = &bucket_epochs(c)[i];
+  // the lag is bounded (see SWEEP_PASS_OPS) so the full epoch can be recovered
+  size_t swept = cf->epoch - (uint16_t)((uint16_t)cf->epoch - *be);
+  cuckoo_bucket *b = &c->buckets[i];
+  for (int j = 0; j < BUCKET_SIZE; ++j) {
+    if (b->entries[j] != 0 && cf->expired[b->interval[j]] > swept) {
+      b->entries[j] = 0;
+      b->interval[j] = 0;
+      --c->cnt;
+      if (cf->pending > 0) --cf->pending;
+    }
+  }
+  *be = (uint16_t)cf->epoch;
+}
+
+
+/*
+ * Returns the bucket at index i of filter c (cf is the head of the chain)
+ * after removing any expired entries the sweep has not reached yet.
+ */
+static cuckoo_bucket* touch_bucket(cuckoo_filter *cf, cuckoo_filter *c,
+                                   size_t i)
+{
+  if (cf->sweeping && !is_swept(cf, c, i)) {
+    sweep_bucket(cf, c, i);
+  }
+  return &c->buckets[i];
+}
+
+
+static void drop_empty_filters(lua_State *lua, cuckoo_filter *cf)
+{
+  for (cuckoo_filter *prev = cf; prev->next;) {
+    cuckoo_filter *c = prev->next;
+    if (c->cnt == 0) {
+      int ref = prev->next_ref;
+      prev->next = c->next;
+      prev->next_ref = c->next_ref;
+      c->next = NULL;
+      c->next_ref = LUA_NOREF;
+      luaL_unref(lua, LUA_REGISTRYINDEX, ref);
+    } else {
+      prev = c;
+    }
+  }
+}
+
+
+static void start_pass(cuckoo_filter *cf)
+{
+  cf->pass_epoch = cf->epoch;
+  for (cuckoo_filter *c = cf; c; c = c->next) {
+    c->cursor = 0;
+  }
+}
+
+
+/*
+ * Number of buckets swept per operation, scaled with the size of the chain so
+ * a pass completes within SWEEP_PASS_OPS operations.
+ */
+static size_t sweep_step(cuckoo_filter *cf)
+{
+  size_t buckets = 0;
+  for (cuckoo_filter *c = cf; c; c = c->next) {
+    buckets += c->num_buckets;
+  }
+  size_t step = (buckets + SWEEP_PASS_OPS - 1) / SWEEP_PASS_OPS;
+  return step > SWEEP_BUCKETS ? step : SWEEP_BUCKETS;
+}
+
+
+/*
+ * Advances the sweep by up to max_buckets buckets. A pass that completes after
+ * further expirations is restarted, otherwise the sweep is finished and the
+ * emptied filters, other than the head, are dropped.
+ */
+static void sweep(lua_State *lua, cuckoo_filter *cf, size_t max_buckets)
+{
+  while (cf->sweeping && max_buckets) {
+    for (cuckoo_filter *c = cf; c && max_buckets; c = c->next) {
+      for (; c->cursor < c->num_buckets && max_buckets;
+           ++c->cursor, --max_buckets) {
+        if (!is_swept(cf, c, c->cursor)) {
+          sweep_bucket(cf, c, c->cursor);
+        }
+      }
+    }
+    if (!max_buckets) break;
+
+    if (cf->pass_epoch != cf->epoch) {
+      start_pass(cf);
+    } else {
+      cf->sweeping = false;
+      cf->pending = 0;
+      drop_empty_filters(lua, cf);
+    }
+  }
+}
+
+
+/*
+ * Expires the interval range; the entries are removed from the count
+ * immediately and from the filter by the sweep. A sweep in progress is
+ * extended, never completed synchronously.
+ */
+static void expire_range(cuckoo_filter *cf, int start, int end)
+{
+  size_t pending = 0;
+  for (int i = start;; i = (i + 1) % MAX_INTERVALS) {
+    pending += cf->interval_cnt[i];
+    cf->interval_cnt[i] = 0;
+    if (i == end) break;
+  }
+  if (pending == 0) return;
+
+  ++cf->epoch;
+  for (int i = start;; i = (i + 1) % MAX_INTERVALS) {
+    cf->expired[i] = cf->epoch;
+    if (i == end) break;
+  }
+  cf->pending += pending;
+  if (!cf->sweeping) {
+    cf->sweeping = true;
+    start_pass(cf);
+  }
+}
+
+
+static int lru_interval(cuckoo_filter *cf)
+{
+  for (int i = 0; i < MAX_INTERVALS; ++i) {
+    unsigned idx = index_v2r(cf, i);
+    if (cf->interval_cnt[idx] > 0) return idx;
+  }
+  return -1;
+}
+
+
 static bool bucket_lookup(lua_State *lua, cuckoo_bucket *b, uint32_t fp)
 {
   for (int i = 0; i < BUCKET_SIZE; ++i) {
@@ -123,9 +399,9 @@ static bool bucket_lookup(lua_State *lua, cuckoo_bucket *b, uint32_t fp)
 
 
 static bool bucket_insert_lookup(lua_State *lua, cuckoo_filter *cf,
-                                 unsigned idx, uint32_t fp, uint8_t interval)
+                                 cuckoo_bucket *b, uint32_t fp,
+                                 uint8_t interval)
 {
-  cuckoo_bucket *b = &cf->buckets[idx];
   for (int i = 0; i < BUCKET_SIZE; ++i) {
     if (b->entries[i] == fp) {
       lua_pushboolean(lua, false);
@@ -133,6 +409,8 @@ static bool bucket_insert_lookup(lua_State *lua, cuckoo_filter *cf,
       int pidx = index_r2v(cf, b->interval[i]);
       int delta;
       if (cidx > pidx) {
+        remove_interval(cf, b->interval[i]);
+        ++cf->interval_cnt[interval];
         b->interval[i] = interval;
         delta = cidx - pidx;
       } else {
@@ -146,16 +424,17 @@ static bool bucket_insert_lookup(lua_State *lua, cuckoo_filter *cf,
 }
 
 
-static bool bucket_delete(cuckoo_bucket *b, uint32_t fp)
+static int bucket_delete(cuckoo_bucket *b, uint32_t fp)
 {
   for (int i = 0; i < BUCKET_SIZE; ++i) {
     if (b->entries[i] == fp) {
+      int interval = b->interval[i];
       b->entries[i] = 0;
       b->interval[i] = 0;
-      return true;
+      return interval;
     }
   }
-  return false;
+  return -1;
 }
 
 
@@ -172,17 +451,35 @@ static bool bucket_add(cuckoo_bucket *b, uint32_t fp, uint8_t interval)
 }
 
 
-static bool bucket_insert(lua_State *lua, cuckoo_filter *cf, unsigned i1,
-                          unsigned i2, uint32_t fp, uint8_t interval)
+static void get_indexes(cuckoo_filter *cf, uint64_t h, uint32_t fp,
+                        unsigned *i1, unsigned *i2)
+{
+  *i1 = h % cf->num_buckets;
+  *i2 = *i1 ^ (XXH64(&fp, sizeof(uint32_t), 1) >> (cf->nlz + 32));
+}
+
+
+static bool bucket_insert(lua_State *lua, cuckoo_filter *cf,
+                          cuckoo_filter *target, uint64_t h, uint32_t fp,
+                          uint8_t interval)
 {
   // since we must handle duplicates we consider any collision within the bucket
   // to be a duplicate. The 32 bit fingerprint makes the false postive rate very
   // low 0.0000000019
-  if (bucket_insert_lookup(lua, cf, i1, fp, interval)) return false;
-  if (bucket_insert_lookup(lua, cf, i2, fp, interval)) return false;
+  unsigned i1, i2;
+  for (cuckoo_filter *c = cf; c; c = c->next) {
+    get_indexes(c, h, fp, &i1, &i2);
+    if (bucket_insert_lookup(lua, cf, touch_bucket(cf, c, i1), fp, interval)
+        || bucket_insert_lookup(lua, cf, touch_bucket(cf, c, i2), fp,
+                                interval)) {
+      return false;
+    }
+  }
 
-  if (!bucket_add(&cf->buckets[i1], fp, interval)) {
-    if (!bucket_add(&cf->buckets[i2], fp, interval)) {
+  get_indexes(target, h, fp, &i1, &i2);
+  if (!bucket_add(&target->buckets[i1], fp, interval)) {
+    if (!bucket_add(&target->buckets[i2], fp, interval)) {
+      uint8_t added = interval;
       unsigned ri;
       if (rand() % 2) {
         ri = i1;
@@ -190,16 +487,23 @@ static bool bucket_insert(lua_State *lua, cuckoo_filter *cf, unsigned i1,
         ri = i2;
       }
       for (int i = 0; i < 512; ++i) {
+        cuckoo_bucket *b = &target->buckets[ri];
         int entry = rand() % BUCKET_SIZE;
-        unsigned tmp = cf->buckets[ri].entries[entry];
-        uint8_t tinterval = cf->buckets[ri].interval[entry];
-        cf->buckets[ri].entries[entry] = fp;
-        cf->buckets[ri].interval[entry] = interval;
+        unsigned tmp = b->entries[entry];
+        uint8_t tinterval = b->interval[entry];
+        b->entries[entry] = fp;
+        b->interval[entry] = interval;
         fp = tmp;
         interval = tinterval;
-        ri = ri ^ (XXH64(&fp, sizeof(uint32_t), 1) >> (cf->nlz + 32));
-        if (bucket_insert_lookup(lua, cf, ri, fp, interval)) return false;
-        if (bucket_add(&cf->buckets[ri], fp, interval)) return true;
+        ri = ri ^ (XXH64(&fp, sizeof(uint32_t), 1) >> (target->nlz + 32));
+        b = touch_bucket(cf, target, ri);
+        if (bucket_insert_lookup(lua, cf, b, fp, interval)) {
+          // the displaced entry was a duplicate and is dropped
+          remove_interval(cf, interval);
+          ++cf->interval_cnt[added];
+          return false;
+        }
+        if (bucket_add(b, fp, interval)) return true;
       }
       luaL_error(lua, "the cuckoo filter is full");
     }
@@ -208,25 +512,36 @@ static bool bucket_insert(lua_State *lua, cuckoo_filter *cf, unsigned i1,
 }
 
 
-static int prune_range(cuckoo_filter *cf, int start, int end)
+/*
+ * Returns the first filter in the chain below the maximum load. When they are
+ * all full a larger filter is appended (scalable mode) or the least recently
+ * used interval is expired.
+ */
+static cuckoo_filter* insert_target(lua_State *lua, cuckoo_filter *cf)
 {
-  int lru_vidx = MAX_INTERVALS - 1;
-  for (size_t i = 0; i < cf->num_buckets; ++i) {
-    for (int j = 0; j < BUCKET_SIZE; ++j) {
-      if (cf->buckets[i].entries[j] != 0) {
-        int interval = cf->buckets[i].interval[j];
-        if ((end >= start && (interval >= start && interval <= end))
-            || (end < start && (interval >= start || interval <= end))) {
-          cf->buckets[i].entries[j] = 0;
-          cf->buckets[i].interval[j] = 0;
-          --cf->cnt;
-        }
-        int vidx = index_r2v(cf, interval);
-        if (vidx < lru_vidx) {lru_vidx = vidx;}
-      }
-    }
+  cuckoo_filter *last = cf;
+  size_t items = 0;
+  int n = 0;
+  for (cuckoo_filter *c = cf; c; c = c->next, ++n) {
+    if ((double)c->cnt / c->items < MAX_LOAD) return c;
+    items += c->items;
+    last = c;
+  }
+
+  // the space held by the expired entries is freed as the sweep progresses
+  if ((double)total_count(cf) / items < MAX_LOAD) return last;
+
+  if (cf->scalable && n < MAX_FILTERS) {
+    return append_filter(lua, cf, (unsigned)last->num_buckets * 2);
   }
-  return index_v2r(cf, lru_vidx);
+
+  // expire due to capacity
+  if (cf->lru_interval == -1) {
+    cf->lru_interval = (cf->interval + 1) % MAX_INTERVALS;
+  }
+  expire_range(cf, cf->lru_interval, cf->lru_interval);
+  cf->lru_interval = lru_interval(cf);
+  return last;
 }
 
 
@@ -260,27 +575,20 @@ static int cf_add(lua_State *lua)
 
   if (cf->interval != interval && timet > cf->timet) { // expire due to time
     int oldest = (cf->interval + 1) % MAX_INTERVALS;
-    if (cf->cnt > 0) {
-      cf->lru_interval = prune_range(cf, oldest, interval);
-    }
+    expire_range(cf, oldest, interval);
     cf->interval = interval;
     cf->timet = timet;
+    cf->lru_interval = lru_interval(cf);
   }
+  sweep(lua, cf, sweep_step(cf));
 
-  if ((double)cf->cnt / cf->items >= 0.8) { // expire due to capacity
-    if (cf->lru_interval == -1) {
-      cf->lru_interval = (cf->interval + 1) % MAX_INTERVALS;
-    }
-    cf->lru_interval = prune_range(cf, cf->lru_interval, cf->lru_interval);
-  }
-
+  cuckoo_filter *target = insert_target(lua, cf);
   uint64_t h = XXH64(key, (int)len, 1);
   uint32_t fp = fingerprint32(h);
-  unsigned i1 = h % cf->num_buckets;
-  unsigned i2 = i1 ^ (XXH64(&fp, sizeof(uint32_t), 1) >> (cf->nlz + 32));
-  bool success = bucket_insert(lua, cf, i1, i2, fp, interval);
+  bool success = bucket_insert(lua, cf, target, h, fp, interval);
   if (success) {
-    ++cf->cnt;
+    ++target->cnt;
+    ++cf->interval_cnt[interval];
     lua_pushboolean(lua, success);
     lua_pushinteger(lua, 0);
   }
@@ -307,13 +615,16 @@ static int cf_query(lua_State *lua)
     luaL_argerror(lua, 2, "must be a string or number");
     break;
   }
+  sweep(lua, cf, sweep_step(cf));
+
   uint64_t h = XXH64(key, (int)len, 1);
   uint32_t fp = fingerprint32(h);
-  unsigned i1 = h % cf->num_buckets;
-  bool found = bucket_lookup(lua, &cf->buckets[i1], fp);
-  if (!found) {
-    unsigned i2 = i1 ^ (XXH64(&fp, sizeof(uint32_t), 1) >> (cf->nlz + 32));
-    found = bucket_lookup(lua, &cf->buckets[i2], fp);
+  bool found = false;
+  unsigned i1, i2;
+  for (cuckoo_filter *c = cf; c && !found; c = c->next) {
+    get_indexes(c, h, fp, &i1, &i2);
+    found = bucket_lookup(lua, touch_bucket(cf, c, i1), fp)
+        || bucket_lookup(lua, touch_bucket(cf, c, i2), fp);
   }
   if (found) return 2;
 
@@ -341,18 +652,24 @@ static int cf_delete(lua_State *lua)
     luaL_argerror(lua, 2, "must be a string or number");
     break;
   }
+  sweep(lua, cf, sweep_step(cf));
+
   uint64_t h = XXH64(key, (int)len, 1);
   uint32_t fp = fingerprint32(h);
-  unsigned i1 = h % cf->num_buckets;
-  bool deleted = bucket_delete(&cf->buckets[i1], fp);
-  if (!deleted) {
-    unsigned i2 = i1 ^ (XXH64(&fp, sizeof(uint32_t), 1) >> (cf->nlz + 32));
-    deleted = bucket_delete(&cf->buckets[i2], fp);
-  }
-  if (deleted) {
-    --cf->cnt;
+  int interval = -1;
+  unsigned i1, i2;
+  for (cuckoo_filter *c = cf; c && interval == -1; c = c->next) {
+    get_indexes(c, h, fp, &i1, &i2);
+    interval = bucket_delete(touch_bucket(cf, c, i1), fp);
+    if (interval == -1) {
+      interval = bucket_delete(touch_bucket(cf, c, i2), fp);
+    }
+    if (interval != -1) {
+      --c->cnt;
+      remove_interval(cf, interval);
+    }
   }
-  lua_pushboolean(lua, deleted);
+  lua_pushboolean(lua, interval != -1);
   return 1;
 }
 
@@ -360,7 +677,7 @@ static int cf_delete(lua_State *lua)
 static int cf_count(lua_State *lua)
 {
   cuckoo_filter *cf = check_cuckoo_filter(lua, 1);
-  lua_pushnumber(lua, (lua_Number)cf->cnt);
+  lua_pushnumber(lua, (lua_Number)total_count(cf));
   return 1;
 }
 
@@ -368,7 +685,27 @@ static int cf_count(lua_State *lua)
 static int cf_clear(lua_State *lua)
 {
   cuckoo_filter *cf = check_cuckoo_filter(lua, 1);
-  clear(cf);
+  clear(lua, cf);
+  return 0;
+}
+
+
+static int cf_filters(lua_State *lua)
+{
+  cuckoo_filter *cf = check_cuckoo_filter(lua, 1);
+  int n = 0;
+  for (; cf; cf = cf->next) {
+    ++n;
+  }
+  lua_pushinteger(lua, n);
+  return 1;
+}
+
+
+static int cf_gc(lua_State *lua)
+{
+  cuckoo_filter *cf = check_cuckoo_filter(lua, 1);
+  release_next(lua, cf);
   return 0;
 }
 
@@ -390,20 +727,50 @@ static int cf_current_interval(lua_State *lua)
 
 
 #ifdef LUA_SANDBOX
+static void count_intervals(cuckoo_filter *cf, cuckoo_filter *c)
+{
+  for (size_t i = 0; i < c->num_buckets; ++i) {
+    for (int j = 0; j < BUCKET_SIZE; ++j) {
+      if (c->buckets[i].entries[j] != 0) {
+        ++cf->interval_cnt[c->buckets[i].interval[j]];
+      }
+    }
+  }
+}
+
+
 static int cf_fromstring(lua_State *lua)
 {
-  if (lua_gettop(lua) == 4) {
+  if (lua_gettop(lua) == 4 && lua_type(lua, 3) == LUA_TNUMBER) {
     lua_remove(lua, 3); // interval_size was removed from the API
   }
-  cuckoo_filter *cf = check_cuckoo_filter(lua, 3);
-  cf->cnt = (size_t)luaL_checknumber(lua, 2);
+  int n = lua_gettop(lua);
+  cuckoo_filter *head = check_cuckoo_filter(lua, n == 4 ? 4 : 3);
+  cuckoo_filter *cf = head;
+  size_t cnt = (size_t)luaL_checknumber(lua, 2);
   size_t len = 0;
   const char *values = luaL_checklstring(lua, 3, &len);
+  if (n == 4) { // restore a scalable filter's chained filter
+    int items = luaL_checkint(lua, 4);
+    luaL_argcheck(lua, items >= BUCKET_SIZE && items % BUCKET_SIZE == 0, 4,
+                  "invalid number of items");
+    unsigned buckets = items / BUCKET_SIZE;
+    if (clp2(buckets) != buckets) { // the alternate index XOR requires it
+      luaL_error(lua, "fromstring() invalid number of buckets: %d", buckets);
+    }
+    cf = append_filter(lua, head, buckets);
+  } else {
+    release_next(lua, cf); // the chained filters are restored after the head
+    reset_sweep(cf);
+    memset(cf->interval_cnt, 0, sizeof(cf->interval_cnt));
+  }
+  cf->cnt = cnt;
   if (len != cf->bytes) {
     luaL_error(lua, "fromstring() bytes found: %d, expected %d", len,
                cf->bytes);
   }
   memcpy(cf->buckets, values, len);
+  count_intervals(head, cf);
   return 0;
 }
 
@@ -416,13 +783,15 @@ static int serialize_cuckoo_filter(lua_State *lua)
   if (!(ob && key && cf)) {
     return 1;
   }
+  sweep(lua, cf, SIZE_MAX); // the expired entries cannot be preserved
   if (lsb_outputf(ob,
-                  "if %s == nil then %s = %s.new(%u, %d) end\n",
+                  "if %s == nil then %s = %s.new(%u, %d%s) end\n",
                   key,
                   key,
                   module_table,
                   (unsigned)cf->items,
-                  cf->interval_size / 60
+                  cf->interval_size / 60,
+                  cf->scalable ? ", true" : ""
                  )) {
 
     return 1;
@@ -435,6 +804,16 @@ static int serialize_cuckoo_filter(lua_State *lua)
   if (lsb_outputs(ob, "\")\n", 3)) {
     return 1;
   }
+
+  for (cuckoo_filter *c = cf->next; c; c = c->next) {
+    if (lsb_outputf(ob, "%s:fromstring(%u, \"", key, (unsigned)c->cnt)) {
+      return 1;
+    }
+    if (lsb_serialize_binary(ob, c->buckets, c->bytes)) return 1;
+    if (lsb_outputf(ob, "\", %u)\n", (unsigned)c->items)) {
+      return 1;
+    }
+  }
   return 0;
 }
 #endif
@@ -454,6 +833,8 @@ static const struct luaL_reg cuckoo_filterlib_m[] = {
   { "count", cf_count },
   { "clear", cf_clear },
   { "current_interval", cf_current_interval },
+  { "filters", cf_filters },
+  { "__gc", cf_gc },
 #ifdef LUA_SANDBOX
   { "fromstring", cf_fromstring }, // used for data restoration
 #endif
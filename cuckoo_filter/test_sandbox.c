@@ -162,6 +162,9 @@ static char* test_sandbox_expire()
   lsb_test_report(sb, 0);
   mu_assert(strcmp("3", lsb_test_output) == 0, "test: count received: %s",
             lsb_test_output);
+  lsb_test_report(sb, 97);
+  mu_assert(strcmp("1500 3", lsb_test_output) == 0,
+            "test: scalable count received: %s", lsb_test_output);
 
   for (int i = 0; tests[i]; ++i) {
     result = lsb_test_process(sb, i);
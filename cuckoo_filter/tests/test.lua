@@ -3,7 +3,7 @@
 -- file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
 require "cuckoo_filter"
-assert(cuckoo_filter.version() == "1.1.1", cuckoo_filter.version())
+assert(cuckoo_filter.version() == "1.3.0", cuckoo_filter.version())
 
 local errors = {
     function() local cf = cuckoo_filter.new(2, 99) end, -- new() incorrect # args
@@ -39,7 +39,10 @@ local errors = {
     end,
     function()
         local cf = cuckoo_filter.new(2) -- must specify atleast 4 items
-    end
+    end,
+    function()
+        local cf = cuckoo_filter.new(20, 3) -- invalid bucket size
+    end,
 }
 
 for i, v in ipairs(errors) do
@@ -93,6 +96,34 @@ cf:clear()
 assert(cf:count() == 0, "cuckoo filter should be empty")
 assert(not cf:query("1"), "cuckoo filter should be empty")
 
+-- test high occupancy
+cf = cuckoo_filter.new(1024)
+assert(cf:load_factor() == 0, "load_factor=" .. cf:load_factor())
+local i = 0
+while cf:load_factor() < 0.95 do
+    i = i + 1
+    cf:add(i)
+end
+for j=1, i do
+    assert(cf:query(j), "query failed " .. j)
+end
+
+-- test eight entry buckets
+cf = cuckoo_filter.new(1000000, 8)
+for i=1, test_items do
+    cf:add(i)
+end
+assert(cf:count() == 799946, "count=" .. cf:count())
+for i=1, test_items do
+    assert(cf:query(i), "query failed " .. i .. " " .. cf:count())
+end
+assert(cf:delete(1))
+assert(not cf:query(1))
+assert(cf:count() == 799945, "count=" .. cf:count())
+cf:clear()
+assert(cf:count() == 0, "cuckoo filter should be empty")
+assert(not cf:query(2), "cuckoo filter should be empty")
+
 cf = cuckoo_filter.new(8)
 for i=1, 8 do
     local ok, err = pcall(cf.add, cf, 8)
@@ -103,7 +134,7 @@ end
 
 
 require "cuckoo_filter_expire"
-assert(cuckoo_filter_expire.version() == "1.1.1", cuckoo_filter_expire.version())
+assert(cuckoo_filter_expire.version() == "1.3.0", cuckoo_filter_expire.version())
 
 local errors = {
     function() local cf = cuckoo_filter_expire.new(1024, 1, 3) end, -- new() incorrect # args
@@ -143,7 +174,16 @@ local errors = {
     end,
     function()
         local cf = cuckoo_filter_expire.new(2) -- must specify atleast 4 items
-    end
+    end,
+    function() local cf = cuckoo_filter_expire.new(1024, 1, true, 1) end, -- new() incorrect # args
+    function()
+        local cf = cuckoo_filter_expire.new(1024, 1, true)
+        cf:fromstring(0, "", 3) -- invalid sub-filter items
+    end,
+    function()
+        local cf = cuckoo_filter_expire.new(1024, 1, true)
+        cf:fromstring(0, "", 12) -- sub-filter buckets not a power of two
+    end,
 }
 
 for i, v in ipairs(errors) do
@@ -234,6 +274,61 @@ assert(cf:count() == 410, "count=" .. cf:count())
 cf:add(411, 86400e9 * 2) -- expired everything by capacity
 assert(cf:count() == 2, "count=" .. cf:count())
 
+-- test scalable mode
+cf = cuckoo_filter_expire.new(512, 1, true)
+assert(cf:filters() == 1, "filters=" .. cf:filters())
+for i=1, 5000 do
+   assert(cf:add(i, 60e9), "add failed " .. i)
+end
+assert(cf:count() == 5000, "count=" .. cf:count())
+assert(cf:filters() == 4, "filters=" .. cf:filters())
+for i=1, 5000 do
+    assert(cf:query(i), "query failed " .. i)
+end
+added, delta = cf:add(4000, 120e9) -- duplicate in a chained filter
+assert(not added)
+assert(delta == 1, tostring(delta))
+assert(cf:delete(5000))
+assert(cf:count() == 4999, "count=" .. cf:count())
+cf:add(1, 258 * 60e9) -- expire everything by time
+assert(cf:count() == 1, "count=" .. cf:count())
+assert(not cf:query(2), "expired entry found")
+assert(cf:filters() == 4, "filters=" .. cf:filters()) -- the sweep is incremental
+for i=1, 40 do
+    cf:query(i)
+end
+assert(cf:filters() == 1, "filters=" .. cf:filters()) -- the chained filters are dropped
+assert(cf:query(1), "query failed")
+cf:clear()
+assert(cf:count() == 0, "cuckoo filter should be empty")
+
+-- expirations during a sweep extend it (the interval numbers are reused)
+cf = cuckoo_filter_expire.new(1000000, 1)
+for i=1, 1000 do
+   cf:add(i, 60e9)
+end
+for i=1001, 2000 do
+   cf:add(i, 120e9)
+end
+cf:add("a", 257 * 60e9) -- expires the first minute
+assert(cf:count() == 1001, "count=" .. cf:count())
+assert(not cf:query(1), "expired entry found")
+assert(cf:query(1001), "query failed")
+cf:add("b", 258 * 60e9) -- expires the second minute before the sweep is done
+assert(cf:count() == 2, "count=" .. cf:count())
+for i=1, 2000 do
+    assert(not cf:query(i), "expired entry found " .. i)
+    assert(cf:add(i, 258 * 60e9), "add failed " .. i)
+end
+for i=1, 10000 do
+    cf:query(i)
+end
+assert(cf:count() == 2002, "count=" .. cf:count())
+for i=1, 2000 do
+    assert(cf:query(i), "query failed " .. i)
+end
+assert(cf:query("a") and cf:query("b"), "query failed")
+
 --[[ big test
 require "math"
 cf = cuckoo_filter_expire.new(256e6, 1)
@@ -5,6 +5,7 @@
 require "cuckoo_filter_expire"
 
 cf = cuckoo_filter_expire.new(512, 1)
+scf = cuckoo_filter_expire.new(512, 1, true)
 
 function process(ts)
     if not cf:query(ts) then
@@ -12,12 +13,17 @@ function process(ts)
             error("key existed")
         end
     end
+    for i = 1, 500 do
+        scf:add(ts * 1000 + i, 1)
+    end
 
     return 0
 end
 
 function report(tc)
-    if tc == 98 then
+    if tc == 97 then
+        write_output(string.format("%d %d", scf:count(), scf:filters()))
+    elseif tc == 98 then
         cf:delete(1);
         write_output(cf:count())
     elseif tc == 99 then
@@ -26,58 +26,195 @@ static const char *mozsvc_hyperloglog = "mozsvc.hyperloglog";
 
 static const char *hll_magic = "HYLL";
 
+/* The dense representation length (header included) for precision p. */
+#define HLL_DENSE_LEN(p) (HLL_HDR_SIZE + HLL_DENSE_BYTES(p))
+#define HLL_SPARSE_MAX(p) (HLL_DENSE_BYTES(p) < HLL_SPARSE_MAX_BYTES ? \
+                           HLL_DENSE_BYTES(p) : HLL_SPARSE_MAX_BYTES)
+/* The largest sparse representation plus the room for a single update. */
+#define HLL_SPARSE_MAX_SIZE(p) (HLL_HDR_SIZE + HLL_SPARSE_MAX(p) + 3)
+#define HLL_SPARSE_INIT_SIZE(p) (HLL_HDR_SIZE + \
+                                 2 * ((HLL_REGISTERS_P(p) + 16383) / 16384) + 16)
+
+/* The HLL starts out sparse and is promoted to dense once the sparse
+ * representation exceeds HLL_SPARSE_MAX_BYTES (or the size of the dense
+ * representation). The buffer is allocated with the Lua allocator so it is
+ * included in the sandbox memory accounting. */
+typedef struct hll_object
+{
+  hyperloglog *hll;
+  size_t len;  /* bytes used by the representation (header included) */
+  size_t size; /* bytes allocated */
+} hll_object;
+
 
-static hyperloglog* check_hll(lua_State *lua, int args)
+static hll_object* check_hll(lua_State *lua, int args)
 {
   int n = lua_gettop(lua);
   luaL_argcheck(lua, args == n, n, "incorrect number of arguments");
-  hyperloglog *hll = luaL_checkudata(lua, 1, mozsvc_hyperloglog);
-  return hll;
+  hll_object *o = luaL_checkudata(lua, 1, mozsvc_hyperloglog);
+  return o;
 }
 
 
-static int hll_new(lua_State *lua)
+static void* hll_realloc(lua_State *lua, void *ptr, size_t osize, size_t nsize)
 {
-  int n = lua_gettop(lua);
-  luaL_argcheck(lua, n == 0, n, "incorrect number of arguments");
+  void *ud;
+  lua_Alloc alloc = lua_getallocf(lua, &ud);
+  void *p = alloc(ud, ptr, osize, nsize);
+  if (!p && nsize) {
+    luaL_error(lua, "memory allocation failed");
+  }
+  return p;
+}
 
-  size_t nbytes = sizeof(hyperloglog);
-  hyperloglog *hll = lua_newuserdata(lua, nbytes);
+
+static void init_sparse(hll_object *o, int p, int hash)
+{
+  hyperloglog *hll = o->hll;
   memcpy(hll->magic, hll_magic, sizeof(hll->magic));
-  hll->encoding = HLL_DENSE;
+  hll->encoding = HLL_SPARSE;
+  hll->precision = p == HLL_P ? 0 : (uint8_t)p;
+  hll->hash = (uint8_t)hash;
+  memset(hll->notused, 0, sizeof(hll->notused));
   memset(hll->card, 0, sizeof(hll->card));
   HLL_INVALIDATE_CACHE(hll);
-  memset(hll->notused, 0, sizeof(hll->notused));
-  memset(hll->registers, 0, HLL_REGISTERS_SIZE);
+  o->len = HLL_HDR_SIZE + hllSparseInit(hll->registers, p);
+}
+
+
+static void promote(lua_State *lua, hll_object *o)
+{
+  int p = HLL_PRECISION(o->hll);
+  size_t size = HLL_DENSE_LEN(p) + 1;
+  hyperloglog *dense = hll_realloc(lua, NULL, 0, size);
+  memcpy(dense, o->hll, HLL_HDR_SIZE);
+  dense->encoding = HLL_DENSE;
+  memset(dense->registers, 0, HLL_DENSE_BYTES(p) + 1);
+  hllSparseMerge(dense->registers, o->hll->registers, o->len - HLL_HDR_SIZE,
+                 p);
+  hll_realloc(lua, o->hll, o->size, 0);
+  o->hll = dense;
+  o->len = HLL_DENSE_LEN(p);
+  o->size = size;
+}
+
+
+static int set_register(lua_State *lua, hll_object *o, long index,
+                        uint8_t count)
+{
+  if (o->hll->encoding == HLL_DENSE) {
+    return hllDenseSet(o->hll->registers, index, count);
+  }
+
+  int p = HLL_PRECISION(o->hll);
+  if (o->len + 3 > o->size) {
+    size_t nsize = o->size * 2;
+    if (nsize > HLL_SPARSE_MAX_SIZE(p)) nsize = HLL_SPARSE_MAX_SIZE(p);
+    o->hll = hll_realloc(lua, o->hll, o->size, nsize);
+    o->size = nsize;
+  }
+  size_t sparselen = o->len - HLL_HDR_SIZE;
+  int altered = hllSparseSet(o->hll->registers, &sparselen, index, count);
+  if (altered == -1) {
+    promote(lua, o);
+    return hllDenseSet(o->hll->registers, index, count);
+  }
+  o->len = HLL_HDR_SIZE + sparselen;
+  if (sparselen > (size_t)HLL_SPARSE_MAX(p)) {
+    promote(lua, o);
+  }
+  return altered;
+}
+
+
+/* Returns the dense representation, a sparse HLL is expanded into a
+ * temporary userdata left on the top of the stack. */
+static hyperloglog* to_dense(lua_State *lua, hll_object *o)
+{
+  if (o->hll->encoding == HLL_DENSE) return o->hll;
+
+  int p = HLL_PRECISION(o->hll);
+  hyperloglog *tmp = lua_newuserdata(lua, HLL_DENSE_LEN(p) + 1);
+  memcpy(tmp, o->hll, HLL_HDR_SIZE);
+  tmp->encoding = HLL_DENSE;
+  memset(tmp->registers, 0, HLL_DENSE_BYTES(p) + 1);
+  hllSparseMerge(tmp->registers, o->hll->registers, o->len - HLL_HDR_SIZE, p);
+  return tmp;
+}
+
+
+static int compatible(hyperloglog *a, hyperloglog *b)
+{
+  return a->precision == b->precision && a->hash == b->hash;
+}
 
+
+static int hll_new(lua_State *lua)
+{
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n <= 1, n, "incorrect number of arguments");
+  int p = HLL_P;
+  int hash = HLL_HASH_MURMUR;
+  if (n == 1) {
+    p = luaL_checkint(lua, 1);
+    luaL_argcheck(lua, p >= HLL_P_MIN && p <= HLL_P_MAX, 1,
+                  "precision must be between 4 and 18");
+    hash = HLL_HASH_XXH64;
+  }
+
+  hll_object *o = lua_newuserdata(lua, sizeof(hll_object));
+  o->hll = NULL;
+  o->len = 0;
+  o->size = 0;
   luaL_getmetatable(lua, mozsvc_hyperloglog);
   lua_setmetatable(lua, -2);
 
+  o->hll = hll_realloc(lua, NULL, 0, HLL_SPARSE_INIT_SIZE(p));
+  o->size = HLL_SPARSE_INIT_SIZE(p);
+  init_sparse(o, p, hash);
   return 1;
 }
 
 
+static int hll_gc(lua_State *lua)
+{
+  hll_object *o = luaL_checkudata(lua, 1, mozsvc_hyperloglog);
+  hll_realloc(lua, o->hll, o->size, 0);
+  o->hll = NULL;
+  o->size = 0;
+  return 0;
+}
+
+
 static int hll_set_count(lua_State *lua)
 {
   int n = lua_gettop(lua);
   luaL_argcheck(lua, n > 1, n, "incorrect number of arguments");
 
-  uint8_t max[HLL_HDR_SIZE + HLL_REGISTERS], *registers;
-  memset(max, 0, sizeof max);
-  hyperloglog *raw = (hyperloglog *)max;
-  raw->encoding = HLL_RAW;
-  registers = max + HLL_HDR_SIZE;
+  hll_object *first = luaL_checkudata(lua, 1, mozsvc_hyperloglog);
+  for (int idx = 2; idx <= n; ++idx) {
+    hll_object *o = luaL_checkudata(lua, idx, mozsvc_hyperloglog);
+    luaL_argcheck(lua, compatible(first->hll, o->hll), idx,
+                  "incompatible precision or hash");
+  }
+
+  int p = HLL_PRECISION(first->hll);
+  hyperloglog *merged = lua_newuserdata(lua, HLL_DENSE_LEN(p) + 1);
+  memcpy(merged, first->hll, HLL_HDR_SIZE);
+  merged->encoding = HLL_DENSE;
+  memset(merged->registers, 0, HLL_DENSE_BYTES(p) + 1);
 
   for (int idx = 1; idx <= n; ++idx) {
-    hyperloglog *hll = luaL_checkudata(lua, idx, mozsvc_hyperloglog);
-    uint8_t val;
-    for (int i = 0; i < HLL_REGISTERS; i++) {
-      HLL_DENSE_GET_REGISTER(val, hll->registers, i);
-      if (val > registers[i]) registers[i] = val;
+    hll_object *o = lua_touserdata(lua, idx);
+    if (o->hll->encoding == HLL_DENSE) {
+      hllDenseMerge(merged->registers, o->hll->registers, p);
+    } else {
+      hllSparseMerge(merged->registers, o->hll->registers,
+                     o->len - HLL_HDR_SIZE, p);
     }
   }
 
-  uint64_t card = hllCount(raw);
+  uint64_t card = hllCount(merged, 0);
   lua_pushnumber(lua, (double)card);
   return 1;
 }
@@ -85,7 +222,7 @@ static int hll_set_count(lua_State *lua)
 
 static int hll_add(lua_State *lua)
 {
-  hyperloglog *hll = check_hll(lua, 2);
+  hll_object *o = check_hll(lua, 2);
   size_t len = 0;
   double val = 0;
   void *key = NULL;
@@ -103,9 +240,13 @@ static int hll_add(lua_State *lua)
     break;
   }
 
+  long index;
+  uint8_t count = (uint8_t)hllPatLen((unsigned char *)key, len,
+                                     HLL_PRECISION(o->hll), o->hll->hash,
+                                     &index);
   int altered = 0;
-  if (1 == hllDenseAdd(hll->registers, (unsigned char *)key, len)) {
-    HLL_INVALIDATE_CACHE(hll);
+  if (1 == set_register(lua, o, index, count)) {
+    HLL_INVALIDATE_CACHE(o->hll);
     altered = 1;
   }
 
@@ -116,22 +257,44 @@ static int hll_add(lua_State *lua)
 
 static int hll_merge(lua_State *lua)
 {
-  hyperloglog *dest = check_hll(lua, 2);
-  hyperloglog *src = luaL_checkudata(lua, 2, mozsvc_hyperloglog);
+  hll_object *dest = check_hll(lua, 2);
+  hll_object *src = luaL_checkudata(lua, 2, mozsvc_hyperloglog);
   if (dest == src) {
     return 1;
   }
+  luaL_argcheck(lua, compatible(dest->hll, src->hll), 2,
+                "incompatible precision or hash");
 
-  int i;
-  uint8_t sval, dval;
-  for (i = 0; i < HLL_REGISTERS; i++) {
-    HLL_DENSE_GET_REGISTER(dval, dest->registers, i);
-    HLL_DENSE_GET_REGISTER(sval, src->registers, i);
-    if (sval > dval) {
-      HLL_DENSE_SET_REGISTER(dest->registers, i, sval);
+  int precision = HLL_PRECISION(dest->hll);
+  if (src->hll->encoding == HLL_DENSE) {
+    if (dest->hll->encoding != HLL_DENSE) {
+      promote(lua, dest);
+    }
+    hllDenseMerge(dest->hll->registers, src->hll->registers, precision);
+  } else if (dest->hll->encoding == HLL_DENSE) {
+    hllSparseMerge(dest->hll->registers, src->hll->registers,
+                   src->len - HLL_HDR_SIZE, precision);
+  } else {
+    const uint8_t *p = src->hll->registers;
+    const uint8_t *end = (const uint8_t *)src->hll + src->len;
+    long idx = 0;
+    while (p < end) {
+      if (HLL_SPARSE_IS_ZERO(p)) {
+        idx += HLL_SPARSE_ZERO_LEN(p);
+        p++;
+      } else if (HLL_SPARSE_IS_XZERO(p)) {
+        idx += HLL_SPARSE_XZERO_LEN(p);
+        p += 2;
+      } else {
+        uint8_t val = (uint8_t)HLL_SPARSE_VAL_VALUE(p);
+        for (int i = HLL_SPARSE_VAL_LEN(p); i > 0; --i) {
+          set_register(lua, dest, idx++, val);
+        }
+        p++;
+      }
     }
   }
-  HLL_INVALIDATE_CACHE(dest);
+  HLL_INVALIDATE_CACHE(dest->hll);
   lua_pushvalue(lua, 1);
   return 1;
 }
@@ -139,7 +302,8 @@ static int hll_merge(lua_State *lua)
 
 static int hll_count(lua_State *lua)
 {
-  hyperloglog *hll = check_hll(lua, 1);
+  hll_object *o = check_hll(lua, 1);
+  hyperloglog *hll = o->hll;
   uint64_t card;
   /* Check if the cached cardinality is valid. */
   if (HLL_VALID_CACHE(hll)) {
@@ -154,7 +318,7 @@ static int hll_count(lua_State *lua)
     card |= (uint64_t)hll->card[7] << 56;
   } else {
     /* Recompute it and update the cached value. */
-    card = hllCount(hll);
+    card = hllCount(hll, o->len - HLL_HDR_SIZE);
     hll->card[0] = card & 0xff;
     hll->card[1] = (card >> 8) & 0xff;
     hll->card[2] = (card >> 16) & 0xff;
@@ -172,29 +336,79 @@ static int hll_count(lua_State *lua)
 
 static int hll_clear(lua_State *lua)
 {
-  hyperloglog *hll = check_hll(lua, 1);
-  memset(hll->registers, 0, HLL_REGISTERS_SIZE);
-  HLL_INVALIDATE_CACHE(hll);
+  hll_object *o = check_hll(lua, 1);
+  int p = HLL_PRECISION(o->hll);
+  if (o->hll->encoding == HLL_DENSE) {
+    o->hll = hll_realloc(lua, o->hll, o->size, HLL_SPARSE_INIT_SIZE(p));
+    o->size = HLL_SPARSE_INIT_SIZE(p);
+  }
+  init_sparse(o, p, o->hll->hash);
   return 0;
 }
 
 
+static int valid_sparse(const uint8_t *p, size_t len, int precision)
+{
+  const uint8_t *end = p + len;
+  long idx = 0;
+  while (p < end) {
+    if (HLL_SPARSE_IS_ZERO(p)) {
+      idx += HLL_SPARSE_ZERO_LEN(p);
+      p++;
+    } else if (HLL_SPARSE_IS_XZERO(p)) {
+      idx += HLL_SPARSE_XZERO_LEN(p);
+      p += 2;
+    } else {
+      idx += HLL_SPARSE_VAL_LEN(p);
+      p++;
+    }
+  }
+  return p == end && idx == HLL_REGISTERS_P(precision);
+}
+
+
 static int hll_fromstring(lua_State *lua)
 {
-  hyperloglog *hll = check_hll(lua, 2);
+  hll_object *o = check_hll(lua, 2);
   size_t len = 0;
   const char *values  = luaL_checklstring(lua, 2, &len);
-  if (len != sizeof(hyperloglog) - 1) {
-    luaL_error(lua, "fromstring() bytes found: %d, expected %d",
-               len, sizeof(hyperloglog) - 1);
+  if (len < HLL_HDR_SIZE) {
+    luaL_error(lua, "fromstring() bytes found: %d, expected %d", (int)len,
+               (int)HLL_DENSE_LEN(HLL_PRECISION(o->hll)));
   }
-  if (memcmp(values, hll_magic, sizeof(hll->magic)) != 0) {
+  const hyperloglog *hdr = (const hyperloglog *)values;
+  if (memcmp(values, hll_magic, sizeof(o->hll->magic)) != 0) {
     luaL_error(lua, "fromstring() HYLL header not found");
   }
-  if (values[5] != HLL_DENSE) {
-    luaL_error(lua, "fromstring() invalid encoding");
+  int p = HLL_PRECISION(hdr);
+  if (p < HLL_P_MIN || p > HLL_P_MAX || hdr->hash > HLL_HASH_XXH64) {
+    luaL_error(lua, "fromstring() invalid precision or hash");
+  }
+
+  size_t size;
+  if (hdr->encoding == HLL_DENSE) {
+    if (len != HLL_DENSE_LEN(p)) {
+      luaL_error(lua, "fromstring() bytes found: %d, expected %d", (int)len,
+                 (int)HLL_DENSE_LEN(p));
+    }
+    size = len + 1;
+  } else if (hdr->encoding == HLL_SPARSE) {
+    if (len > HLL_HDR_SIZE + HLL_SPARSE_MAX(p)
+        || !valid_sparse((const uint8_t *)values + HLL_HDR_SIZE,
+                         len - HLL_HDR_SIZE, p)) {
+      luaL_error(lua, "fromstring() invalid sparse representation");
+    }
+    size = len + 3;
+  } else {
+    return luaL_error(lua, "fromstring() invalid encoding");
+  }
+  o->hll = hll_realloc(lua, o->hll, o->size, size);
+  o->size = size;
+  o->len = len;
+  memcpy(o->hll, values, len);
+  if (hdr->encoding == HLL_DENSE) {
+    o->hll->registers[HLL_DENSE_BYTES(p)] = 0;
   }
-  memcpy(hll, values, sizeof(hyperloglog) - 1);
   return 0;
 }
 
@@ -211,16 +425,22 @@ static int serialize_hyperloglog(lua_State *lua)
 {
   lsb_output_buffer *ob = lua_touserdata(lua, -1);
   const char *key = lua_touserdata(lua, -2);
-  hyperloglog *hll = lua_touserdata(lua, -3);
-  if (!(ob && key && hll)) return 1;
+  hll_object *o = lua_touserdata(lua, -3);
+  if (!(ob && key && o)) return 1;
 
-  if (lsb_outputf(ob,
-                  "if %s == nil then %s = hyperloglog.new() end\n", key, key)) {
+  if (o->hll->hash == HLL_HASH_MURMUR) {
+    if (lsb_outputf(ob, "if %s == nil then %s = hyperloglog.new() end\n",
+                    key, key)) {
+      return 1;
+    }
+  } else if (lsb_outputf(ob,
+                         "if %s == nil then %s = hyperloglog.new(%d) end\n",
+                         key, key, HLL_PRECISION(o->hll))) {
     return 1;
   }
 
   if (lsb_outputf(ob, "%s:fromstring(\"", key)) return 1;
-  if (lsb_serialize_binary(ob, hll, sizeof(hyperloglog) - 1)) return 1;
+  if (lsb_serialize_binary(ob, o->hll, o->len)) return 1;
   if (lsb_outputs(ob, "\")\n", 3)) return 1;
   return 0;
 }
@@ -229,18 +449,23 @@ static int serialize_hyperloglog(lua_State *lua)
 static int output_hyperloglog(lua_State *lua)
 {
   lsb_output_buffer *ob = lua_touserdata(lua, -1);
-  hyperloglog *hll = lua_touserdata(lua, -2);
-  if (!(ob && hll)) return 1;
-  if (lsb_outputs(ob, (const char *)hll, sizeof(hyperloglog) - 1)) return 1;
-  return 0;
+  hll_object *o = lua_touserdata(lua, -2);
+  if (!(ob && o)) return 1;
+  int top = lua_gettop(lua);
+  const char *dense = (const char *)to_dense(lua, o);
+  lsb_err_value rv = lsb_outputs(ob, dense,
+                                 HLL_DENSE_LEN(HLL_PRECISION(o->hll)));
+  lua_settop(lua, top);
+  return rv ? 1 : 0;
 }
 #endif
 
 
 static int hll_tostring(lua_State *lua)
 {
-  hyperloglog *hll = check_hll(lua, 1);
-  lua_pushlstring(lua, (const char *)hll, sizeof(hyperloglog) - 1);
+  hll_object *o = check_hll(lua, 1);
+  lua_pushlstring(lua, (const char *)to_dense(lua, o),
+                  HLL_DENSE_LEN(HLL_PRECISION(o->hll)));
   return 1;
 }
 
@@ -262,6 +487,7 @@ static const struct luaL_reg hyperlogloglib_m[] =
   { "merge", hll_merge },
   { "fromstring", hll_fromstring },
   { "__tostring", hll_tostring },
+  { "__gc", hll_gc },
   { NULL, NULL }
 };
 
@@ -30,13 +30,18 @@
  */
 
 /* This file has been modified for use in the Mozilla lua_sandbox.  Dependencies
-   on the redis.h header file and the unneed sparse and raw implementations have
-   been removed.  The dense data representation remains unchanged. */
+   on the redis.h header file and the unneed raw implementation have been
+   removed.  The sparse representation operates on a caller managed buffer
+   instead of an sds string.  The dense and sparse data representations remain
+   unchanged. */
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <math.h>
 
+#include "../common/xxhash.h"
+
 #include "redis_hyperloglog.h"
 
 
@@ -59,8 +64,13 @@
  * [2] P. Flajolet, Eric Fusy, O. Gandouet, and F. Meunier. Hyperloglog: The
  *     analysis of a near-optimal cardinality estimation algorithm.
  *
- * The "dense" representation where every entry is represented by a
- * 6-bit integer.
+ * We use two representations:
+ *
+ * 1) A "dense" representation where every entry is represented by
+ *    a 6-bit integer.
+ * 2) A "sparse" representation using run length compression suitable
+ *    for representing HyperLogLogs with many registers set to 0 in
+ *    a memory efficient way.
  *
  * HLL header
  * ===
@@ -97,6 +107,54 @@
  * The 6 bits counters are encoded one after the other starting from the
  * LSB to the MSB, and using the next bytes as needed.
  *
+ * Sparse representation
+ * ===
+ *
+ * The sparse representation encodes registers using a run length
+ * encoding composed of three opcodes, two using one byte, and one using
+ * of two bytes. The opcodes are called ZERO, XZERO and VAL.
+ *
+ * ZERO opcode is represented as 00xxxxxx. The 6-bit integer represented
+ * by the six bits 'xxxxxx', plus 1, means that there are N registers set
+ * to 0. This opcode can represent from 1 to 64 contiguous registers set
+ * to the value of 0.
+ *
+ * XZERO opcode is represented by two bytes 01xxxxxx yyyyyyyy. The 14-bit
+ * integer represented by the bits 'xxxxxx' as most significant bits and
+ * 'yyyyyyyy' as least significant bits, plus 1, means that there are N
+ * registers set to 0. This opcode can represent from 0 to 16384 contiguous
+ * registers set to the value of 0.
+ *
+ * VAL opcode is represented as 1vvvvvxx. It contains a 5-bit integer
+ * representing the value of a register, and a 2-bit integer representing
+ * the number of contiguous registers set to that value 'vvvvv'.
+ * To obtain the value and run length, the integers vvvvv and xx must be
+ * incremented by one. This opcode can represent values from 1 to 32,
+ * repeated from 1 to 4 times.
+ *
+ * The sparse representation can't represent registers with a value
+ * greater than 32, however it is very unlikely that we find such a register
+ * in an HLL with a cardinality where the sparse representation is still
+ * more memory efficient than the dense representation. When this happens the
+ * HLL is converted to the dense representation.
+ *
+ * The sparse representation is purely positional. For example a sparse
+ * representation of an empty HLL is just: XZERO:16384.
+ *
+ * An HLL having only 3 non-zero registers at position 1000, 1020, 1021
+ * respectively set to 2, 3, 3, is represented by the following three
+ * opcodes:
+ *
+ * XZERO:1000 (Registers 0-999 are set to 0)
+ * VAL:2,1    (1 register set to value 2, that is register 1000)
+ * ZERO:19    (Registers 1001-1019 set to 0)
+ * VAL:3,2    (2 registers set to value 3, that is registers 1020,1021)
+ * XZERO:15362 (Registers 1022-16383 set to 0)
+ *
+ * In the example the sparse representation used just 7 bytes instead
+ * of 12k in order to represent the HLL registers. In general for low
+ * cardinality there is a big win in terms of space efficiency, traded
+ * with CPU time since the sparse representation is slower to access.
  */
 
 /* ========================= HyperLogLog algorithm  ========================= */
@@ -169,9 +227,10 @@ static uint64_t MurmurHash64A(const void *key, int len, unsigned int seed)
 /* Given a string element to add to the HyperLogLog, returns the length
  * of the pattern 000..1 of the element hash. As a side effect 'regp' is
  * set to the register index this element hashes to. */
-static int hllPatLen(unsigned char *ele, size_t elesize, long *regp)
+int hllPatLen(unsigned char *ele, size_t elesize, int p, int hash,
+              long *regp)
 {
-  uint64_t hash, bit, index;
+  uint64_t h, bit, index;
   int count;
 
   /* Count the number of zeroes starting from bit HLL_REGISTERS
@@ -185,12 +244,16 @@ static int hllPatLen(unsigned char *ele, size_t elesize, long *regp)
    *
    * This may sound like inefficient, but actually in the average case
    * there are high probabilities to find a 1 after a few iterations. */
-  hash = MurmurHash64A(ele, (int)elesize, 0xadc83b19ULL);
-  index = hash & HLL_P_MASK; /* Register index. */
-  hash |= ((uint64_t)1 << 63); /* Make sure the loop terminates. */
-  bit = HLL_REGISTERS; /* First bit not used to address the register. */
+  if (hash == HLL_HASH_XXH64) {
+    h = XXH64(ele, elesize, 0);
+  } else {
+    h = MurmurHash64A(ele, (int)elesize, 0xadc83b19ULL);
+  }
+  index = h & (HLL_REGISTERS_P(p) - 1); /* Register index. */
+  h |= ((uint64_t)1 << 63); /* Make sure the loop terminates. */
+  bit = HLL_REGISTERS_P(p); /* First bit not used to address the register. */
   count = 1; /* Initialized to 1 since we count the "00000...1" pattern. */
-  while ((hash & bit) == 0) {
+  while ((h & bit) == 0) {
     count++;
     bit <<= 1;
   }
@@ -198,126 +261,110 @@ static int hllPatLen(unsigned char *ele, size_t elesize, long *regp)
   return count;
 }
 
-/* Compute SUM(2^-reg) in the dense representation.
- * PE is an array with a pre-computer table of values 2^-reg indexed by reg.
- * As a side effect the integer pointed by 'ezp' is set to the number
- * of zero registers. */
-static double hllDenseSum(uint8_t *registers, double *PE, int *ezp)
+/* Compute the register histogram in the dense representation. */
+static void hllDenseRegHisto(uint8_t *registers, int p, int *reghisto)
 {
-  double E = 0;
-  int j, ez = 0;
+  int j;
 
-  /* Redis default is to use 16384 registers 6 bits each. The code works
-   * with other values by modifying the defines, but for our target value
-   * we take a faster path with unrolled loops. */
-  if (HLL_REGISTERS == 16384 && HLL_BITS == 6) {
+  /* The registers are 6 bits each and there are always a multiple of 16 of
+   * them (p >= 4) so we take a faster path with unrolled loops. */
+  if (HLL_BITS == 6) {
     uint8_t *r = registers;
     unsigned long r0, r1, r2, r3, r4, r5, r6, r7, r8, r9,
         r10, r11, r12, r13, r14, r15;
-    for (j = 0; j < 1024; j++) {
+    for (j = 0; j < HLL_REGISTERS_P(p) / 16; j++) {
       /* Handle 16 registers per iteration. */
-      r0 = r[0] & 63; if (r0 == 0) ez++;
-      r1 = (r[0] >> 6 | r[1] << 2) & 63; if (r1 == 0) ez++;
-      r2 = (r[1] >> 4 | r[2] << 4) & 63; if (r2 == 0) ez++;
-      r3 = (r[2] >> 2) & 63; if (r3 == 0) ez++;
-      r4 = r[3] & 63; if (r4 == 0) ez++;
-      r5 = (r[3] >> 6 | r[4] << 2) & 63; if (r5 == 0) ez++;
-      r6 = (r[4] >> 4 | r[5] << 4) & 63; if (r6 == 0) ez++;
-      r7 = (r[5] >> 2) & 63; if (r7 == 0) ez++;
-      r8 = r[6] & 63; if (r8 == 0) ez++;
-      r9 = (r[6] >> 6 | r[7] << 2) & 63; if (r9 == 0) ez++;
-      r10 = (r[7] >> 4 | r[8] << 4) & 63; if (r10 == 0) ez++;
-      r11 = (r[8] >> 2) & 63; if (r11 == 0) ez++;
-      r12 = r[9] & 63; if (r12 == 0) ez++;
-      r13 = (r[9] >> 6 | r[10] << 2) & 63; if (r13 == 0) ez++;
-      r14 = (r[10] >> 4 | r[11] << 4) & 63; if (r14 == 0) ez++;
-      r15 = (r[11] >> 2) & 63; if (r15 == 0) ez++;
-
-      /* Additional parens will allow the compiler to optimize the
-       * code more with a loss of precision that is not very relevant
-       * here (floating point math is not commutative!). */
-      E += (PE[r0] + PE[r1]) + (PE[r2] + PE[r3]) + (PE[r4] + PE[r5]) +
-          (PE[r6] + PE[r7]) + (PE[r8] + PE[r9]) + (PE[r10] + PE[r11]) +
-          (PE[r12] + PE[r13]) + (PE[r14] + PE[r15]);
+      r0 = r[0] & 63;
+      r1 = (r[0] >> 6 | r[1] << 2) & 63;
+      r2 = (r[1] >> 4 | r[2] << 4) & 63;
+      r3 = (r[2] >> 2) & 63;
+      r4 = r[3] & 63;
+      r5 = (r[3] >> 6 | r[4] << 2) & 63;
+      r6 = (r[4] >> 4 | r[5] << 4) & 63;
+      r7 = (r[5] >> 2) & 63;
+      r8 = r[6] & 63;
+      r9 = (r[6] >> 6 | r[7] << 2) & 63;
+      r10 = (r[7] >> 4 | r[8] << 4) & 63;
+      r11 = (r[8] >> 2) & 63;
+      r12 = r[9] & 63;
+      r13 = (r[9] >> 6 | r[10] << 2) & 63;
+      r14 = (r[10] >> 4 | r[11] << 4) & 63;
+      r15 = (r[11] >> 2) & 63;
+
+      reghisto[r0]++;
+      reghisto[r1]++;
+      reghisto[r2]++;
+      reghisto[r3]++;
+      reghisto[r4]++;
+      reghisto[r5]++;
+      reghisto[r6]++;
+      reghisto[r7]++;
+      reghisto[r8]++;
+      reghisto[r9]++;
+      reghisto[r10]++;
+      reghisto[r11]++;
+      reghisto[r12]++;
+      reghisto[r13]++;
+      reghisto[r14]++;
+      reghisto[r15]++;
+
       r += 12;
     }
   } else {
-    for (j = 0; j < HLL_REGISTERS; j++) {
+    for (j = 0; j < HLL_REGISTERS_P(p); j++) {
       unsigned long reg;
-
       HLL_DENSE_GET_REGISTER(reg, registers, j);
-      if (reg == 0) {
-        ez++;
-        /* Increment E at the end of the loop. */
-      } else {
-        E += PE[reg]; /* Precomputed 2^(-reg[j]). */
-      }
+      reghisto[reg]++;
     }
-    E += ez; /* Add 2^0 'ez' times. */
   }
-  *ezp = ez;
-  return E;
 }
 
-/* Implements the SUM operation for uint8_t data type which is only used
- * internally as speedup for PFCOUNT with multiple keys. */
-double hllRawSum(uint8_t *registers, double *PE, int *ezp)
+
+/* Compute the register histogram in the sparse representation.
+ * Returns -1 if the sparse representation is invalid. */
+static int hllSparseRegHisto(const uint8_t *sparse, size_t sparselen,
+                             int precision, int *reghisto)
 {
-  double E = 0;
-  int j, ez = 0;
-  uint64_t *word = (uint64_t *)registers;
-  uint8_t *bytes;
-
-  for (j = 0; j < HLL_REGISTERS / 8; j++) {
-    if (*word == 0) {
-      ez += 8;
+  int idx = 0, runlen, regval;
+  const uint8_t *end = sparse + sparselen, *p = sparse;
+
+  while (p < end) {
+    if (HLL_SPARSE_IS_ZERO(p)) {
+      runlen = HLL_SPARSE_ZERO_LEN(p);
+      idx += runlen;
+      reghisto[0] += runlen;
+      p++;
+    } else if (HLL_SPARSE_IS_XZERO(p)) {
+      runlen = HLL_SPARSE_XZERO_LEN(p);
+      idx += runlen;
+      reghisto[0] += runlen;
+      p += 2;
     } else {
-      bytes = (uint8_t *)word;
-      if (bytes[0]) E += PE[bytes[0]];
-      else ez++;
-      if (bytes[1]) E += PE[bytes[1]];
-      else ez++;
-      if (bytes[2]) E += PE[bytes[2]];
-      else ez++;
-      if (bytes[3]) E += PE[bytes[3]];
-      else ez++;
-      if (bytes[4]) E += PE[bytes[4]];
-      else ez++;
-      if (bytes[5]) E += PE[bytes[5]];
-      else ez++;
-      if (bytes[6]) E += PE[bytes[6]];
-      else ez++;
-      if (bytes[7]) E += PE[bytes[7]];
-      else ez++;
+      runlen = HLL_SPARSE_VAL_LEN(p);
+      regval = HLL_SPARSE_VAL_VALUE(p);
+      idx += runlen;
+      reghisto[regval] += runlen;
+      p++;
     }
-    word++;
   }
-  E += ez; /* 2^(-reg[j]) is 1 when m is 0, add it 'ez' times for every
-              zero register in the HLL. */
-  *ezp = ez;
-  return E;
+  return idx == HLL_REGISTERS_P(precision) && p == end ? 0 : -1;
 }
 
 /* ================== Dense representation implementation  ================== */
 
-/* "Add" the element in the dense hyperloglog data structure.
- * Actually nothing is added, but the max 0 pattern counter of the subset
- * the element belongs to is incremented if needed.
+/* Low level function to set the dense HLL register at 'index' to the
+ * specified value if the current value is smaller than 'count'.
  *
  * 'registers' is expected to have room for HLL_REGISTERS plus an
- * additional byte on the right. This requirement is met by sds strings
- * automatically since they are implicitly null terminated.
+ * additional byte on the right.
  *
  * The function always succeed, however if as a result of the operation
  * the approximated cardinality changed, 1 is returned. Otherwise 0
  * is returned. */
-int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize)
+int hllDenseSet(uint8_t *registers, long index, uint8_t count)
 {
-  uint8_t oldcount, count;
-  long index;
+  uint8_t oldcount;
 
-  /* Update the register if this element produced a longer run of zeroes. */
-  count = hllPatLen(ele, elesize, &index);
   HLL_DENSE_GET_REGISTER(oldcount, registers, index);
   if (count > oldcount) {
     HLL_DENSE_SET_REGISTER(registers, index, count);
@@ -327,73 +374,393 @@ int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize)
   }
 }
 
+
+/* Loads the 8 registers packed in the 6 bytes at p. */
+static uint64_t load48(const uint8_t *p)
+{
+  return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+      | (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40;
+}
+
+
+static void store48(uint8_t *p, uint64_t v)
+{
+  for (int i = 0; i < 6; ++i) {
+    p[i] = (uint8_t)(v >> (i * 8));
+  }
+}
+
+
+/* Computes the register wise maximum of 4 registers in 12 bit lanes (the
+ * register in the low 6 bits). The 7th bit of each lane is used as a guard
+ * so a single subtraction compares all the lanes (SIMD within a register). */
+static uint64_t max_lanes(uint64_t a, uint64_t b)
+{
+  const uint64_t guard = 0x0000040040040040ULL;
+  uint64_t ge = (((a | guard) - b) & guard) >> 6; /* 1 in lanes where a >= b */
+  uint64_t mask = ge * HLL_REGISTER_MAX;
+  return (a & mask) | (b & ~mask);
+}
+
+
+void hllDenseMerge(uint8_t *dest, const uint8_t *src, int p)
+{
+  const uint64_t even = 0x000003f03f03f03fULL; /* registers 0,2,4,6 */
+  int j;
+
+  for (j = 0; j < HLL_DENSE_BYTES(p); j += 6) {
+    uint64_t s = load48(src + j);
+    if (s == 0) continue;
+    uint64_t d = load48(dest + j);
+    uint64_t lo = max_lanes(d & even, s & even);
+    uint64_t hi = max_lanes((d >> 6) & even, (s >> 6) & even);
+    store48(dest + j, lo | hi << 6);
+  }
+}
+
+/* ================== Sparse representation implementation  ================= */
+
+size_t hllSparseInit(uint8_t *sparse, int p)
+{
+  uint8_t *s = sparse;
+  long registers = HLL_REGISTERS_P(p);
+  while (registers) {
+    long len = registers > HLL_SPARSE_XZERO_MAX_LEN ? HLL_SPARSE_XZERO_MAX_LEN
+        : registers;
+    HLL_SPARSE_XZERO_SET(s, len);
+    s += 2;
+    registers -= len;
+  }
+  return s - sparse;
+}
+
+
+/* Low level function to set the sparse HLL register at 'index' to the
+ * specified value if the current value is smaller than 'count'.
+ *
+ * The caller must ensure the sparse array has room for three additional bytes
+ * (the largest growth of a single update).
+ *
+ * The function returns 1 if the register was updated, 0 if it already had a
+ * greater or equal value, and -1 if the value can not be represented with
+ * the sparse encoding (or the representation is invalid) so the HLL must be
+ * converted to the dense representation. */
+int hllSparseSet(uint8_t *sparse, size_t *sparselen, long index,
+                 uint8_t count)
+{
+  uint8_t oldcount, *p, *end, *prev, *next;
+  long first, span;
+  long is_zero = 0, is_xzero = 0, is_val = 0, runlen = 0;
+
+  /* If the count is too big to be representable by the sparse representation
+   * switch to dense representation. */
+  if (count > HLL_SPARSE_VAL_MAX_VALUE) return -1;
+
+  /* Step 1: we need to locate the opcode we need to modify to check
+   * if a value update is actually needed. */
+  end = sparse + *sparselen;
+  p = sparse;
+  first = 0;
+  prev = NULL; /* Points to previous opcode at the end of the loop. */
+  next = NULL; /* Points to the next opcode at the end of the loop. */
+  span = 0;
+  while (p < end) {
+    long oplen;
+
+    /* Set span to the number of registers covered by this opcode.
+     *
+     * This is the most performance critical loop of the sparse
+     * representation. Sorting the conditionals from the most to the
+     * least frequent opcode in many-bytes sparse HLLs is faster. */
+    oplen = 1;
+    if (HLL_SPARSE_IS_ZERO(p)) {
+      span = HLL_SPARSE_ZERO_LEN(p);
+    } else if (HLL_SPARSE_IS_VAL(p)) {
+      span = HLL_SPARSE_VAL_LEN(p);
+    } else { /* XZERO. */
+      span = HLL_SPARSE_XZERO_LEN(p);
+      oplen = 2;
+    }
+    /* Break if this opcode covers the register as 'index'. */
+    if (index <= first + span - 1) break;
+    prev = p;
+    p += oplen;
+    first += span;
+  }
+  if (span == 0 || p >= end) return -1; /* Invalid format. */
+
+  next = HLL_SPARSE_IS_XZERO(p) ? p + 2 : p + 1;
+  if (next >= end) next = NULL;
+
+  /* Cache current opcode type to avoid using the macro again and
+   * again for something that will not change.
+   * Also cache the run-length of the opcode. */
+  if (HLL_SPARSE_IS_ZERO(p)) {
+    is_zero = 1;
+    runlen = HLL_SPARSE_ZERO_LEN(p);
+  } else if (HLL_SPARSE_IS_XZERO(p)) {
+    is_xzero = 1;
+    runlen = HLL_SPARSE_XZERO_LEN(p);
+  } else {
+    is_val = 1;
+    runlen = HLL_SPARSE_VAL_LEN(p);
+  }
+
+  /* Step 2: After the loop:
+   *
+   * 'first' stores to the index of the first register covered
+   *  by the current opcode, which is pointed by 'p'.
+   *
+   * 'next' ad 'prev' store respectively the next and previous opcode,
+   *  or NULL if the opcode at 'p' is respectively the last or first.
+   *
+   * 'span' is set to the number of registers covered by the current
+   *  opcode.
+   *
+   * There are different cases in order to update the data structure
+   * in place without generating it from scratch:
+   *
+   * A) If it is a VAL opcode already set to a value >= our 'count'
+   *    no update is needed, regardless of the VAL run-length field.
+   *    In this case PFADD returns 0 since no changes are performed.
+   *
+   * B) If it is a VAL opcode with len = 1 (representing only our
+   *    register) and the value is less than 'count', we just update it
+   *    since this is a trivial case. */
+  if (is_val) {
+    oldcount = HLL_SPARSE_VAL_VALUE(p);
+    /* Case A. */
+    if (oldcount >= count) return 0;
+
+    /* Case B. */
+    if (runlen == 1) {
+      HLL_SPARSE_VAL_SET(p, count, 1);
+      goto updated;
+    }
+  }
+
+  /* C) Another trivial to handle case is a ZERO opcode with a len of 1.
+   * We can just replace it with a VAL opcode with our value and len of 1. */
+  if (is_zero && runlen == 1) {
+    HLL_SPARSE_VAL_SET(p, count, 1);
+    goto updated;
+  }
+
+  /* D) General case.
+   *
+   * The other cases are more complex: our register requires to be updated
+   * and is either currently represented by a VAL opcode with len > 1,
+   * by a ZERO opcode with len > 1, or by an XZERO opcode.
+   *
+   * In those cases the original opcode must be split into multiple
+   * opcodes. The worst case is an XZERO split in the middle resulting into
+   * XZERO - VAL - XZERO, so the resulting sequence max length is
+   * 5 bytes.
+   *
+   * We perform the split writing the new sequence into the 'new' buffer
+   * with 'newlen' as length. Later the new sequence is inserted in place
+   * of the old one, possibly moving what is on the right a few bytes
+   * if the new sequence is longer than the older one. */
+  uint8_t seq[5], *n = seq;
+  long last = first + span - 1; /* Last register covered by the sequence. */
+  long len;
+
+  if (is_zero || is_xzero) {
+    /* Handle splitting of ZERO / XZERO. */
+    if (index != first) {
+      len = index - first;
+      if (len > HLL_SPARSE_ZERO_MAX_LEN) {
+        HLL_SPARSE_XZERO_SET(n, len);
+        n += 2;
+      } else {
+        HLL_SPARSE_ZERO_SET(n, len);
+        n++;
+      }
+    }
+    HLL_SPARSE_VAL_SET(n, count, 1);
+    n++;
+    if (index != last) {
+      len = last - index;
+      if (len > HLL_SPARSE_ZERO_MAX_LEN) {
+        HLL_SPARSE_XZERO_SET(n, len);
+        n += 2;
+      } else {
+        HLL_SPARSE_ZERO_SET(n, len);
+        n++;
+      }
+    }
+  } else {
+    /* Handle splitting of VAL. */
+    int curval = HLL_SPARSE_VAL_VALUE(p);
+
+    if (index != first) {
+      len = index - first;
+      HLL_SPARSE_VAL_SET(n, curval, len);
+      n++;
+    }
+    HLL_SPARSE_VAL_SET(n, count, 1);
+    n++;
+    if (index != last) {
+      len = last - index;
+      HLL_SPARSE_VAL_SET(n, curval, len);
+      n++;
+    }
+  }
+
+  /* Step 3: substitute the new sequence with the old one.
+   *
+   * Note that we already allocated space on the buffer for the worst case
+   * (three extra bytes). */
+  long seqlen = n - seq;
+  long oldlen = is_xzero ? 2 : 1;
+  long deltalen = seqlen - oldlen;
+
+  if (deltalen && next) memmove(next + deltalen, next, end - next);
+  *sparselen += deltalen;
+  memcpy(p, seq, seqlen);
+  end += deltalen;
+
+updated:
+  /* Step 4: Merge adjacent values if possible.
+   *
+   * The representation was updated, however the resulting representation
+   * may not be optimal: adjacent VAL opcodes can sometimes be merged into
+   * a single one. */
+  p = prev ? prev : sparse;
+  int scanlen = 5; /* Scan up to 5 upcodes starting from prev. */
+  while (p < end && scanlen--) {
+    if (HLL_SPARSE_IS_XZERO(p)) {
+      p += 2;
+      continue;
+    } else if (HLL_SPARSE_IS_ZERO(p)) {
+      p++;
+      continue;
+    }
+    /* We need two adjacent VAL opcodes to try a merge, having
+     * the same value, and a len that fits the VAL opcode max len. */
+    if (p + 1 < end && HLL_SPARSE_IS_VAL(p + 1)) {
+      int v1 = HLL_SPARSE_VAL_VALUE(p);
+      int v2 = HLL_SPARSE_VAL_VALUE(p + 1);
+      if (v1 == v2) {
+        int mergedlen = HLL_SPARSE_VAL_LEN(p) + HLL_SPARSE_VAL_LEN(p + 1);
+        if (mergedlen <= HLL_SPARSE_VAL_MAX_LEN) {
+          HLL_SPARSE_VAL_SET(p + 1, v1, mergedlen);
+          memmove(p, p + 1, end - p);
+          *sparselen -= 1;
+          end--;
+          /* After a merge we reiterate without incrementing 'p'
+           * in order to try to merge the just merged value with
+           * a value on its right. */
+          continue;
+        }
+      }
+    }
+    p++;
+  }
+  return 1;
+}
+
+
+int hllSparseMerge(uint8_t *registers, const uint8_t *sparse,
+                   size_t sparselen, int precision)
+{
+  const uint8_t *p = sparse, *end = sparse + sparselen;
+  long runlen, regval;
+  long idx = 0;
+
+  while (p < end) {
+    if (HLL_SPARSE_IS_ZERO(p)) {
+      runlen = HLL_SPARSE_ZERO_LEN(p);
+      idx += runlen;
+      p++;
+    } else if (HLL_SPARSE_IS_XZERO(p)) {
+      runlen = HLL_SPARSE_XZERO_LEN(p);
+      idx += runlen;
+      p += 2;
+    } else {
+      runlen = HLL_SPARSE_VAL_LEN(p);
+      regval = HLL_SPARSE_VAL_VALUE(p);
+      if ((runlen + idx) > HLL_REGISTERS_P(precision)) break; /* Overflow. */
+      while (runlen--) {
+        hllDenseSet(registers, idx, (uint8_t)regval);
+        idx++;
+      }
+      p++;
+    }
+  }
+  return idx == HLL_REGISTERS_P(precision) ? 0 : -1;
+}
+
 /* ========================= HyperLogLog Count ==============================
  * This is the core of the algorithm where the approximated count is computed.
- * The function uses the lower level hllDenseSum() function as helpers to
- * compute the SUM(2^-reg) part of the computation, which is
- * representation-specific, while all the rest is common. */
+ * The function uses the lower level hllDenseRegHisto() and hllSparseRegHisto()
+ * functions as helpers to compute the register histogram, which is
+ * representation-specific, while all the rest is common.
+ *
+ * The cardinality is estimated with the improved raw estimator from
+ * O. Ertl, "New cardinality estimation algorithms for HyperLogLog sketches"
+ * which corrects the small and large range bias of the original HyperLogLog
+ * estimator analytically so it works for any precision without the empirical
+ * bias tables of HyperLogLog++. */
+
+/* Helper function sigma as defined in the paper. */
+static double hllSigma(double x)
+{
+  if (x == 1.) return INFINITY;
+  double zPrime;
+  double y = 1;
+  double z = x;
+  do {
+    x *= x;
+    zPrime = z;
+    z += x * y;
+    y += y;
+  } while (zPrime != z);
+  return z;
+}
+
+
+/* Helper function tau as defined in the paper. */
+static double hllTau(double x)
+{
+  if (x == 0. || x == 1.) return 0.;
+  double zPrime;
+  double y = 1.0;
+  double z = 1 - x;
+  do {
+    x = sqrt(x);
+    zPrime = z;
+    y *= 0.5;
+    z -= pow(1 - x, 2) * y;
+  } while (zPrime != z);
+  return z / 3;
+}
+
 
 /* Return the approximated cardinality of the set based on the harmonic
- * mean of the registers values. 'hdr' points to the start of the SDS
- * representing the String object holding the HLL representation.
- *
- * hllCount() supports a special internal-only encoding of HLL_RAW, that
- * is, hdr->registers will point to an uint8_t array of HLL_REGISTERS element.
- * This is useful in order to speedup PFCOUNT when called against multiple
- * keys (no need to work with 6-bit integers encoding). */
-uint64_t hllCount(hyperloglog *hdr)
+ * mean of the registers values. 'hdr' points to the start of the HLL
+ * representation (header followed by the sparse or dense registers). */
+uint64_t hllCount(hyperloglog *hdr, size_t sparselen)
 {
-  double m = HLL_REGISTERS;
-  double E, alpha = 0.7213 / (1 + 1.079 / m);
-  int j, ez; /* Number of registers equal to 0. */
-
-/* We precompute 2^(-reg[j]) in a small table in order to
- * speedup the computation of SUM(2^-register[0..i]). */
-  static int initialized = 0;
-  static double PE[64];
-  if (!initialized) {
-    PE[0] = 1; /* 2^(-reg[j]) is 1 when m is 0. */
-    for (j = 1; j < 64; j++) {
-      /* 2^(-reg[j]) is the same as 1/2^reg[j]. */
-      PE[j] = 1.0 / (1ULL << j);
-    }
-    initialized = 1;
-  }
+  int p = HLL_PRECISION(hdr);
+  int q = 64 - p; /* The largest register value. */
+  double m = HLL_REGISTERS_P(p);
+  int j;
+  int reghisto[64] = { 0 };
 
-/* Compute SUM(2^-register[0..i]). */
   if (hdr->encoding == HLL_DENSE) {
-    E = hllDenseSum(hdr->registers, PE, &ez);
-  } else if (hdr->encoding == HLL_RAW) {
-    E = hllRawSum(hdr->registers, PE, &ez);
+    hllDenseRegHisto(hdr->registers, p, reghisto);
+  } else if (hdr->encoding == HLL_SPARSE) {
+    if (hllSparseRegHisto(hdr->registers, sparselen, p, reghisto)) return 0;
   } else {
     return 0;
   }
 
-/* Muliply the inverse of E for alpha_m * m^2 to have the raw estimate. */
-  E = (1 / E) * alpha * m * m;
-
-/* Use the LINEARCOUNTING algorithm for small cardinalities.
- * For larger values but up to 72000 HyperLogLog raw approximation is
- * used since linear counting error starts to increase. However HyperLogLog
- * shows a strong bias in the range 2.5*16384 - 72000, so we try to
- * compensate for it. */
-  if (E < m * 2.5 && ez != 0) {
-    E = m * log(m / ez); /* LINEARCOUNTING() */
-  } else if (m == 16384 && E < 72000) {
-    /* We did polynomial regression of the bias for this range, this
-     * way we can compute the bias for a given cardinality and correct
-     * according to it. Only apply the correction for P=14 that's what
-     * we use and the value the correction was verified with. */
-    double bias = 5.9119 * 1.0e-18 * (E * E * E * E)
-        - 1.4253 * 1.0e-12 * (E * E * E) +
-        1.2940 * 1.0e-7 * (E * E)
-        - 5.2921 * 1.0e-3 * E +
-        83.3216;
-    E -= E * (bias / 100);
+  double z = m * hllTau((m - reghisto[q + 1]) / m);
+  for (j = q; j >= 1; --j) {
+    z += reghisto[j];
+    z *= 0.5;
   }
-/* We don't apply the correction for E > 1/30 of 2^32 since we use
- * a 64 bit function and 6 bit counters. To apply the correction for
- * 1/30 of 2^64 is not needed since it would require a huge set
- * to approach such a value. */
-  return (uint64_t)E;
+  z += m * hllSigma(reghisto[0] / m);
+  return (uint64_t)llround(0.721347520444481703680 * m * m / z);
 }
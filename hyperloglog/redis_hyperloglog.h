@@ -5,25 +5,36 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 /** @brief Lua HyperLogLog probabilistic cardinality approximation leveraging
- *  the Redis HLL dense represention/implementation @file */
+ *  the Redis HLL sparse/dense represention/implementation @file */
 
 #ifndef redis_hyperloglog_h_
 #define redis_hyperloglog_h_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define HLL_P 14 /* The greater is P, the smaller the error. */
-#define HLL_REGISTERS (1<<HLL_P) /* With P=14, 16384 registers. */
+#define HLL_P_MIN 4
+#define HLL_P_MAX 18
+#define HLL_REGISTERS_P(p) (1<<(p)) /* With P=14, 16384 registers. */
+#define HLL_REGISTERS HLL_REGISTERS_P(HLL_P)
 #define HLL_BITS 6 /* Enough to count up to 63 leading zeroes. */
 #define HLL_DENSE 0 /* Dense encoding. */
-#define HLL_RAW 255 /* Only used internally, never exposed. */
+#define HLL_SPARSE 1 /* Sparse encoding. */
+#define HLL_HASH_MURMUR 0 /* MurmurHash64A (Redis compatible). */
+#define HLL_HASH_XXH64 1 /* xxHash64. */
 
+/* Size of the dense register data for precision p. */
+#define HLL_DENSE_BYTES(p) ((HLL_REGISTERS_P(p)*HLL_BITS+7)/8)
 /*'registers' is expected to have room for HLL_REGISTERS plus an
  * additional byte on the right. */
-#define HLL_REGISTERS_SIZE ((HLL_REGISTERS*HLL_BITS+7)/8) + 1
-#define HLL_P_MASK (HLL_REGISTERS-1) /* Mask to index register. */
+#define HLL_REGISTERS_SIZE (HLL_DENSE_BYTES(HLL_P) + 1)
 #define HLL_REGISTER_MAX ((1<<HLL_BITS)-1)
 
+/* Sparse representations larger than this (or the dense representation) are
+ * promoted to dense. */
+#define HLL_SPARSE_MAX_BYTES 3000
+
 /* =========================== Low level bit macros ========================= */
 
 /* Macros to access the dense representation.
@@ -177,37 +188,135 @@
     _p[_byte+1] |= _v >> _fb8; \
 } while(0)
 
+/* Macros to access the sparse representation.
+ * The macros parameter is expected to be an uint8_t pointer.
+ *
+ * ZERO:len     00xxxxxx         a run of 1-64 zero registers
+ * XZERO:len    01xxxxxx yyyyyyyy a run of 1-16384 zero registers
+ * VAL:val,len  1vvvvvxx         a run of 1-4 registers set to 1-32 */
+#define HLL_SPARSE_XZERO_BIT 0x40 /* 01xxxxxx */
+#define HLL_SPARSE_VAL_BIT 0x80 /* 1vvvvvxx */
+#define HLL_SPARSE_IS_ZERO(p) (((*(p)) & 0xc0) == 0) /* 00xxxxxx */
+#define HLL_SPARSE_IS_XZERO(p) (((*(p)) & 0xc0) == HLL_SPARSE_XZERO_BIT)
+#define HLL_SPARSE_IS_VAL(p) ((*(p)) & HLL_SPARSE_VAL_BIT)
+#define HLL_SPARSE_ZERO_LEN(p) (((*(p)) & 0x3f)+1)
+#define HLL_SPARSE_XZERO_LEN(p) (((((*(p)) & 0x3f) << 8) | (*((p)+1)))+1)
+#define HLL_SPARSE_VAL_VALUE(p) ((((*(p)) >> 2) & 0x1f)+1)
+#define HLL_SPARSE_VAL_LEN(p) (((*(p)) & 0x3)+1)
+#define HLL_SPARSE_VAL_MAX_VALUE 32
+#define HLL_SPARSE_VAL_MAX_LEN 4
+#define HLL_SPARSE_ZERO_MAX_LEN 64
+#define HLL_SPARSE_XZERO_MAX_LEN 16384
+#define HLL_SPARSE_VAL_SET(p,val,len) do { \
+    *(p) = (((val)-1)<<2|((len)-1))|HLL_SPARSE_VAL_BIT; \
+} while(0)
+#define HLL_SPARSE_ZERO_SET(p,len) do { \
+    *(p) = (len)-1; \
+} while(0)
+#define HLL_SPARSE_XZERO_SET(p,len) do { \
+    int _l = (len)-1; \
+    *(p) = (_l>>8) | HLL_SPARSE_XZERO_BIT; \
+    *((p)+1) = (_l&0xff); \
+} while(0)
+
+/* The Redis header with two of the reserved bytes used for the precision and
+ * hash function.  Both are zero for a Redis compatible (P=14, MurmurHash64A)
+ * HyperLogLog so its representation is unchanged. */
 typedef struct hyperloglog {
   char magic[4];      /* "HYLL" */
-  uint8_t encoding;   /* HLL_DENSE */
-  uint8_t notused[3]; /* Reserved for future use, must be zero. */
+  uint8_t encoding;   /* HLL_DENSE or HLL_SPARSE */
+  uint8_t precision;  /* HLL_P_MIN - HLL_P_MAX, zero for HLL_P */
+  uint8_t hash;       /* HLL_HASH_MURMUR or HLL_HASH_XXH64 */
+  uint8_t notused[1]; /* Reserved for future use, must be zero. */
   uint8_t card[8];    /* Cached cardinality, little endian. */
-  uint8_t registers[HLL_REGISTERS_SIZE]; /* Data bytes. */
+  uint8_t registers[]; /* Data bytes. */
 } hyperloglog;
 
-#define HLL_HDR_SIZE (sizeof(hyperloglog) - sizeof(uint8_t) \
-* HLL_REGISTERS_SIZE)
+#define HLL_HDR_SIZE sizeof(hyperloglog)
+#define HLL_PRECISION(hll) ((hll)->precision ? (hll)->precision : HLL_P)
 
 /**
- * "Add" the element in the dense hyperloglog data structure.
- * Actually nothing is added, but the max 0 pattern counter of the subset
- * the element belongs to is incremented if needed.
+ * Returns the length of the pattern 000..1 of the element hash and sets the
+ * register index the element hashes to.
  *
- * @param registers
  * @param ele
  * @param elesize
+ * @param p Precision
+ * @param hash HLL_HASH_MURMUR or HLL_HASH_XXH64
+ * @param regp Set to the register index
+ *
+ * @return int The register value for the element
+ */
+int hllPatLen(unsigned char *ele, size_t elesize, int p, int hash,
+              long *regp);
+
+/**
+ * Initializes an empty sparse representation (a run of zero registers).
+ *
+ * @param sparse Must have room for 2 bytes per 16384 registers
+ * @param p Precision
+ *
+ * @return size_t The length of the sparse representation
+ */
+size_t hllSparseInit(uint8_t *sparse, int p);
+
+/**
+ * Sets the dense register to count if it is greater than the current value.
+ *
+ * @param registers
+ * @param index
+ * @param count
+ *
+ * @return int 1 if the register was altered, 0 otherwise
+ */
+int hllDenseSet(uint8_t *registers, long index, uint8_t count);
+
+/**
+ * Sets the sparse register to count if it is greater than the current value.
+ * The sparse array must have room for three additional bytes.
+ *
+ * @param sparse
+ * @param sparselen Length of the sparse representation, updated on change
+ * @param index
+ * @param count
+ *
+ * @return int 1 if the register was altered, 0 if not, -1 if the value cannot
+ *         be represented and the HLL must be promoted to dense
+ */
+int hllSparseSet(uint8_t *sparse, size_t *sparselen, long index,
+                 uint8_t count);
+
+/**
+ * Merges (max) the sparse registers into the dense registers.
+ *
+ * @param registers
+ * @param sparse
+ * @param sparselen
+ * @param p Precision
+ *
+ * @return int 0 on success, -1 if the sparse representation is invalid
+ */
+int hllSparseMerge(uint8_t *registers, const uint8_t *sparse,
+                   size_t sparselen, int p);
+
+/**
+ * Merges (max) the src dense registers into the dest dense registers.
  *
- * @return int
+ * @param dest
+ * @param src
+ * @param p Precision
  */
-int hllDenseAdd(uint8_t *registers, unsigned char *ele, size_t elesize);
+void hllDenseMerge(uint8_t *dest, const uint8_t *src, int p);
 
 /**
- * Return cached cardinality or compute the current value.
+ * Computes the approximate cardinality.
  *
  * @param hll Pointer to the HyperLogLog object.
+ * @param sparselen Length of the register data (only used by HLL_SPARSE)
  *
- * @return uint64_t The approximated cardinality of the set.
+ * @return uint64_t The approximated cardinality of the set, 0 if the
+ *         representation is invalid.
  */
-uint64_t hllCount(hyperloglog *hll);
+uint64_t hllCount(hyperloglog *hll, size_t sparselen);
 
 #endif
@@ -52,12 +52,14 @@ static char* test_sandbox()
 
   int result = lsb_test_report(sb, 0);
   mu_assert(result == 0, "report() received: %d", result);
-  mu_assert(strcmp("100070", lsb_test_output) == 0, "test: initial received: %s",
+  mu_assert(strcmp("100079 100", lsb_test_output) == 0,
+            "test: initial received: %s",
             lsb_test_output); // count should remain the same
 
   result = lsb_test_report(sb, 0);
   mu_assert(result == 0, "report() received: %d", result);
-  mu_assert(strcmp("100070", lsb_test_output) == 0, "test: cache received: %s",
+  mu_assert(strcmp("100079 100", lsb_test_output) == 0,
+            "test: cache received: %s",
             lsb_test_output); // count should remain the same
 
   e = lsb_destroy(sb);
@@ -73,7 +75,8 @@ static char* test_sandbox()
 
   result = lsb_test_report(sb, 0);
   mu_assert(result == 0, "report() received: %d", result);
-  mu_assert(strcmp("100070", lsb_test_output) == 0, "test: reload received: %s",
+  mu_assert(strcmp("100079 100", lsb_test_output) == 0,
+            "test: reload received: %s",
             lsb_test_output); // count should remain the same
 
   for (int i = 0; i < 100000; ++i) {
@@ -83,14 +86,14 @@ static char* test_sandbox()
   }
   result = lsb_test_report(sb, 0);
   mu_assert(result == 0, "report() received: %d", result);
-  mu_assert(strcmp("100070", lsb_test_output) == 0,
+  mu_assert(strcmp("100079 100", lsb_test_output) == 0,
             "test: data replay received: %s", lsb_test_output);
   // count should remain the same
 
   // test clear
   lsb_test_report(sb, 99);
   lsb_test_report(sb, 0);
-  mu_assert(strcmp("0", lsb_test_output) == 0, "test: clear received: %s",
+  mu_assert(strcmp("0 0", lsb_test_output) == 0, "test: clear received: %s",
             lsb_test_output);
 
   e = lsb_destroy(sb);
@@ -116,7 +119,7 @@ static char* benchmark()
   }
   t = clock() - t;
   lsb_test_report(sb, 0);
-  mu_assert(strcmp("1006268", lsb_test_output) == 0, "received: %s", lsb_test_output);
+  mu_assert(strcmp("1006401 100", lsb_test_output) == 0, "received: %s", lsb_test_output);
   mu_assert(lsb_get_state(sb) == LSB_RUNNING, "benchmark failed %s",
             lsb_get_error(sb));
   e = lsb_destroy(sb);
@@ -4,7 +4,7 @@
 
 require "hyperloglog"
 require "string"
-assert(hyperloglog.version() == "1.0.1", hyperloglog.version())
+assert(hyperloglog.version() == "1.2.0", hyperloglog.version())
 
 local hll = hyperloglog.new()
 local hll1 = hyperloglog.new()
@@ -14,7 +14,7 @@ local base = hyperloglog.new()
 for i=1, 110000 do
     base:add(string.format("%08d", i))
 end
-local expected = 110505
+local expected = 110519
 assert(base:count() == expected, string.format("incorect count expected: %d, received: %d", expected, base:count()))
 
 local expected = 0
@@ -24,7 +24,7 @@ local expected = 50000
 for i=1, 50000 do
     hll:add(string.format("%08d", i))
 end
-expected = 49932
+expected = 49929
 assert(hll:count() == expected, string.format("incorect count expected: %d, received: %d", expected, hll:count()))
 hll1:merge(hll)
 assert(hll1:count() == expected, string.format("incorect count expected: %d, received: %d", expected, hll1:count()))
@@ -39,20 +39,70 @@ assert(hll_restored:count() == expected, string.format("incorect count expected:
 for i=100001, 110000 do
     hll1:add(string.format("%08d", i))
 end
-expected = 59872
+expected = 59936
 local count = hyperloglog.count(hll, hll1)
 assert(count == expected, string.format("incorect count expected: %d, received: %d", expected, count))
 
 for i=50001, 100000 do
     hll2:add(string.format("%08d", i))
 end
-expected = 50151
+expected = 50130
 assert(hll2:count() == expected, string.format("incorect count expected: %d, received: %d", expected, hll2:count()))
 
-expected = 110383
+expected = 110519
 count = hyperloglog.count(hll, hll1, hll2)
 assert(count == expected, string.format("incorect count expected: %d, received: %d", expected, count))
 
+-- sparse representation
+local sp = hyperloglog.new()
+local sp1 = hyperloglog.new()
+for i=1, 100 do
+    sp:add(string.format("%08d", i))
+end
+for i=51, 150 do
+    sp1:add(string.format("%08d", i))
+end
+expected = 100
+assert(sp:count() == expected, string.format("incorect count expected: %d, received: %d", expected, sp:count()))
+assert(#tostring(sp) == 12304, #tostring(sp))
+sp1:merge(sp)
+expected = 151
+assert(sp1:count() == expected, string.format("incorect count expected: %d, received: %d", expected, sp1:count()))
+expected = 110519
+count = hyperloglog.count(sp1, base)
+assert(count == expected, string.format("incorect count expected: %d, received: %d", expected, count))
+local dense = hyperloglog.new()
+dense:merge(hll2)
+dense:merge(sp1)
+expected = 50248
+assert(dense:count() == expected, string.format("incorect count expected: %d, received: %d", expected, dense:count()))
+hll_restored:fromstring(tostring(sp1))
+expected = 151
+assert(hll_restored:count() == expected, string.format("incorect count expected: %d, received: %d", expected, hll_restored:count()))
+
+-- configurable precision
+local p18 = hyperloglog.new(18)
+local p10 = hyperloglog.new(10)
+for i=1, 110000 do
+    local key = string.format("%08d", i)
+    p18:add(key)
+    p10:add(key)
+end
+expected = 109742
+assert(p18:count() == expected, string.format("incorect count expected: %d, received: %d", expected, p18:count()))
+expected = 105566
+assert(p10:count() == expected, string.format("incorect count expected: %d, received: %d", expected, p10:count()))
+local p10_str = tostring(p10)
+assert(#p10_str == 784, #p10_str)
+local p10_restored = hyperloglog.new(10)
+p10_restored:fromstring(p10_str)
+assert(p10_restored:count() == expected, string.format("incorect count expected: %d, received: %d", expected, p10_restored:count()))
+count = hyperloglog.count(p10, p10_restored)
+assert(count == expected, string.format("incorect count expected: %d, received: %d", expected, count))
+p10:clear()
+assert(p10:count() == 0, p10:count())
+assert(#tostring(hyperloglog.new(4)) == 28)
+
 hll:clear()
 
 local hll_str = tostring(hll)
@@ -61,8 +111,16 @@ assert(#hll_str == 12304, #hll_str)
 expected = 0
 assert(hll:count() == expected, string.format("incorect count expected: %d, received: %d", expected, hll:count()))
 
-local ok, err = pcall(hyperloglog.new, 2)
-assert(err == "bad argument #1 to '?' (incorrect number of arguments)", err)
+local ok, err = pcall(hyperloglog.new, 14, 1)
+assert(err == "bad argument #2 to '?' (incorrect number of arguments)", err)
+ok, err = pcall(hyperloglog.new, 3)
+assert(err == "bad argument #1 to '?' (precision must be between 4 and 18)", err)
+ok, err = pcall(hyperloglog.new, 19)
+assert(err == "bad argument #1 to '?' (precision must be between 4 and 18)", err)
+ok, err = pcall(hll.merge, hll, p18)
+assert(err == "bad argument #2 to '?' (incompatible precision or hash)", err)
+ok, err = pcall(hyperloglog.count, hll, hyperloglog.new(14))
+assert(err == "bad argument #2 to '?' (incompatible precision or hash)", err)
 
 ok, err = pcall(hyperloglog.count)
 assert(err == "bad argument #0 to '?' (incorrect number of arguments)", err)
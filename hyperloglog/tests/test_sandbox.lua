@@ -5,17 +5,19 @@
 require "hyperloglog"
 
 hll = hyperloglog.new()
+small = hyperloglog.new() -- remains sparse
 
 function process(ts)
     hll:add(ts)
+    small:add(ts % 100)
     return 0
 end
 
 function report(tc)
     if tc == 99 then
         hll:clear()
+        small:clear()
     else
-        write_output(hll:count())
+        write_output(hll:count(), " ", small:count())
     end
 end
-
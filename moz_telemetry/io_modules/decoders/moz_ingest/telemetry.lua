@@ -159,6 +159,22 @@ end
 
 local submissionField = {value = nil, representation = "json"}
 local doc = rjson.parse("{}") -- reuse this object to avoid creating a lot of GC
+
+-- dimensions extracted from the new style pings with a single doc:values call
+local new_style_fields = {
+    reason              = rjson.path("payload", "info", "reason"),
+    os                  = rjson.path("environment", "system", "os", "name"),
+    telemetryEnabled    = rjson.path("environment", "settings", "telemetryEnabled"),
+    activeExperimentId  = rjson.path("environment", "addons", "activeExperiment", "id"),
+    clientId            = rjson.path("clientId"),
+    docType             = rjson.path("type"),
+    appName             = rjson.path("application", "name"),
+    appVersion          = rjson.path("application", "version"),
+    appBuildId          = rjson.path("application", "buildId"),
+    appUpdateChannel    = rjson.path("application", "channel"),
+    appVendor           = rjson.path("application", "vendor"),
+}
+local os_version_path = rjson.path("environment", "system", "os", "version")
 local function process_json(hsr, msg)
     local ok, err = pcall(doc.parse_message, doc, hsr, "Fields[content]", nil, nil, true)
     if not ok then
@@ -215,22 +231,10 @@ local function process_json(hsr, msg)
         if cts then
             msg.Fields.creationTimestamp = dt.time_to_ns(dt.rfc3339:match(cts))
         end
-        msg.Fields.reason               = doc:value(doc:find("payload", "info", "reason"))
-        msg.Fields.os                   = doc:value(doc:find("environment", "system", "os", "name"))
-        msg.Fields.telemetryEnabled     = doc:value(doc:find("environment", "settings", "telemetryEnabled"))
-        msg.Fields.activeExperimentId   = doc:value(doc:find("environment", "addons", "activeExperiment", "id"))
-        msg.Fields.clientId             = doc:value(doc:find("clientId"))
+        doc:values(new_style_fields, msg.Fields)
         msg.Fields.sourceVersion        = sourceVersion
-        msg.Fields.docType              = doc:value(doc:find("type"))
-
-        local app = doc:find("application")
-        msg.Fields.appName              = doc:value(doc:find(app, "name"))
-        msg.Fields.appVersion           = doc:value(doc:find(app, "version"))
-        msg.Fields.appBuildId           = doc:value(doc:find(app, "buildId"))
-        msg.Fields.appUpdateChannel     = doc:value(doc:find(app, "channel"))
-        msg.Fields.appVendor            = doc:value(doc:find(app, "vendor"))
         msg.Fields.normalizedChannel    = mtn.channel(msg.Fields.appUpdateChannel)
-        msg.Fields.normalizedOSVersion  = mtn.os_version(doc:value(doc:find("environment", "system", "os", "version")))
+        msg.Fields.normalizedOSVersion  = mtn.os_version(doc:value(os_version_path))
 
         remove_objects(msg, doc, "environment", environment_objects)
         remove_objects(msg, doc, "payload", extract_payload_objects[msg.Fields.docType])
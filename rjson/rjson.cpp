@@ -13,7 +13,10 @@
 #include <rapidjson/schema.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
-#include <unordered_map>
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <vector>
 
 extern "C"
 {
@@ -32,6 +35,9 @@ int luaopen_rjson(lua_State *lua);
 #include "luasandbox/util/output_buffer.h"
 #include "luasandbox_output.h"
 #endif
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
 namespace rj = rapidjson;
 
@@ -40,21 +46,362 @@ typedef struct rjson_buffer
   unsigned char *buf;
   size_t         len;
   size_t         capacity;
+#ifdef HAVE_LIBDEFLATE
+  struct libdeflate_decompressor *ld;
+#endif
 } rjson_buffer;
 
 
+static size_t hash_key(const char *s, size_t len)
+{
+  size_t h = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  }
+  return h;
+}
+
+
+// Hashed member lookup for large objects. A single lookup is cheaper as a
+// linear scan than building an index so an object is only indexed on its
+// second lookup; the index is an open addressed table of member offsets
+// allocated in one block (keys are compared against the member names).
+class MemberIndex {
+public:
+  MemberIndex() : cnt_(0) { }
+  ~MemberIndex() { Clear(); }
+
+  // hash is optional (0)
+  rj::Value::MemberIterator Find(rj::Value *v, const char *key, size_t len,
+                                 size_t hash)
+  {
+    Entry *e = Get(v);
+    if (!e->slots) {
+      if (!e->seen) {
+        e->seen = true;
+        return Scan(v, key, len);
+      }
+      if (!Build(e)) return Scan(v, key, len);
+    }
+
+    uint32_t h = static_cast<uint32_t>(hash ? hash : hash_key(key, len));
+    rj::Value::MemberIterator begin = v->MemberBegin();
+    for (uint32_t i = h & e->mask;; i = (i + 1) & e->mask) {
+      const Slot &slot = e->slots[i];
+      if (!slot.member) return v->MemberEnd();
+      if (slot.hash == h) {
+        const rj::Value &name = begin[slot.member - 1].name;
+        if (name.GetStringLength() == len
+            && memcmp(name.GetString(), key, len) == 0) {
+          return begin + (slot.member - 1);
+        }
+      }
+    }
+  }
+
+  void Clear()
+  {
+    if (!cnt_) return;
+    for (size_t i = 0; i < entries_.size(); ++i) {
+      free(entries_[i].slots);
+      entries_[i] = Entry();
+    }
+    cnt_ = 0;
+  }
+
+private:
+  MemberIndex(const MemberIndex&);
+  MemberIndex& operator=(const MemberIndex&);
+
+  struct Slot {
+    uint32_t hash;
+    uint32_t member; // offset + 1, zero marks an unused slot
+  };
+
+  struct Entry {
+    Entry() : v(NULL), slots(NULL), mask(0), seen(false) { }
+    rj::Value *v;
+    Slot      *slots;
+    uint32_t  mask;
+    bool      seen;
+  };
+
+  static size_t Hash(const rj::Value *v)
+  {
+    return static_cast<size_t>(reinterpret_cast<uintptr_t>(v) >> 3) * 2654435761u;
+  }
+
+  static rj::Value::MemberIterator Scan(rj::Value *v, const char *key,
+                                        size_t len)
+  {
+    rj::Value name(rj::StringRef(key, static_cast<rj::SizeType>(len)));
+    return v->FindMember(name);
+  }
+
+  Entry* Get(rj::Value *v)
+  {
+    if ((cnt_ + 1) * 2 > entries_.size()) Grow();
+    size_t mask = entries_.size() - 1;
+    size_t i = Hash(v) & mask;
+    while (entries_[i].v && entries_[i].v != v) i = (i + 1) & mask;
+    if (!entries_[i].v) {
+      entries_[i].v = v;
+      ++cnt_;
+    }
+    return &entries_[i];
+  }
+
+  void Grow()
+  {
+    std::vector<Entry> old;
+    old.swap(entries_);
+    entries_.resize(old.empty() ? 16 : old.size() * 2);
+    size_t mask = entries_.size() - 1;
+    for (size_t i = 0; i < old.size(); ++i) {
+      if (!old[i].v) continue;
+      size_t j = Hash(old[i].v) & mask;
+      while (entries_[j].v) j = (j + 1) & mask;
+      entries_[j] = old[i];
+    }
+  }
+
+  // members are inserted in order so the first of any duplicate names is found
+  static bool Build(Entry *e)
+  {
+    size_t n = e->v->MemberCount();
+    size_t size = 16;
+    while (size < n * 2) size <<= 1;
+    e->slots = static_cast<Slot *>(calloc(size, sizeof(Slot)));
+    if (!e->slots) return false;
+    e->mask = static_cast<uint32_t>(size - 1);
+
+    uint32_t member = 1;
+    auto end = e->v->MemberEnd();
+    for (auto m = e->v->MemberBegin(); m != end; ++m, ++member) {
+      uint32_t h = static_cast<uint32_t>(hash_key(m->name.GetString(),
+                                                  m->name.GetStringLength()));
+      uint32_t i = h & e->mask;
+      while (e->slots[i].member) i = (i + 1) & e->mask;
+      e->slots[i].hash = h;
+      e->slots[i].member = member;
+    }
+    return true;
+  }
+
+  std::vector<Entry>  entries_;
+  size_t              cnt_;
+};
+
+
+static const unsigned  handle_slot_bits = sizeof(uintptr_t) * 4;
+static const uintptr_t handle_slot_mask = ((uintptr_t)1 << handle_slot_bits) - 1;
+static std::atomic<uint32_t> handle_generation(0);
+
+// Maps the lightuserdata handles given to Lua back to the document values. A
+// handle is a slot number tagged with the table generation; every document
+// (re)parse starts a new process wide generation so validating a handle is a
+// bounds check and a compare. Repeated lookups of the same value return the
+// same handle through an open addressed pointer table that is invalidated
+// along with the generation (no per handle allocations or clearing).
+class HandleTable {
+public:
+  HandleTable() : gen_(NextGeneration()), owned_(0), cnt_(0) { }
+  ~HandleTable() { DeleteOwned(); }
+
+  // returns NULL when the handle space is exhausted
+  void* Insert(rj::Value *v, bool owned = false)
+  {
+    if ((cnt_ + 1) * 2 > entries_.size()) Grow();
+    size_t mask = entries_.size() - 1;
+    for (size_t i = Hash(v) & mask;; i = (i + 1) & mask) {
+      Entry &e = entries_[i];
+      if (e.gen != gen_) {
+        if (!NewSlot(v, owned)) return NULL;
+        e.v = v;
+        e.gen = gen_;
+        e.slot = static_cast<uint32_t>(slots_.size() - 1);
+        ++cnt_;
+        return ToHandle(e.slot);
+      }
+      if (e.v == v) {
+        if (!slots_[e.slot].v) { // erased, the old handles stay invalid
+          if (!NewSlot(v, owned)) return NULL;
+          e.slot = static_cast<uint32_t>(slots_.size() - 1);
+        }
+        return ToHandle(e.slot);
+      }
+    }
+  }
+
+  rj::Value* Get(const void *h) const
+  {
+    uintptr_t u = reinterpret_cast<uintptr_t>(h);
+    size_t slot = static_cast<size_t>(u & handle_slot_mask) - 1;
+    if (u >> handle_slot_bits != Tag() || slot >= slots_.size()) return NULL;
+    return slots_[slot].v;
+  }
+
+  // invalidates the handle of a value removed from the document
+  void Erase(rj::Value *v)
+  {
+    if (!cnt_) return;
+    size_t mask = entries_.size() - 1;
+    for (size_t i = Hash(v) & mask; entries_[i].gen == gen_; i = (i + 1) & mask) {
+      if (entries_[i].v == v) {
+        Slot &s = slots_[entries_[i].slot];
+        if (!s.owned) s.v = NULL; // owned values are never part of the tree
+        return;
+      }
+    }
+  }
+
+  void Clear()
+  {
+    DeleteOwned();
+    slots_.clear();
+    cnt_ = 0;
+    uint32_t gen = NextGeneration();
+    if (gen < gen_) { // wrapped, stale entries could match again
+      for (size_t i = 0; i < entries_.size(); ++i) entries_[i].gen = 0;
+    }
+    gen_ = gen;
+  }
+
+private:
+  HandleTable(const HandleTable&);
+  HandleTable& operator=(const HandleTable&);
+
+  struct Slot {
+    rj::Value *v;
+    bool      owned;
+  };
+
+  struct Entry {
+    rj::Value *v;
+    uint32_t  gen;
+    uint32_t  slot;
+  };
+
+  static uint32_t NextGeneration()
+  {
+    uint32_t gen;
+    do {
+      gen = ++handle_generation;
+    } while (gen == 0); // zero marks an unused entry
+    return gen;
+  }
+
+  static size_t Hash(const rj::Value *v)
+  {
+    return static_cast<size_t>(reinterpret_cast<uintptr_t>(v) >> 3) * 2654435761u;
+  }
+
+  uintptr_t Tag() const { return gen_ & (UINTPTR_MAX >> handle_slot_bits); }
+
+  void* ToHandle(uint32_t slot) const
+  {
+    return reinterpret_cast<void *>(Tag() << handle_slot_bits | (slot + 1));
+  }
+
+  bool NewSlot(rj::Value *v, bool owned)
+  {
+    if (slots_.size() >= handle_slot_mask - 1) return false;
+    Slot s = { v, owned };
+    slots_.push_back(s);
+    if (owned) ++owned_;
+    return true;
+  }
+
+  void Grow()
+  {
+    std::vector<Entry> old;
+    old.swap(entries_);
+    Entry e = { NULL, 0, 0 };
+    entries_.resize(old.empty() ? 64 : old.size() * 2, e);
+    size_t mask = entries_.size() - 1;
+    for (size_t i = 0; i < old.size(); ++i) {
+      if (old[i].gen != gen_) continue;
+      size_t j = Hash(old[i].v) & mask;
+      while (entries_[j].gen == gen_) j = (j + 1) & mask;
+      entries_[j] = old[i];
+    }
+  }
+
+  void DeleteOwned()
+  {
+    for (size_t i = 0; owned_ && i < slots_.size(); ++i) {
+      if (slots_[i].owned) {
+        delete(slots_[i].v);
+        slots_[i].owned = false;
+        --owned_;
+      }
+    }
+  }
+
+  std::vector<Slot>   slots_;
+  std::vector<Entry>  entries_;
+  uint32_t            gen_;
+  size_t              owned_;
+  size_t              cnt_;
+};
+
+
 typedef struct rjson
 {
-  rj::MemoryPoolAllocator<>             *mpa;
-  rj::Document                          *doc;
-  rj::Value                             *val;
-  std::unordered_map<rj::Value *, bool> *refs;
-  rjson_buffer                          insitu;
+  rj::MemoryPoolAllocator<>                       *mpa;
+  rj::Document                                    *doc;
+  rj::Value                                       *val;
+  HandleTable                                     *handles;
+  MemberIndex                                     *index;
+  rjson_buffer                                    insitu;
 } rjson;
 
+// Output handler for the validators used while parsing, it forwards the SAX
+// events to the document being built.
+class DocumentForwarder {
+public:
+  typedef char Ch;
+  DocumentForwarder() : d_(NULL) { }
+  void SetDocument(rj::Document *d) { d_ = d; }
+  bool Null() { return d_->Null(); }
+  bool Bool(bool b) { return d_->Bool(b); }
+  bool Int(int i) { return d_->Int(i); }
+  bool Uint(unsigned u) { return d_->Uint(u); }
+  bool Int64(int64_t i) { return d_->Int64(i); }
+  bool Uint64(uint64_t u) { return d_->Uint64(u); }
+  bool Double(double d) { return d_->Double(d); }
+  bool RawNumber(const Ch *s, rj::SizeType len, bool copy)
+  {
+    return d_->RawNumber(s, len, copy);
+  }
+  bool String(const Ch *s, rj::SizeType len, bool copy)
+  {
+    return d_->String(s, len, copy);
+  }
+  bool StartObject() { return d_->StartObject(); }
+  bool Key(const Ch *s, rj::SizeType len, bool copy)
+  {
+    return d_->Key(s, len, copy);
+  }
+  bool EndObject(rj::SizeType n) { return d_->EndObject(n); }
+  bool StartArray() { return d_->StartArray(); }
+  bool EndArray(rj::SizeType n) { return d_->EndArray(n); }
+private:
+  DocumentForwarder(const DocumentForwarder&);
+  DocumentForwarder& operator=(const DocumentForwarder&);
+  rj::Document *d_;
+};
+
+typedef rj::GenericSchemaValidator<rj::SchemaDocument, DocumentForwarder>
+    ParsingValidator;
+
 typedef struct rjson_schema
 {
-  rj::SchemaDocument *doc;
+  rj::SchemaDocument  *doc;
+  // validators are created on first use and reused (Reset) for every document
+  rj::SchemaValidator *validator;
+  DocumentForwarder   *fwd;
+  ParsingValidator    *pvalidator;
 } rjson_schema;
 
 typedef struct rjson_object_iterator
@@ -63,16 +410,46 @@ typedef struct rjson_object_iterator
   rj::Value::MemberIterator *end;
 } rjson_object_iterator;
 
+typedef struct rjson_path_element
+{
+  const char    *key;  // NULL for an array index
+  size_t        len;
+  size_t        hash;
+  rj::SizeType  idx;
+} rjson_path_element;
+
+typedef struct rjson_path
+{
+  int                 n;
+  rjson_path_element  *e; // elements and key strings follow the header
+} rjson_path;
+
 static const char *mozsvc_rjson             = "mozsvc.rjson";
 static const char *mozsvc_rjson_schema      = "mozsvc.rjson_schema";
 static const char *mozsvc_rjson_object_iter = "mozsvc.rjson_object_iter";
+static const char *mozsvc_rjson_extractor   = "mozsvc.rjson_extractor";
+static const char *mozsvc_rjson_path        = "mozsvc.rjson_path";
 
+// objects with fewer members are searched linearly
+static const rj::SizeType index_min_members = 32;
 
 static void init_rjson_buffer(rjson_buffer *b)
 {
   b->buf = NULL;
   b->len = 0;
   b->capacity = 0;
+#ifdef HAVE_LIBDEFLATE
+  b->ld = NULL; // allocated on the first gzipped payload
+#endif
+}
+
+
+static void free_rjson_buffer(rjson_buffer *b)
+{
+  free(b->buf);
+#ifdef HAVE_LIBDEFLATE
+  if (b->ld) libdeflate_free_decompressor(b->ld);
+#endif
 }
 
 
@@ -81,37 +458,213 @@ static void init_rjson(rjson *j)
   j->mpa = new rj::MemoryPoolAllocator<>;
   j->doc = new rj::Document(j->mpa);
   j->val = NULL;
-  j->refs = new std::unordered_map<rj::Value *, bool>;
+  j->handles = new HandleTable;
+  j->index = new MemberIndex;
   init_rjson_buffer(&j->insitu);
 }
 
 
+static rjson_schema* check_schema(lua_State *lua, int idx)
+{
+  if (lua_isnoneornil(lua, idx)) return NULL;
+  return static_cast<rjson_schema *>
+      (luaL_checkudata(lua, idx, mozsvc_rjson_schema));
+}
+
+
+static rj::SchemaValidator* get_validator(rjson_schema *hs)
+{
+  if (!hs->validator) {
+    hs->validator = new rj::SchemaValidator(*hs->doc);
+  } else {
+    hs->validator->Reset();
+  }
+  return hs->validator;
+}
+
+
+static ParsingValidator* get_parsing_validator(rjson_schema *hs,
+                                               rj::Document *doc)
+{
+  if (!hs->pvalidator) {
+    hs->fwd = new DocumentForwarder;
+    hs->pvalidator = new ParsingValidator(*hs->doc, *hs->fwd);
+  } else {
+    hs->pvalidator->Reset();
+  }
+  hs->fwd->SetDocument(doc);
+  return hs->pvalidator;
+}
+
+
+template <typename Validator>
+static void push_schema_error(lua_State *lua, Validator *validator,
+                              const char *prefix)
+{
+  luaL_Buffer b;
+  luaL_buffinit(lua, &b);
+  luaL_addstring(&b, prefix);
+  rj::StringBuffer sb;
+  validator->GetInvalidSchemaPointer().StringifyUriFragment(sb);
+  luaL_addstring(&b, "SchemaURI: ");
+  luaL_addstring(&b, sb.GetString());
+  luaL_addstring(&b, " Keyword: ");
+  luaL_addstring(&b, validator->GetInvalidSchemaKeyword());
+  sb.Clear();
+  validator->GetInvalidDocumentPointer().StringifyUriFragment(sb);
+  luaL_addstring(&b, " DocumentURI: ");
+  luaL_addstring(&b, sb.GetString());
+  luaL_pushresult(&b);
+}
+
+
+// Populate generator running the reader through the schema's pooled
+// ParsingValidator, the validator forwards the events to the document so
+// invalid input stops the parse at the first violation (doc:validate uses the
+// schema's other pooled validator, see get_validator).
+template <unsigned flags, typename Stream>
+class ValidatingParser {
+public:
+  ValidatingParser(Stream &is, ParsingValidator &v) : is_(is), v_(v) { }
+  bool operator()(rj::Document &)
+  {
+    pr_ = reader_.Parse<flags>(is_, v_);
+    return !pr_.IsError();
+  }
+  const rj::ParseResult& GetParseResult() const { return pr_; }
+private:
+  ValidatingParser(const ValidatingParser&);
+  ValidatingParser& operator=(const ValidatingParser&);
+  Stream            &is_;
+  ParsingValidator  &v_;
+  rj::Reader        reader_;
+  rj::ParseResult   pr_;
+};
+
+
+template <unsigned flags, typename Stream>
+static bool parse_validating(lua_State *lua, rjson *j, Stream &is,
+                             rjson_schema *hs)
+{
+  ParsingValidator *v = get_parsing_validator(hs, j->doc);
+  ValidatingParser<flags, Stream> vp(is, *v);
+  j->doc->Populate(vp);
+  if (!vp.GetParseResult().IsError()) return true;
+
+  j->doc->SetNull();
+  if (!v->IsValid()) {
+    push_schema_error(lua, v, "failed to validate ");
+  } else {
+    lua_pushfstring(lua, "failed to parse offset:%f %s",
+                    (lua_Number)vp.GetParseResult().Offset(),
+                    rj::GetParseError_En(vp.GetParseResult().Code()));
+  }
+  return false;
+}
+
+
+static bool parse_json(lua_State *lua, rjson *j, const char *json,
+                       bool validate, rjson_schema *hs)
+{
+  if (hs) {
+    rj::StringStream is(json);
+    if (validate) {
+      return parse_validating<rj::kParseValidateEncodingFlag>(lua, j, is, hs);
+    }
+    return parse_validating<rj::kParseDefaultFlags>(lua, j, is, hs);
+  }
+
+  if (validate) {
+    j->doc->Parse<rj::kParseValidateEncodingFlag>(json);
+  } else {
+    j->doc->Parse(json);
+  }
+  if (j->doc->HasParseError()) {
+    lua_pushfstring(lua, "failed to parse offset:%f %s",
+                    (lua_Number)j->doc->GetErrorOffset(),
+                    rj::GetParseError_En(j->doc->GetParseError()));
+    j->doc->SetNull();
+    return false;
+  }
+  return true;
+}
+
+
+// hash is optional (0), it is only needed when the object is indexed
+static rj::Value::MemberIterator find_member(rjson *j, rj::Value *v,
+                                             const char *key, size_t len,
+                                             size_t hash)
+{
+  if (v->MemberCount() < index_min_members) {
+    rj::Value name(rj::StringRef(key, static_cast<rj::SizeType>(len)));
+    return v->FindMember(name);
+  }
+  return j->index->Find(v, key, len, hash);
+}
+
+
+static rj::Value* find_path(rjson *j, rj::Value *v, const rjson_path *p)
+{
+  for (int i = 0; v && i < p->n; ++i) {
+    const rjson_path_element *e = &p->e[i];
+    if (e->key) {
+      if (!v->IsObject()) return NULL;
+      rj::Value::MemberIterator itr = find_member(j, v, e->key, e->len, e->hash);
+      v = itr == v->MemberEnd() ? NULL : &itr->value;
+    } else {
+      if (!v->IsArray() || e->idx >= v->Size()) return NULL;
+      v = &(*v)[e->idx];
+    }
+  }
+  return v;
+}
+
+
 static rj::Value* check_value(lua_State *lua)
 {
   int n = lua_gettop(lua);
   luaL_argcheck(lua, n >= 1 && n <= 2, 0, "invalid number of arguments");
   rjson *j = static_cast<rjson *>(luaL_checkudata(lua, 1, mozsvc_rjson));
-  rj::Value *v = static_cast<rj::Value *>(lua_touserdata(lua, 2));
-  if (!v) {
-    int t = lua_type(lua, 2);
-    if (t == LUA_TNONE) {
-      v = j->doc ? j->doc : j->val;
-    } else if (t == LUA_TNIL) {
-      v = NULL;
-    } else {
-      luaL_checktype(lua, 2, LUA_TLIGHTUSERDATA);
-    }
-  } else if (j->refs->find(v) == j->refs->end()) {
-    luaL_error(lua, "invalid value");
+  if (lua_type(lua, 2) == LUA_TUSERDATA) {
+    rjson_path *p = static_cast<rjson_path *>
+        (luaL_checkudata(lua, 2, mozsvc_rjson_path));
+    return find_path(j, j->doc ? j->doc : j->val, p);
+  }
+  rj::Value *v = NULL;
+  switch (lua_type(lua, 2)) {
+  case LUA_TNONE:
+    v = j->doc ? j->doc : j->val;
+    break;
+  case LUA_TNIL:
+    break;
+  case LUA_TLIGHTUSERDATA:
+    v = j->handles->Get(lua_touserdata(lua, 2));
+    if (!v) luaL_error(lua, "invalid value");
+    break;
+  default:
+    luaL_checktype(lua, 2, LUA_TLIGHTUSERDATA);
+    break;
   }
   return v;
 }
 
 
+static void push_handle(lua_State *lua, rjson *j, rj::Value *v,
+                        bool owned = false)
+{
+  void *h = j->handles->Insert(v, owned);
+  if (!h) luaL_error(lua, "too many value handles");
+  lua_pushlightuserdata(lua, h);
+}
+
+
 static int schema_gc(lua_State *lua)
 {
   rjson_schema *hs = static_cast<rjson_schema *>
       (luaL_checkudata(lua, 1, mozsvc_rjson_schema));
+  delete(hs->pvalidator);
+  delete(hs->fwd);
+  delete(hs->validator);
   delete(hs->doc);
   return 0;
 }
@@ -126,27 +679,15 @@ static int iter_gc(lua_State *lua)
 }
 
 
-static void delete_owned_refs(std::unordered_map<rj::Value *, bool> *refs)
-{
-  auto end = refs->end();
-  for (auto it = refs->begin(); it != end; ++it) {
-    if (it->second) {
-      delete(it->first);
-      it->second = false;
-    }
-  }
-}
-
-
 static int rjson_gc(lua_State *lua)
 {
   rjson *j = static_cast<rjson *>(luaL_checkudata(lua, 1, mozsvc_rjson));
-  delete_owned_refs(j->refs);
-  delete(j->refs);
+  delete(j->handles);
+  delete(j->index);
   delete(j->val);
   delete(j->doc);
   RAPIDJSON_DELETE(j->mpa);
-  free(j->insitu.buf);
+  free_rjson_buffer(&j->insitu);
   return 0;
 }
 
@@ -156,6 +697,9 @@ static int rjson_parse_schema(lua_State *lua)
   const char *json = luaL_checkstring(lua, 1);
   rjson_schema *hs = static_cast<rjson_schema *>(lua_newuserdata(lua, sizeof*hs));
   hs->doc = NULL;
+  hs->validator = NULL;
+  hs->fwd = NULL;
+  hs->pvalidator = NULL;
   luaL_getmetatable(lua, mozsvc_rjson_schema);
   lua_setmetatable(lua, -2);
 
@@ -177,6 +721,52 @@ static int rjson_parse_schema(lua_State *lua)
 }
 
 
+static int rjson_new_path(lua_State *lua)
+{
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n > 0, 0, "invalid number of arguments");
+  size_t size = sizeof(rjson_path) + sizeof(rjson_path_element) * n;
+  for (int i = 1; i <= n; ++i) {
+    switch (lua_type(lua, i)) {
+    case LUA_TSTRING:
+      size += lua_objlen(lua, i);
+      break;
+    case LUA_TNUMBER:
+      luaL_argcheck(lua, lua_tonumber(lua, i) >= 0, i,
+                    "array index must be >= 0");
+      break;
+    default:
+      luaL_typerror(lua, i, "string or number");
+      break;
+    }
+  }
+
+  rjson_path *p = static_cast<rjson_path *>(lua_newuserdata(lua, size));
+  p->n = n;
+  p->e = reinterpret_cast<rjson_path_element *>(p + 1);
+  char *keys = reinterpret_cast<char *>(p->e + n);
+  for (int i = 1; i <= n; ++i) {
+    rjson_path_element *e = &p->e[i - 1];
+    if (lua_type(lua, i) == LUA_TSTRING) {
+      const char *key = lua_tolstring(lua, i, &e->len);
+      memcpy(keys, key, e->len);
+      e->key = keys;
+      e->hash = hash_key(key, e->len);
+      e->idx = 0;
+      keys += e->len;
+    } else {
+      e->key = NULL;
+      e->len = 0;
+      e->hash = 0;
+      e->idx = static_cast<rj::SizeType>(lua_tonumber(lua, i));
+    }
+  }
+  luaL_getmetatable(lua, mozsvc_rjson_path);
+  lua_setmetatable(lua, -2);
+  return 1;
+}
+
+
 static int rjson_parse(lua_State *lua)
 {
   const char *json = luaL_checkstring(lua, 1);
@@ -187,32 +777,18 @@ static int rjson_parse(lua_State *lua)
   } else {
     luaL_typerror(lua, 2, "boolean");
   }
+  rjson_schema *hs = check_schema(lua, 3);
   rjson *j = static_cast<rjson *>(lua_newuserdata(lua, sizeof*j));
   init_rjson(j);
   luaL_getmetatable(lua, mozsvc_rjson);
   lua_setmetatable(lua, -2);
 
-  if (!j->doc || !j->refs) {
+  if (!j->doc || !j->handles) {
     lua_pushstring(lua, "memory allocation failed");
     return lua_error(lua);
-  } else {
-    if (validate) {
-      if (j->doc->Parse<rj::kParseValidateEncodingFlag>(json).HasParseError()) {
-        lua_pushfstring(lua, "failed to parse offset:%f %s",
-                        (lua_Number)j->doc->GetErrorOffset(),
-                        rj::GetParseError_En(j->doc->GetParseError()));
-        return lua_error(lua);
-      }
-    } else {
-      if (j->doc->Parse(json).HasParseError()) {
-        lua_pushfstring(lua, "failed to parse offset:%f %s",
-                        (lua_Number)j->doc->GetErrorOffset(),
-                        rj::GetParseError_En(j->doc->GetParseError()));
-        return lua_error(lua);
-      }
-    }
+  } else if (!parse_json(lua, j, json, validate, hs)) {
+    return lua_error(lua);
   }
-  j->refs->insert(std::make_pair(j->doc, false));
   return 1;
 }
 
@@ -223,8 +799,8 @@ static int rjson_dparse(lua_State *lua)
   delete(j->val);
   j->val = NULL;
   j->insitu.len = 0;
-  delete_owned_refs(j->refs);
-  j->refs->clear();
+  j->handles->Clear();
+  j->index->Clear();
   j->mpa->Clear();
   j->doc->SetNull();
 
@@ -236,25 +812,11 @@ static int rjson_dparse(lua_State *lua)
   } else {
     luaL_typerror(lua, 3, "boolean");
   }
+  rjson_schema *hs = check_schema(lua, 4);
 
-  if (validate) {
-    if (j->doc->Parse<rj::kParseValidateEncodingFlag>(json).HasParseError()) {
-      lua_pushfstring(lua, "failed to parse offset:%f %s",
-                      (lua_Number)j->doc->GetErrorOffset(),
-                      rj::GetParseError_En(j->doc->GetParseError()));
-      j->doc->SetNull();
-      return lua_error(lua);
-    }
-  } else {
-    if (j->doc->Parse(json).HasParseError()) {
-      lua_pushfstring(lua, "failed to parse offset:%f %s",
-                      (lua_Number)j->doc->GetErrorOffset(),
-                      rj::GetParseError_En(j->doc->GetParseError()));
-      j->doc->SetNull();
-      return lua_error(lua);
-    }
+  if (!parse_json(lua, j, json, validate, hs)) {
+    return lua_error(lua);
   }
-  j->refs->insert(std::make_pair(j->doc, false));
   lua_pushvalue(lua, 1);
   return 1;
 }
@@ -267,26 +829,14 @@ static int rjson_validate(lua_State *lua)
   rjson_schema *hs = static_cast<rjson_schema *>
       (luaL_checkudata(lua, 2, mozsvc_rjson_schema));
 
-  rj::SchemaValidator validator(*hs->doc);
+  rj::SchemaValidator *validator = get_validator(hs);
   rj::Value *v = j->doc ? j->doc : j->val;
-  if (!v->Accept(validator)) {
+  if (!v->Accept(*validator)) {
     lua_pushboolean(lua, false);
-    luaL_Buffer b;
-    luaL_buffinit(lua, &b);
+    push_schema_error(lua, validator, "");
     rj::StringBuffer sb;
-    validator.GetInvalidSchemaPointer().StringifyUriFragment(sb);
-    luaL_addstring(&b, "SchemaURI: ");
-    luaL_addstring(&b, sb.GetString());
-    luaL_addstring(&b, " Keyword: ");
-    luaL_addstring(&b, validator.GetInvalidSchemaKeyword());
-    sb.Clear();
-    validator.GetInvalidDocumentPointer().StringifyUriFragment(sb);
-    luaL_addstring(&b, " DocumentURI: ");
-    luaL_addstring(&b, sb.GetString());
-    luaL_pushresult(&b);
-    sb.Clear();
     rj::Writer<rj::StringBuffer> w(sb);
-    validator.GetError().Accept(w);
+    validator->GetError().Accept(w);
     lua_pushstring(lua, sb.GetString());
     return 3; // ok, err, report
   } else {
@@ -301,12 +851,13 @@ static int rjson_find(lua_State *lua)
 {
   rjson *j = static_cast<rjson *>(luaL_checkudata(lua, 1, mozsvc_rjson));
   int start = 3;
-  rj::Value *v = static_cast<rj::Value *>(lua_touserdata(lua, 2));
-  if (!v) {
+  rj::Value *v = NULL;
+  if (lua_type(lua, 2) == LUA_TLIGHTUSERDATA) {
+    v = j->handles->Get(lua_touserdata(lua, 2));
+    if (!v) return luaL_error(lua, "invalid value");
+  } else {
     v = j->doc ? j->doc : j->val;
     start = 2;
-  } else if (j->refs->find(v) == j->refs->end()) {
-    return luaL_error(lua, "invalid value");
   }
 
   int n = lua_gettop(lua);
@@ -318,7 +869,9 @@ static int rjson_find(lua_State *lua)
           lua_pushnil(lua);
           return 1;
         }
-        rj::Value::MemberIterator itr = v->FindMember(lua_tostring(lua, i));
+        size_t len;
+        const char *key = lua_tolstring(lua, i, &len);
+        rj::Value::MemberIterator itr = find_member(j, v, key, len, 0);
         if (itr == v->MemberEnd()) {
           lua_pushnil(lua);
           return 1;
@@ -326,6 +879,17 @@ static int rjson_find(lua_State *lua)
         v = &itr->value;
       }
       break;
+    case LUA_TUSERDATA:
+      {
+        rjson_path *p = static_cast<rjson_path *>
+            (luaL_checkudata(lua, i, mozsvc_rjson_path));
+        v = find_path(j, v, p);
+        if (!v) {
+          lua_pushnil(lua);
+          return 1;
+        }
+      }
+      break;
     case LUA_TNUMBER:
       {
         if (!v->IsArray()) {
@@ -345,8 +909,7 @@ static int rjson_find(lua_State *lua)
       return 1;
     }
   }
-  j->refs->insert(std::make_pair(v, false));
-  lua_pushlightuserdata(lua, v);
+  push_handle(lua, j, v);
   return 1;
 }
 
@@ -418,19 +981,16 @@ static int rjson_object_iter(lua_State *lua)
 {
   rjson_object_iterator *hoi = static_cast<rjson_object_iterator *>
       (lua_touserdata(lua, lua_upvalueindex(1)));
-  rj::Value *v = (rj::Value *)lua_touserdata(lua, lua_upvalueindex(2));
   rjson *j = (rjson *)lua_touserdata(lua, lua_upvalueindex(3));
 
-  if (j->refs->find(v) == j->refs->end()) {
+  if (!j->handles->Get(lua_touserdata(lua, lua_upvalueindex(2)))) {
     return luaL_error(lua, "iterator has been invalidated");
   }
 
   if (*hoi->it != *hoi->end) {
-    rj::Value *next = &(*hoi->it)->value;
-    j->refs->insert(std::make_pair(next, false));
     lua_pushlstring(lua, (*hoi->it)->name.GetString(),
                     (size_t)(*hoi->it)->name.GetStringLength());
-    lua_pushlightuserdata(lua, next);
+    push_handle(lua, j, &(*hoi->it)->value);
     ++*hoi->it;
   } else {
     lua_pushnil(lua);
@@ -444,18 +1004,16 @@ static int rjson_array_iter(lua_State *lua)
 {
   rj::SizeType it = (rj::SizeType)lua_tonumber(lua, lua_upvalueindex(1));
   rj::SizeType end = (rj::SizeType)lua_tonumber(lua, lua_upvalueindex(2));
-  rj::Value *v = (rj::Value *)lua_touserdata(lua, lua_upvalueindex(3));
   rjson *j = (rjson *)lua_touserdata(lua, lua_upvalueindex(4));
+  rj::Value *v = j->handles->Get(lua_touserdata(lua, lua_upvalueindex(3)));
 
-  if (j->refs->find(v) == j->refs->end()) {
+  if (!v) {
     return luaL_error(lua, "iterator has been invalidated");
   }
 
   if (it != end) {
-    rj::Value *next = &(*v)[it];
-    j->refs->insert(std::make_pair(next, false));
     lua_pushnumber(lua, (lua_Number)it);
-    lua_pushlightuserdata(lua, next);
+    push_handle(lua, j, &(*v)[it]);
 
     ++it;
     lua_pushnumber(lua, (lua_Number)it);
@@ -468,36 +1026,114 @@ static int rjson_array_iter(lua_State *lua)
 }
 
 
+static void push_primitive(lua_State *lua, rj::Value *v, const char *fname)
+{
+  switch (v->GetType()) {
+  case rj::kStringType:
+    lua_pushlstring(lua, v->GetString(), (size_t)v->GetStringLength());
+    break;
+  case rj::kNumberType:
+    lua_pushnumber(lua, (lua_Number)v->GetDouble());
+    break;
+  case rj::kFalseType:
+  case rj::kTrueType:
+    lua_pushboolean(lua, v->GetBool());
+    break;
+  case rj::kObjectType:
+    luaL_error(lua, "%s() not allowed on an object", fname);
+    break;
+  case rj::kArrayType:
+    luaL_error(lua, "%s() not allowed on an array", fname);
+    break;
+  default:
+    lua_pushnil(lua);
+    break;
+  }
+}
+
+
 static int rjson_value(lua_State *lua)
 {
-  rj::Value *v = check_value(lua);
-  if (!v) {
+  rj::Value *v = check_value(lua);
+  if (!v) {
+    lua_pushnil(lua);
+    return 1;
+  }
+  push_primitive(lua, v, "value");
+  return 1;
+}
+
+
+static rjson_path* to_path(lua_State *lua, int idx)
+{
+  void *p = lua_touserdata(lua, idx);
+  if (p && lua_type(lua, idx) == LUA_TUSERDATA && lua_getmetatable(lua, idx)) {
+    luaL_getmetatable(lua, mozsvc_rjson_path);
+    bool match = lua_rawequal(lua, -1, -2) != 0;
+    lua_pop(lua, 2);
+    if (match) return static_cast<rjson_path *>(p);
+  }
+  return NULL;
+}
+
+
+// pushes the value of the spec entry at idx: a path or a {path, default} table
+static void push_spec_value(lua_State *lua, rjson *j, rj::Value *root, int idx)
+{
+  rjson_path *p;
+  bool has_default = lua_type(lua, idx) == LUA_TTABLE;
+  if (has_default) {
+    lua_rawgeti(lua, idx, 1);
+    p = to_path(lua, -1);
+    lua_pop(lua, 1); // still referenced by the spec entry
+  } else {
+    p = to_path(lua, idx);
+  }
+  if (!p) {
+    luaL_error(lua, "values() spec entries must be a path or {path, default}");
+  }
+
+  rj::Value *v = find_path(j, root, p);
+  if (!v || v->IsNull()) {
+    if (has_default) {
+      lua_rawgeti(lua, idx, 2);
+    } else {
+      lua_pushnil(lua);
+    }
+    return;
+  }
+  push_primitive(lua, v, "values");
+}
+
+
+static int rjson_values(lua_State *lua)
+{
+  int n = lua_gettop(lua);
+  luaL_argcheck(lua, n >= 2 && n <= 3, 0, "invalid number of arguments");
+  rjson *j = static_cast<rjson *>(luaL_checkudata(lua, 1, mozsvc_rjson));
+  luaL_checktype(lua, 2, LUA_TTABLE);
+  rj::Value *root = j->doc ? j->doc : j->val;
+
+  if (n == 3) {
+    luaL_checktype(lua, 3, LUA_TTABLE);
     lua_pushnil(lua);
+    while (lua_next(lua, 2) != 0) {
+      lua_pushvalue(lua, -2);
+      push_spec_value(lua, j, root, lua_gettop(lua) - 1);
+      lua_rawset(lua, 3);
+      lua_pop(lua, 1);
+    }
     return 1;
   }
 
-  switch (v->GetType()) {
-  case rj::kStringType:
-    lua_pushlstring(lua, v->GetString(), (size_t)v->GetStringLength());
-    break;
-  case rj::kNumberType:
-    lua_pushnumber(lua, (lua_Number)v->GetDouble());
-    break;
-  case rj::kFalseType:
-  case rj::kTrueType:
-    lua_pushboolean(lua, v->GetBool());
-    break;
-  case rj::kObjectType:
-    return luaL_error(lua, "value() not allowed on an object");
-    break;
-  case rj::kArrayType:
-    return luaL_error(lua, "value() not allowed on an array");
-    break;
-  default:
-    lua_pushnil(lua);
-    break;
+  int cnt = static_cast<int>(lua_objlen(lua, 2));
+  luaL_checkstack(lua, cnt + 1, "too many values");
+  for (int i = 1; i <= cnt; ++i) {
+    lua_rawgeti(lua, 2, i);
+    push_spec_value(lua, j, root, lua_gettop(lua));
+    lua_replace(lua, -2);
   }
-  return 1;
+  return cnt;
 }
 
 
@@ -508,6 +1144,7 @@ static int rjson_iter(lua_State *lua)
     lua_pushnil(lua);
     return 1;
   }
+  rjson *j = static_cast<rjson *>(lua_touserdata(lua, 1));
 
   switch (v->GetType()) {
   case rj::kObjectType:
@@ -523,7 +1160,7 @@ static int rjson_iter(lua_State *lua)
       }
       *hoi->it = v->MemberBegin();
       *hoi->end = v->MemberEnd();
-      lua_pushlightuserdata(lua, (void *)v);
+      push_handle(lua, j, v);
       lua_pushvalue(lua, 1);
       lua_pushcclosure(lua, rjson_object_iter, 3);
     }
@@ -532,7 +1169,7 @@ static int rjson_iter(lua_State *lua)
     {
       lua_pushnumber(lua, 0);
       lua_pushnumber(lua, (lua_Number)v->Size());
-      lua_pushlightuserdata(lua, (void *)v);
+      push_handle(lua, j, v);
       lua_pushvalue(lua, 1);
       lua_pushcclosure(lua, rjson_array_iter, 4);
     }
@@ -548,16 +1185,17 @@ static int rjson_iter(lua_State *lua)
 static rj::Value* remove_value(lua_State *lua, bool shallow)
 {
   rjson *j = static_cast<rjson *>(luaL_checkudata(lua, 1, mozsvc_rjson));
-  rj::Value *v = static_cast<rj::Value *>(lua_touserdata(lua, 2));
+  rj::Value *v = NULL;
   rj::Value *rv = NULL;
 
   int n = lua_gettop(lua);
   int start = 3;
-  if (!v) {
+  if (lua_type(lua, 2) == LUA_TLIGHTUSERDATA) {
+    v = j->handles->Get(lua_touserdata(lua, 2));
+    if (!v) luaL_error(lua, "invalid value");
+  } else {
     start = 2;
     v = j->doc ? j->doc : j->val;
-  } else if (j->refs->find(v) == j->refs->end()) {
-    luaL_error(lua, "invalid value");
   }
   if (n == start - 1) {
     luaL_error(lua, "cannot remove the root");
@@ -570,16 +1208,16 @@ static rj::Value* remove_value(lua_State *lua, bool shallow)
         if (!v->IsObject()) {
           return rv;
         }
-        rj::Value::MemberIterator itr = v->FindMember(lua_tostring(lua, i));
+        size_t len;
+        const char *key = lua_tolstring(lua, i, &len);
+        rj::Value::MemberIterator itr = find_member(j, v, key, len, 0);
         if (itr == v->MemberEnd()) {
           return rv;
         }
         if (i == n) {
-          j->refs->erase(&itr->value);
+          j->handles->Erase(&itr->value);
+          j->index->Clear(); // member offsets and value addresses are changing
           rv = new rj::Value;
-          if (shallow) {
-            j->refs->insert(std::make_pair(rv, true));
-          }
           *rv = itr->value; // move the value out replacing the original with NULL
           v->RemoveMember(itr);
         } else {
@@ -597,11 +1235,9 @@ static rj::Value* remove_value(lua_State *lua, bool shallow)
           return rv;
         }
         if (i == n) {
-          j->refs->erase(&(*v)[idx]);
+          j->handles->Erase(&(*v)[idx]);
+          j->index->Clear();
           rv = new rj::Value;
-          if (shallow) {
-            j->refs->insert(std::make_pair(rv, true));
-          }
           *rv = (*v)[idx]; // move the value out replacing the original with NULL
           v->Erase(v->Begin() + idx);
         } else {
@@ -628,17 +1264,17 @@ static int rjson_remove(lua_State *lua)
   nv->mpa = new rj::MemoryPoolAllocator<>;
   nv->doc = NULL;
   nv->val = new rj::Value(*v, *nv->mpa); // deep copy
-  nv->refs = new std::unordered_map<rj::Value *, bool>;
+  nv->handles = new HandleTable;
+  nv->index = new MemberIndex;
   init_rjson_buffer(&nv->insitu);
   luaL_getmetatable(lua, mozsvc_rjson);
   lua_setmetatable(lua, -2);
   delete(v);
 
-  if (!nv->val || !nv->refs) {
+  if (!nv->val || !nv->handles) {
     lua_pushstring(lua, "memory allocation failed");
     return lua_error(lua);
   }
-  nv->refs->insert(std::make_pair(nv->val, false));
   return 1;
 }
 
@@ -650,32 +1286,432 @@ static int rjson_remove_shallow(lua_State *lua)
     lua_pushnil(lua);
     return 1;
   }
-  lua_pushlightuserdata(lua, v);
+  // the detached value is owned (freed) by the handle table
+  push_handle(lua, static_cast<rjson *>(lua_touserdata(lua, 1)), v, true);
   return 1;
 }
 
 
+class ExtractHandler {
+public:
+  struct Node {
+    std::vector<std::pair<std::string, int> >   keys;
+    std::vector<std::pair<rj::SizeType, int> >  idx;
+    std::vector<int>                            targets;
+  };
+
+  struct Result {
+    int         type; // LUA_TNONE until found, LUA_TTABLE for an object/array
+    bool        b;
+    lua_Number  d;
+    std::string s;
+    size_t      start;
+    size_t      end;
+  };
+
+  ExtractHandler() : ms_(NULL), key_(-1), found_(0) { }
+
+  void Reset()
+  {
+    nodes_.clear();
+    nodes_.push_back(Node()); // root
+    results_.clear();
+    found_ = 0;
+  }
+
+  // returns the trie node for the next path element creating it if necessary
+  int AddKey(int n, const char *key, size_t len)
+  {
+    for (auto &c : nodes_[n].keys) {
+      if (c.first.size() == len && memcmp(c.first.data(), key, len) == 0) {
+        return c.second;
+      }
+    }
+    int cn = static_cast<int>(nodes_.size());
+    nodes_[n].keys.push_back(std::make_pair(std::string(key, len), cn));
+    nodes_.push_back(Node());
+    return cn;
+  }
+
+  int AddIndex(int n, rj::SizeType i)
+  {
+    for (auto &c : nodes_[n].idx) {
+      if (c.first == i) return c.second;
+    }
+    int cn = static_cast<int>(nodes_.size());
+    nodes_[n].idx.push_back(std::make_pair(i, cn));
+    nodes_.push_back(Node());
+    return cn;
+  }
+
+  void AddTarget(int n)
+  {
+    nodes_[n].targets.push_back(static_cast<int>(results_.size()));
+    results_.push_back(Result());
+    results_.back().type = LUA_TNONE;
+  }
+
+  template<unsigned flags>
+  bool Parse(const char *json, size_t len, rj::ParseResult &pr)
+  {
+    frames_.clear();
+    captures_.clear();
+    rj::MemoryStream ms(json, len);
+    ms_ = &ms;
+    rj::Reader reader;
+    pr = reader.Parse<flags>(ms, *this);
+    ms_ = NULL;
+    // terminated early once every path has been resolved
+    return !pr.IsError() || Done();
+  }
+
+  const std::vector<Result>& Results() const { return results_; }
+
+  bool Null() { return Primitive(LUA_TNIL, false, 0, NULL, 0); }
+  bool Bool(bool b) { return Primitive(LUA_TBOOLEAN, b, 0, NULL, 0); }
+  bool Int(int i) { return Primitive(LUA_TNUMBER, false, i, NULL, 0); }
+  bool Uint(unsigned u) { return Primitive(LUA_TNUMBER, false, u, NULL, 0); }
+  bool Int64(int64_t i) { return Primitive(LUA_TNUMBER, false, (lua_Number)i, NULL, 0); }
+  bool Uint64(uint64_t u) { return Primitive(LUA_TNUMBER, false, (lua_Number)u, NULL, 0); }
+  bool Double(double d) { return Primitive(LUA_TNUMBER, false, d, NULL, 0); }
+#if _BullseyeCoverage
+#pragma BullseyeCoverage off
+#endif
+  bool RawNumber(const char *, rj::SizeType, bool) { assert(false);return false; }
+#if _BullseyeCoverage
+#pragma BullseyeCoverage on
+#endif
+  bool String(const char *s, rj::SizeType len, bool)
+  {
+    return Primitive(LUA_TSTRING, false, 0, s, len);
+  }
+
+  bool Key(const char *s, rj::SizeType len, bool)
+  {
+    key_ = -1;
+    int n = frames_.back().node;
+    if (n < 0) return true;
+    for (auto &c : nodes_[n].keys) {
+      if (c.first.size() == len && memcmp(c.first.data(), s, len) == 0) {
+        key_ = c.second;
+        break;
+      }
+    }
+    return true;
+  }
+
+  bool StartObject() { return Start(false); }
+  bool EndObject(rj::SizeType) { return End(); }
+  bool StartArray() { return Start(true); }
+  bool EndArray(rj::SizeType) { return End(); }
+
+private:
+  struct Frame {
+    int           node;  // -1 when nothing below this container was requested
+    bool          array;
+    rj::SizeType  index;
+  };
+
+  struct Capture {
+    int     node;
+    size_t  start;
+    size_t  depth;
+  };
+
+  bool Done() const { return found_ == results_.size(); }
+
+  int Next()
+  {
+    if (frames_.empty()) return 0;
+    Frame &f = frames_.back();
+    if (f.node < 0) return -1;
+    if (f.array) {
+      rj::SizeType i = f.index++;
+      for (auto &c : nodes_[f.node].idx) {
+        if (c.first == i) return c.second;
+      }
+      return -1;
+    }
+    return key_;
+  }
+
+  bool Primitive(int type, bool b, lua_Number d, const char *s, size_t len)
+  {
+    int n = Next();
+    if (n < 0) return true;
+    for (int t : nodes_[n].targets) {
+      Result &r = results_[t];
+      if (r.type != LUA_TNONE) continue; // first occurrence wins
+      r.type = type;
+      r.b = b;
+      r.d = d;
+      if (s) r.s.assign(s, len);
+      ++found_;
+    }
+    return !Done();
+  }
+
+  bool Start(bool array)
+  {
+    int n = Next();
+    if (n >= 0) {
+      if (!nodes_[n].targets.empty()) {
+        Capture c = { n, ms_->Tell() - 1, frames_.size() + 1 };
+        captures_.push_back(c);
+      }
+      if (nodes_[n].keys.empty() && nodes_[n].idx.empty()) n = -1;
+    }
+    Frame f = { n, array, 0 };
+    frames_.push_back(f);
+    return true;
+  }
+
+  bool End()
+  {
+    size_t depth = frames_.size();
+    frames_.pop_back();
+    if (!captures_.empty() && captures_.back().depth == depth) {
+      Capture &c = captures_.back();
+      for (int t : nodes_[c.node].targets) {
+        Result &r = results_[t];
+        if (r.type != LUA_TNONE) continue;
+        r.type = LUA_TTABLE;
+        r.start = c.start;
+        r.end = ms_->Tell();
+        ++found_;
+      }
+      captures_.pop_back();
+      return !Done();
+    }
+    return true;
+  }
+
+  rj::MemoryStream      *ms_;
+  std::vector<Node>     nodes_;
+  std::vector<Result>   results_;
+  std::vector<Frame>    frames_;
+  std::vector<Capture>  captures_;
+  int                   key_;
+  size_t                found_;
+};
+
+
+typedef struct rjson_extractor
+{
+  ExtractHandler  *handler;
+  rjson_buffer    inflated;
+} rjson_extractor;
+
+
+static int extractor_gc(lua_State *lua)
+{
+  rjson_extractor *e = static_cast<rjson_extractor *>
+      (luaL_checkudata(lua, 1, mozsvc_rjson_extractor));
+  delete(e->handler);
+  free_rjson_buffer(&e->inflated);
+  return 0;
+}
+
+
+static void build_extract_paths(lua_State *lua, int idx, ExtractHandler *h)
+{
+  luaL_checktype(lua, idx, LUA_TTABLE);
+  h->Reset();
+  int n = (int)lua_objlen(lua, idx);
+  luaL_argcheck(lua, n > 0, idx, "at least one path is required");
+  for (int i = 1; i <= n; ++i) {
+    lua_rawgeti(lua, idx, i);
+    luaL_argcheck(lua, lua_type(lua, -1) == LUA_TTABLE, idx,
+                  "each path must be an array of keys/indices");
+    int node = 0;
+    int len = (int)lua_objlen(lua, -1);
+    for (int k = 1; k <= len; ++k) {
+      lua_rawgeti(lua, -1, k);
+      switch (lua_type(lua, -1)) {
+      case LUA_TSTRING:
+        {
+          size_t klen;
+          const char *key = lua_tolstring(lua, -1, &klen);
+          node = h->AddKey(node, key, klen);
+        }
+        break;
+      case LUA_TNUMBER:
+        {
+          lua_Number d = lua_tonumber(lua, -1);
+          luaL_argcheck(lua, d >= 0, idx, "array index must be >= 0");
+          node = h->AddIndex(node, static_cast<rj::SizeType>(d));
+        }
+        break;
+      default:
+        luaL_argerror(lua, idx, "path elements must be strings or numbers");
+        break;
+      }
+      lua_pop(lua, 1);
+    }
+    h->AddTarget(node);
+    lua_pop(lua, 1);
+  }
+}
+
+
+static int push_extract_results(lua_State *lua, const char *json,
+                                const ExtractHandler *h)
+{
+  const std::vector<ExtractHandler::Result> &results = h->Results();
+  int n = static_cast<int>(results.size());
+  luaL_checkstack(lua, n, "too many paths");
+  for (auto &r : results) {
+    switch (r.type) {
+    case LUA_TBOOLEAN:
+      lua_pushboolean(lua, r.b);
+      break;
+    case LUA_TNUMBER:
+      lua_pushnumber(lua, r.d);
+      break;
+    case LUA_TSTRING:
+      lua_pushlstring(lua, r.s.data(), r.s.size());
+      break;
+    case LUA_TTABLE:
+      {
+        rjson *j = static_cast<rjson *>(lua_newuserdata(lua, sizeof*j));
+        init_rjson(j);
+        luaL_getmetatable(lua, mozsvc_rjson);
+        lua_setmetatable(lua, -2);
+        if (!j->doc || !j->handles) {
+          return luaL_error(lua, "memory allocation failed");
+        }
+        // the span was already parsed so this cannot fail
+        rj::MemoryStream ms(json + r.start, r.end - r.start);
+        j->doc->ParseStream<rj::kParseDefaultFlags, rj::UTF8<> >(ms);
+      }
+      break;
+    default:
+      lua_pushnil(lua);
+      break;
+    }
+  }
+  return n;
+}
+
+
+static void extract_json(lua_State *lua, rjson_extractor *e, const char *json,
+                         size_t len, bool validate, bool stop_when_done)
+{
+  rj::ParseResult pr;
+  bool ok;
+  if (validate) {
+    if (stop_when_done) {
+      ok = e->handler->Parse < rj::kParseValidateEncodingFlag | rj::kParseStopWhenDoneFlag > (json, len, pr);
+    } else {
+      ok = e->handler->Parse<rj::kParseValidateEncodingFlag>(json, len, pr);
+    }
+  } else {
+    if (stop_when_done) {
+      ok = e->handler->Parse<rj::kParseStopWhenDoneFlag>(json, len, pr);
+    } else {
+      ok = e->handler->Parse<rj::kParseDefaultFlags>(json, len, pr);
+    }
+  }
+  if (!ok) {
+    luaL_error(lua, "failed to parse offset:%f %s", (lua_Number)pr.Offset(),
+               rj::GetParseError_En(pr.Code()));
+  }
+}
+
+
+static int rjson_extract(lua_State *lua)
+{
+  rjson_extractor *e = static_cast<rjson_extractor *>
+      (lua_touserdata(lua, lua_upvalueindex(1)));
+  size_t len;
+  const char *json = luaL_checklstring(lua, 1, &len);
+  bool validate = false;
+  int t = lua_type(lua, 3);
+  if (t == LUA_TNONE || t == LUA_TNIL || t == LUA_TBOOLEAN) {
+    validate = lua_toboolean(lua, 3);
+  } else {
+    luaL_typerror(lua, 3, "boolean");
+  }
+  build_extract_paths(lua, 2, e->handler);
+  extract_json(lua, e, json, len, validate, false);
+  return push_extract_results(lua, json, e->handler);
+}
+
+
 #ifdef LUA_SANDBOX
 #ifdef HAVE_ZLIB
+static const size_t gzip_max_ratio = 1032; // deflate's maximum compression
+
+// uncompressed size from the gzip trailer (modulo 2^32), 0 if unavailable
+static size_t gzip_size(const char *s, size_t s_len)
+{
+  if (s_len < 18) return 0;
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(s + s_len - 4);
+  return (size_t)p[0] | (size_t)p[1] << 8 | (size_t)p[2] << 16
+      | (size_t)p[3] << 24;
+}
+
+
+static bool reserve_buffer(rjson_buffer *b, size_t len)
+{
+  if (b->capacity < len) {
+    unsigned char *tmp = static_cast<unsigned char *>(realloc(b->buf, len));
+    if (!tmp) return false;
+    b->buf = tmp;
+    b->capacity = len;
+  }
+  return true;
+}
+
+
+#ifdef HAVE_LIBDEFLATE
+// true when the inflated size is known up front and libdeflate can be used
+static bool gzip_fast_path(const char *s, size_t s_len, size_t max_len)
+{
+  size_t size = gzip_size(s, s_len);
+  return size && size / gzip_max_ratio <= s_len && (!max_len || size <= max_len);
+}
+#endif
+
+
 bool ungzip(const char *s, size_t s_len, size_t max_len, rjson_buffer *b)
 {
   if (!s || (max_len && s_len > max_len)) {
     return false;
   }
 
-  size_t len = s_len * 2;
+#ifdef HAVE_LIBDEFLATE
+  if (gzip_fast_path(s, s_len, max_len)) {
+    size_t size = gzip_size(s, s_len);
+    if (!b->ld) b->ld = libdeflate_alloc_decompressor();
+    if (b->ld && reserve_buffer(b, size + 1)) {
+      size_t actual;
+      enum libdeflate_result r = libdeflate_gzip_decompress(b->ld, s, s_len,
+                                                            b->buf, size,
+                                                            &actual);
+      if (r == LIBDEFLATE_SUCCESS) {
+        b->buf[actual] = 0;
+        b->len = actual;
+        return true;
+      }
+      if (r == LIBDEFLATE_BAD_DATA) return false;
+      // the trailer size was wrong, let zlib grow the buffer
+    }
+  }
+#endif
+
+  // size the buffer from the gzip trailer when it is plausible so the payload
+  // is normally inflated in a single pass (and then parsed in place)
+  size_t len = gzip_size(s, s_len);
+  if (len < s_len || len / gzip_max_ratio > s_len || (max_len && len > max_len)) {
+    len = s_len * 2;
+  }
   if (max_len && len > max_len) {
     len = max_len;
   }
   b->len = 0;
-  if (b->capacity < len) {
-    unsigned char *tmp = static_cast<unsigned char *>(realloc(b->buf, len));
-    if (tmp) {
-      b->buf = tmp;
-      b->capacity = len;
-    } else {
-      return false;
-    }
+  if (!reserve_buffer(b, len + 1)) { // + 1 for the terminator
+    return false;
   }
 
   z_stream strm;
@@ -684,7 +1720,7 @@ bool ungzip(const char *s, size_t s_len, size_t max_len, rjson_buffer *b)
   strm.opaque     = Z_NULL;
   strm.avail_in   = s_len;
   strm.next_in    = (unsigned char *)s;
-  strm.avail_out  = b->capacity;
+  strm.avail_out  = len; // a reused buffer may be larger than max_len
   strm.next_out   = b->buf;
 
   int ret = inflateInit2(&strm, 16 + MAX_WBITS);
@@ -694,19 +1730,16 @@ bool ungzip(const char *s, size_t s_len, size_t max_len, rjson_buffer *b)
 
   do {
     if (ret == Z_BUF_ERROR) {
-      if (max_len && b->capacity == max_len) {
+      if (max_len && len == max_len) {
         ret = Z_MEM_ERROR;
         break;
       }
-      len = b->capacity * 2;
+      len *= 2;
       if (max_len && len > max_len) {
         len = max_len;
       }
-      unsigned char *tmp = static_cast<unsigned char *>(realloc(b->buf, len));
-      if (tmp) {
-        b->buf = tmp;
-        b->capacity = len;
-        strm.avail_out = b->capacity - strm.total_out;
+      if (reserve_buffer(b, len + 1)) {
+        strm.avail_out = len - strm.total_out;
         strm.next_out = b->buf + strm.total_out;
       } else {
         ret = Z_MEM_ERROR;
@@ -720,6 +1753,7 @@ bool ungzip(const char *s, size_t s_len, size_t max_len, rjson_buffer *b)
   if (ret != Z_STREAM_END) {
     return false;
   }
+  b->buf[strm.total_out] = 0;
   b->len = strm.total_out;
   return true;
 }
@@ -763,7 +1797,7 @@ static int rjson_make_field(lua_State *lua)
   }
 
   lua_createtable(lua, 0, 3);
-  lua_pushlightuserdata(lua, (void *)v);
+  push_handle(lua, static_cast<rjson *>(lua_touserdata(lua, 1)), v);
   lua_setfield(lua, -2, "value");
   lua_pushvalue(lua, 1);
   lua_setfield(lua, -2, "userdata");
@@ -778,14 +1812,16 @@ static int output_rjson(lua_State *lua)
   lsb_output_buffer *ob = static_cast<lsb_output_buffer *>
       (lua_touserdata(lua, -1));
   rjson *j = static_cast<rjson *>(lua_touserdata(lua, -2));
-  rj::Value *v = static_cast<rj::Value *>(lua_touserdata(lua, -3));
+  void *h = lua_touserdata(lua, -3);
   if (!(ob && j)) {
     return 1;
   }
-  if (!v) {
+  rj::Value *v;
+  if (!h) {
     v = j->doc ? j->doc : j->val;
   } else {
-    if (j->refs->find(v) == j->refs->end()) {
+    v = j->handles->Get(h);
+    if (!v) {
       return 1;
     }
   }
@@ -796,16 +1832,16 @@ static int output_rjson(lua_State *lua)
 }
 
 
-static lsb_const_string read_message(lua_State *lua, int idx,
+static lsb_const_string read_message(lua_State *lua, int idx, int fidx,
                                      const lsb_heka_message *m)
 {
   lsb_const_string ret = { NULL, 0 };
   size_t field_len;
   const char *field = luaL_checklstring(lua, idx, &field_len);
-  int fi = (int)luaL_optinteger(lua, idx + 1, 0);
-  luaL_argcheck(lua, fi >= 0, idx + 1, "field index must be >= 0");
-  int ai = (int)luaL_optinteger(lua, idx + 2, 0);
-  luaL_argcheck(lua, ai >= 0, idx + 2, "array index must be >= 0");
+  int fi = (int)luaL_optinteger(lua, fidx, 0);
+  luaL_argcheck(lua, fi >= 0, fidx, "field index must be >= 0");
+  int ai = (int)luaL_optinteger(lua, fidx + 1, 0);
+  luaL_argcheck(lua, ai >= 0, fidx + 1, "array index must be >= 0");
 
   if (strcmp(field, LSB_PAYLOAD) == 0) {
     if (m->payload.s) ret = m->payload;
@@ -823,23 +1859,39 @@ static lsb_const_string read_message(lua_State *lua, int idx,
 }
 
 
-static void json_decode(lua_State *lua, rjson *j, lsb_const_string *json,
-                        bool validate)
+// automatically handle gzipped strings
+// (optimization for Mozilla telemetry messages)
+static bool is_gzip(lsb_const_string *json)
+{
+  return json->len > 2 && json->s[0] == 0x1f
+      && (unsigned char)json->s[1] == 0x8b;
+}
+
+
+static unsigned char* inflate_json(lua_State *lua, lsb_const_string *json,
+                                   rjson_buffer *b)
 {
-  unsigned char *inflated = NULL;
 #ifdef HAVE_ZLIB
-  // automatically handle gzipped strings
-  // (optimization for Mozilla telemetry messages)
-  if (json->len > 2) {
-    if (json->s[0] == 0x1f && (unsigned char)json->s[1] == 0x8b) {
-      size_t mms = (size_t)lua_tointeger(lua, lua_upvalueindex(1));
-      if (!ungzip(json->s, json->len, mms, &j->insitu)) {
-        luaL_error(lua, "ungzip failed");
-      }
-      inflated = j->insitu.buf;
+  if (is_gzip(json)) {
+    size_t mms = (size_t)lua_tointeger(lua, lua_upvalueindex(1));
+    if (!ungzip(json->s, json->len, mms, b)) {
+      luaL_error(lua, "ungzip failed");
     }
+    return b->buf;
   }
+#else
+  (void)lua;
+  (void)json;
+  (void)b;
 #endif
+  return NULL;
+}
+
+
+static void json_decode(lua_State *lua, rjson *j, lsb_const_string *json,
+                        bool validate, rjson_schema *hs)
+{
+  unsigned char *inflated = inflate_json(lua, json, &j->insitu);
 
   if (!inflated) {
     size_t len = json->len + 1;
@@ -858,7 +1910,14 @@ static void json_decode(lua_State *lua, rjson *j, lsb_const_string *json,
   }
 
   bool err = false;
-  if (validate) {
+  if (hs) {
+    rj::InsituStringStream is(reinterpret_cast<char *>(j->insitu.buf));
+    if (validate) {
+      err = !parse_validating < rj::kParseInsituFlag | rj::kParseValidateEncodingFlag | rj::kParseStopWhenDoneFlag > (lua, j, is, hs);
+    } else {
+      err = !parse_validating < rj::kParseInsituFlag | rj::kParseStopWhenDoneFlag > (lua, j, is, hs);
+    }
+  } else if (validate) {
     if (j->doc->ParseInsitu < rj::kParseValidateEncodingFlag | rj::kParseStopWhenDoneFlag > (reinterpret_cast<char *>(j->insitu.buf)).HasParseError()) {
       err = true;
       lua_pushfstring(lua, "failed to parse offset:%f %s",
@@ -877,7 +1936,6 @@ static void json_decode(lua_State *lua, rjson *j, lsb_const_string *json,
   }
 
   if (err) lua_error(lua);
-  j->refs->insert(std::make_pair(j->doc, false));
 }
 
 
@@ -895,13 +1953,13 @@ static int rjson_parse_message(lua_State *lua)
 
   const lsb_heka_message *msg = NULL;
   if (lsb_heka_get_type(hsb) == 'i') {
-    luaL_argcheck(lua, n >= 2 && n <= 5, 0, "invalid number of arguments");
+    luaL_argcheck(lua, n >= 2 && n <= 6, 0, "invalid number of arguments");
     heka_stream_reader *hsr = static_cast<heka_stream_reader *>
         (luaL_checkudata(lua, 1, LSB_HEKA_STREAM_READER));
     msg = &hsr->msg;
     idx = 2;
   } else {
-    luaL_argcheck(lua, n >= 1 && n <= 4, 0, "invalid number of arguments");
+    luaL_argcheck(lua, n >= 1 && n <= 5, 0, "invalid number of arguments");
     const lsb_heka_message *hm = lsb_heka_get_message(hsb);
     if (!hm || !hm->raw.s) {
       return luaL_error(lua, "parse_message() no active message");
@@ -915,8 +1973,9 @@ static int rjson_parse_message(lua_State *lua)
   } else {
     luaL_typerror(lua, idx + 3, "boolean");
   }
+  rjson_schema *hs = check_schema(lua, idx + 4);
 
-  lsb_const_string json = read_message(lua, idx, msg);
+  lsb_const_string json = read_message(lua, idx, idx + 1, msg);
   if (!json.s) return luaL_error(lua, "field not found");
 
   rjson *j = static_cast<rjson *>(lua_newuserdata(lua, sizeof*j));
@@ -924,11 +1983,11 @@ static int rjson_parse_message(lua_State *lua)
   luaL_getmetatable(lua, mozsvc_rjson);
   lua_setmetatable(lua, -2);
 
-  if (!j->doc || !j->refs) {
+  if (!j->doc || !j->handles) {
     lua_pushstring(lua, "memory allocation failed");
     return lua_error(lua);
   }
-  json_decode(lua, j, &json, validate);
+  json_decode(lua, j, &json, validate, hs);
   return 1;
 }
 
@@ -949,20 +2008,20 @@ static int rjson_dparse_message(lua_State *lua)
   delete(j->val);
   j->val = NULL;
   j->insitu.len = 0;
-  delete_owned_refs(j->refs);
-  j->refs->clear();
+  j->handles->Clear();
+  j->index->Clear();
   j->mpa->Clear();
   j->doc->SetNull();
 
   const lsb_heka_message *msg = NULL;
   if (lsb_heka_get_type(hsb) == 'i') {
-    luaL_argcheck(lua, n >= 3 && n <= 6, 0, "invalid number of arguments");
+    luaL_argcheck(lua, n >= 3 && n <= 7, 0, "invalid number of arguments");
     heka_stream_reader *hsr = static_cast<heka_stream_reader *>
         (luaL_checkudata(lua, 2, LSB_HEKA_STREAM_READER));
     msg = &hsr->msg;
     idx = 3;
   } else {
-    luaL_argcheck(lua, n >= 2 && n <= 5, 0, "invalid number of arguments");
+    luaL_argcheck(lua, n >= 2 && n <= 6, 0, "invalid number of arguments");
     const lsb_heka_message *hm = lsb_heka_get_message(hsb);
     if (!hm || !hm->raw.s) {
       return luaL_error(lua, "parse_message() no active message");
@@ -976,14 +2035,66 @@ static int rjson_dparse_message(lua_State *lua)
   } else {
     luaL_typerror(lua, idx + 3, "boolean");
   }
+  rjson_schema *hs = check_schema(lua, idx + 4);
 
-  lsb_const_string json = read_message(lua, idx, msg);
+  lsb_const_string json = read_message(lua, idx, idx + 1, msg);
   if (!json.s) return luaL_error(lua, "field not found");
 
-  json_decode(lua, j, &json, validate);
+  json_decode(lua, j, &json, validate, hs);
   lua_pushvalue(lua, 1);
   return 1;
 }
+
+
+static int rjson_extract_message(lua_State *lua)
+{
+  lua_getfield(lua, LUA_REGISTRYINDEX, LSB_HEKA_THIS_PTR);
+  lsb_heka_sandbox *hsb =
+      static_cast<lsb_heka_sandbox *>(lua_touserdata(lua, -1));
+  lua_pop(lua, 1); // remove this ptr
+  if (!hsb) {
+    return luaL_error(lua, "extract_message() invalid " LSB_HEKA_THIS_PTR);
+  }
+  rjson_extractor *e = static_cast<rjson_extractor *>
+      (lua_touserdata(lua, lua_upvalueindex(2)));
+  int n = lua_gettop(lua);
+  int idx = 1;
+
+  const lsb_heka_message *msg = NULL;
+  if (lsb_heka_get_type(hsb) == 'i') {
+    luaL_argcheck(lua, n >= 3 && n <= 6, 0, "invalid number of arguments");
+    heka_stream_reader *hsr = static_cast<heka_stream_reader *>
+        (luaL_checkudata(lua, 1, LSB_HEKA_STREAM_READER));
+    msg = &hsr->msg;
+    idx = 2;
+  } else {
+    luaL_argcheck(lua, n >= 2 && n <= 5, 0, "invalid number of arguments");
+    const lsb_heka_message *hm = lsb_heka_get_message(hsb);
+    if (!hm || !hm->raw.s) {
+      return luaL_error(lua, "extract_message() no active message");
+    }
+    msg = hm;
+  }
+  bool validate = false;
+  int t = lua_type(lua, idx + 4);
+  if (t == LUA_TNONE || t == LUA_TNIL || t == LUA_TBOOLEAN) {
+    validate = lua_toboolean(lua, idx + 4);
+  } else {
+    luaL_typerror(lua, idx + 4, "boolean");
+  }
+  build_extract_paths(lua, idx + 1, e->handler);
+
+  lsb_const_string json = read_message(lua, idx, idx + 2, msg);
+  if (!json.s) return luaL_error(lua, "field not found");
+
+  unsigned char *inflated = inflate_json(lua, &json, &e->inflated);
+  if (inflated) {
+    json.s = reinterpret_cast<const char *>(inflated);
+    json.len = e->inflated.len;
+  }
+  extract_json(lua, e, json.s, json.len, validate, true);
+  return push_extract_results(lua, json.s, e->handler);
+}
 #endif
 
 static const struct luaL_reg schemalib_m[] =
@@ -1000,6 +2111,13 @@ static const struct luaL_reg iterlib_m[] =
 };
 
 
+static const struct luaL_reg extractorlib_m[] =
+{
+  { "__gc", extractor_gc },
+  { NULL, NULL }
+};
+
+
 static int rjson_version(lua_State *lua)
 {
   lua_pushstring(lua, DIST_VERSION);
@@ -1011,6 +2129,7 @@ static const struct luaL_reg rjsonlib_f[] =
 {
   { "parse_schema", rjson_parse_schema },
   { "parse", rjson_parse },
+  { "path", rjson_new_path },
   { "version", rjson_version },
   { NULL, NULL }
 };
@@ -1023,6 +2142,7 @@ static const struct luaL_reg rjsonlib_m[] =
   { "type", rjson_type },
   { "find", rjson_find },
   { "value", rjson_value },
+  { "values", rjson_values },
   { "iter", rjson_iter },
   { "size", rjson_size },
   { "remove", rjson_remove },
@@ -1051,6 +2171,15 @@ int luaopen_rjson(lua_State *lua)
   luaL_register(lua, NULL, iterlib_m);
   lua_pop(lua, 1);
 
+  luaL_newmetatable(lua, mozsvc_rjson_path);
+  lua_pop(lua, 1);
+
+  luaL_newmetatable(lua, mozsvc_rjson_extractor);
+  lua_pushvalue(lua, -1);
+  lua_setfield(lua, -2, "__index");
+  luaL_register(lua, NULL, extractorlib_m);
+  lua_pop(lua, 1);
+
   luaL_newmetatable(lua, mozsvc_rjson);
   lua_pushvalue(lua, -1);
   lua_setfield(lua, -2, "__index");
@@ -1082,5 +2211,31 @@ int luaopen_rjson(lua_State *lua)
     lua_pop(lua, 1); // remove LSB_CONFIG_TABLE
   }
 #endif
+
+  // scratch state shared by the extract functions
+  rjson_extractor *e = static_cast<rjson_extractor *>
+      (lua_newuserdata(lua, sizeof*e));
+  e->handler = new ExtractHandler;
+  init_rjson_buffer(&e->inflated);
+  luaL_getmetatable(lua, mozsvc_rjson_extractor);
+  lua_setmetatable(lua, -2);
+  if (!e->handler) {
+    return luaL_error(lua, "memory allocation failed");
+  }
+  lua_pushvalue(lua, -1);
+  lua_pushcclosure(lua, rjson_extract, 1);
+  lua_setfield(lua, -3, "extract");
+
+#ifdef LUA_SANDBOX
+  if (hsb) {
+    lua_getfield(lua, LUA_REGISTRYINDEX, LSB_CONFIG_TABLE);
+    lua_getfield(lua, -1, LSB_HEKA_MAX_MESSAGE_SIZE);
+    lua_pushvalue(lua, -3);
+    lua_pushcclosure(lua, rjson_extract_message, 2);
+    lua_setfield(lua, -4, "extract_message");
+    lua_pop(lua, 1); // remove LSB_CONFIG_TABLE
+  }
+#endif
+  lua_pop(lua, 1); // remove the extractor
   return 1;
 }
@@ -3,7 +3,9 @@
 -- file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
 require "rjson"
-assert(rjson.version() == "1.1.4", rjson.version())
+require "string"
+require "table"
+assert(rjson.version() == "1.8.0", rjson.version())
 
 schema_json = [[{
     "type":"object",
@@ -281,3 +283,151 @@ assert(doc)
 ok, err = pcall(doc.parse, doc, "{")
 assert(not ok) -- doc is now Null
 assert(nil == doc:find("main", "m1"))
+
+json = [[{"skip":{"a":{"b":9}},"a":{"c":[1,{"b":2}],"b":"hi"},"arr":[true,{"x":null,"y":[]}],"n":1.5}]]
+paths = {{"a", "b"}, {"a"}, {"arr", 1}, {"arr", 1, "x"}, {"missing"}, {"n"}, {"arr", 0}, {"arr", 1, "y"}}
+local b, a, a1, x, missing, n, a0, y = rjson.extract(json, paths)
+assert(b == "hi", tostring(b))
+assert(a:type() == "object")
+assert(2 == a:value(a:find("c", 1, "b")))
+assert(a1:size() == 2)
+assert(x == nil)
+assert(missing == nil)
+assert(n == 1.5, tostring(n))
+assert(a0 == true)
+assert(y:type() == "array" and y:size() == 0)
+
+local v = rjson.extract('"str"', {{}})
+assert(v == "str", tostring(v))
+v = rjson.extract('{"a":1} ', {{"a"}})
+assert(v == 1, tostring(v))
+
+ok, err = pcall(rjson.extract, json)
+assert(err == "bad argument #2 to '?' (table expected, got no value)", err)
+ok, err = pcall(rjson.extract, json, {})
+assert(err == "bad argument #2 to '?' (at least one path is required)", err)
+ok, err = pcall(rjson.extract, json, {"a"})
+assert(err == "bad argument #2 to '?' (each path must be an array of keys/indices)", err)
+ok, err = pcall(rjson.extract, json, {{true}})
+assert(err == "bad argument #2 to '?' (path elements must be strings or numbers)", err)
+ok, err = pcall(rjson.extract, json, {{-1}})
+assert(err == "bad argument #2 to '?' (array index must be >= 0)", err)
+ok, err = pcall(rjson.extract, json, {{"a"}}, "")
+assert(err == "bad argument #3 to '?' (boolean expected, got string)", err)
+ok, err = pcall(rjson.extract, "{", {{"a"}})
+assert(err == "failed to parse offset:1 Missing a name for object member.", err)
+ok, err = pcall(rjson.extract, '{"f\240o":"bar"}', {{"x"}}, true)
+assert(not ok, "UTF-8 validation failed")
+
+-- large objects are looked up through a hashed member index
+local t = {}
+for i = 1, 100 do t[#t + 1] = string.format('"k%d":{"v":%d}', i, i) end
+t[#t + 1] = '"k1":{"v":-1}' -- duplicate, the first member wins
+t[#t + 1] = '"a\\u0000b":1'
+json = "{" .. table.concat(t, ",") .. "}"
+doc = rjson.parse(json)
+for i = 1, 100 do
+    assert(i == doc:value(doc:find("k" .. i, "v")), i)
+end
+assert(nil == doc:find("k101"))
+assert(1 == doc:value(doc:find("a\0b")))
+assert(nil == doc:find("a"))
+
+p = rjson.path("k50", "v")
+assert(50 == doc:value(p))
+assert("number" == doc:type(p))
+assert(50 == doc:value(doc:find(p)))
+assert(50 == doc:value(doc:find(doc:find("k50"), rjson.path("v"))))
+assert(nil == doc:value(rjson.path("k50", 0)))
+assert(nil == doc:find(rjson.path("missing")))
+
+rv = doc:remove("k2")
+assert(2 == rv:value(rv:find("v")))
+assert(nil == doc:find("k2"))
+for i = 3, 100 do
+    assert(i == doc:value(doc:find("k" .. i, "v")), i)
+end
+assert(50 == doc:value(p))
+
+doc = rjson.parse('{"arr":[10,20,{"x":"y"}]}')
+assert("y" == doc:value(rjson.path("arr", 2, "x")))
+assert(20 == doc:value(rjson.path("arr", 1)))
+assert(nil == doc:value(rjson.path("arr", 3)))
+assert(nil == doc:value(rjson.path("arr", "x")))
+
+ok, err = pcall(rjson.path)
+assert(err == "bad argument #0 to '?' (invalid number of arguments)", err)
+ok, err = pcall(rjson.path, "a", -1)
+assert(err == "bad argument #2 to '?' (array index must be >= 0)", err)
+ok, err = pcall(rjson.path, "a", true)
+assert(err == "bad argument #2 to '?' (string or number expected, got boolean)", err)
+ok, err = pcall(doc.value, doc, rjson.parse("{}"))
+assert(err == "bad argument #2 to '?' (mozsvc.rjson_path expected, got userdata)", err)
+
+-- bulk value lookups
+doc = rjson.parse('{"a":{"b":"c", "n":null}, "arr":[10,20,{"x":"y"}], "t":true}')
+local spec = {
+    rjson.path("a", "b"),
+    {rjson.path("a", "n"), "dflt"},
+    {rjson.path("missing"), 7},
+    rjson.path("missing"),
+    rjson.path("arr", 1),
+    {rjson.path("t")},
+}
+local b, nv, m, m1, a1, t, extra = doc:values(spec)
+assert("c" == b, tostring(b))
+assert("dflt" == nv, tostring(nv))
+assert(7 == m, tostring(m))
+assert(nil == m1, tostring(m1))
+assert(20 == a1, tostring(a1))
+assert(true == t, tostring(t))
+assert(nil == extra)
+assert(0 == select("#", doc:values({})))
+
+local r = {}
+assert(r == doc:values({b = spec[1], m = spec[3], x = rjson.path("arr", 2, "x"), [5] = spec[5]}, r))
+assert("c" == r.b and 7 == r.m and "y" == r.x and 20 == r[5])
+
+ok, err = pcall(doc.values, doc, {rjson.path("a")})
+assert(err == "values() not allowed on an object", err)
+ok, err = pcall(doc.values, doc, {"a"})
+assert(err == "values() spec entries must be a path or {path, default}", err)
+ok, err = pcall(doc.values, doc, {{"a"}})
+assert(err == "values() spec entries must be a path or {path, default}", err)
+ok, err = pcall(doc.values, doc)
+assert(err == "bad argument #0 to '?' (invalid number of arguments)", err)
+ok, err = pcall(doc.values, doc, spec, true)
+assert(err == "bad argument #3 to '?' (table expected, got boolean)", err)
+
+-- value handles
+doc = rjson.parse(nested)
+main = doc:find("main")
+assert(main == doc:find("main"))
+m1 = doc:find(main, "m1")
+doc:remove("main", "m1")
+ok, err = pcall(doc.find, doc, m1)
+assert(err == "invalid value", err)
+assert("object" == doc:type(main))
+doc:parse(nested)
+ok, err = pcall(doc.value, doc, main)
+assert(err == "invalid value", err)
+assert(main ~= doc:find("main"))
+
+-- schema validation while parsing
+doc = rjson.parse([[{"Timestamp":0, "Type":"foo"}]], nil, schema)
+assert("foo" == doc:value(doc:find("Type")))
+ok, err = pcall(rjson.parse, [[{"Timestamp":0, "EnvVersion":"unknown"}]], nil, schema)
+assert(err == "failed to validate SchemaURI: #/properties/EnvVersion Keyword: pattern DocumentURI: #/EnvVersion", err)
+ok, err = pcall(rjson.parse, [[{"Timestamp":-1, "Type":]], true, schema)
+assert(err == "failed to validate SchemaURI: #/properties/Timestamp Keyword: minimum DocumentURI: #/Timestamp", err)
+ok, err = pcall(rjson.parse, [[{"Timestamp":0, "Type":]], nil, schema)
+assert(err:match("^failed to parse offset:"), err)
+ok, err = pcall(rjson.parse, "{}", nil, "schema")
+assert(err == "bad argument #3 to '?' (mozsvc.rjson_schema expected, got string)", err)
+
+ok, err = pcall(doc.parse, doc, [[{"Timestamp":"0"}]], nil, schema)
+assert(err == "failed to validate SchemaURI: #/properties/Timestamp Keyword: type DocumentURI: #/Timestamp", err)
+assert(nil == doc:find("Timestamp"))
+doc:parse([[{"Timestamp":10}]], nil, schema)
+assert(10 == doc:value(doc:find("Timestamp")))
+assert(doc:validate(schema))
@@ -36,6 +36,33 @@ assert(ok, doc)
 ok, doc = pcall(rjson.parse_message, hsr, "Fields[json]", nil, nil, true)
 assert(ok, doc)
 
+ok, doc = pcall(rjson.parse_message, hsr, "Fields[json]", nil, nil, nil, "foo")
+assert("bad argument #6 to '?' (mozsvc.rjson_schema expected, got string)" == doc, doc)
+
+ok, err = pcall(rjson.extract_message, hsr, "Fields[json]")
+assert("bad argument #0 to '?' (invalid number of arguments)" == err, err)
+foo, missing = rjson.extract_message(hsr, "Fields[json]", {{"foo"}, {"missing"}})
+assert("bar" == foo, tostring(foo))
+assert(nil == missing)
+ok, err = pcall(rjson.extract_message, hsr, "Fields[missing]", {{"foo"}})
+assert("field not found" == err, err)
+ok, err = pcall(rjson.extract_message, hsr, "Fields[json]", {{"foo"}}, nil, nil, "")
+assert("bad argument #6 to '?' (boolean expected, got string)" == err, err)
+
+valid_schema = rjson.parse_schema('{"type":"object","required":["foo"]}')
+invalid_schema = rjson.parse_schema('{"type":"object","required":["missing"]}')
+ok, doc = pcall(rjson.parse_message, hsr, "Fields[json]", nil, nil, nil, valid_schema)
+assert(ok, doc)
+assert("bar" == doc:value(doc:find("foo")))
+ok, err = pcall(rjson.parse_message, hsr, "Fields[json]", nil, nil, nil, invalid_schema)
+assert("failed to validate SchemaURI: # Keyword: required DocumentURI: #" == err, err)
+ok, err = pcall(doc.parse_message, doc, hsr, "Fields[json]", nil, nil, nil, invalid_schema)
+assert("failed to validate SchemaURI: # Keyword: required DocumentURI: #" == err, err)
+assert(nil == doc:find("foo"))
+ok, err = pcall(doc.parse_message, doc, hsr, "Fields[json]", nil, nil, true, valid_schema)
+assert(ok, err)
+assert("bar" == doc:value(doc:find("foo")))
+
 hsr:decode_message("\10\16\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\16\4\82\23\10\4\106\115\111\110\16\1\42\13\123\34\102\246\111\34\58\34\98\97\114\34\125")
 ok, doc = pcall(rjson.parse_message, hsr, "Fields[json]")
 assert(ok, doc)
@@ -65,6 +92,9 @@ if read_config("have_zlib") then
     assert(f.value == rv)
     assert(f.representation == "json")
 
+    values = rjson.extract_message(hsr, "Payload", {{"payload", "values"}})
+    assert(2 == values:value(values:find(1)))
+
     ok, json = pcall(rjson.parse_message, hsr, "Payload", nil, nil, true)
     assert(ok, json)
     assert(json:size() == 2, json:size())